@@ -0,0 +1,138 @@
+#include "dns_async_client.h"
+#include "dns_query.h"
+#include "dns_response.h"
+
+#include <iostream>
+
+
+DNSAsyncClient::DNSAsyncClient(asio::io_context& ioContext, const std::string& srvAddress, std::uint16_t srvPort)
+	: _ioContext(ioContext)
+	, _socket(ioContext, udp::v4())
+	, _srvEndpoint(asio::ip::make_address(srvAddress), srvPort)
+{
+
+}
+
+DNSAsyncClient::~DNSAsyncClient()
+{
+
+}
+
+std::shared_ptr<DNSAsyncClient::Lookup> DNSAsyncClient::createLookup(const std::string& name, DNSMessage::QType qtype)
+{
+	if (_lookups.size() >= MAX_LOOKUPS)
+	{
+		return nullptr;
+	}
+
+	// std::random_device is the system's CSPRNG (getrandom() or RDRAND)
+	std::uint16_t id = 0;
+	do
+	{
+		id = static_cast<std::uint16_t>(_random());
+	}
+	while (_lookups.count(id) != 0);
+
+	std::shared_ptr<Lookup> lookup(std::make_shared<Lookup>(_ioContext));
+	lookup->_id = id;
+	lookup->_name = name;
+	lookup->_qtype = qtype;
+
+	DNSQuery dnsQuery;
+	dnsQuery.setId(lookup->_id);
+	if (_useRecursion)
+	{
+		dnsQuery.setUseRecursion(_useRecursion);
+	}
+	dnsQuery.setType(qtype);
+	dnsQuery.setQCount(1);
+	dnsQuery.setName(name);
+	lookup->_query = dnsQuery.encode();
+
+	_lookups.emplace(lookup->_id, lookup);
+	return lookup;
+}
+
+void DNSAsyncClient::removeLookup(const std::shared_ptr<Lookup>& lookup)
+{
+	_lookups.erase(lookup->_id);
+	if (_lookups.empty() && _receiving)
+	{
+		// nothing to wait for, don't keep io_context busy
+		std::error_code ec;
+		_socket.cancel(ec);
+	}
+}
+
+void DNSAsyncClient::receive()
+{
+	if (_receiving)
+	{
+		return;
+	}
+
+	_receiving = true;
+	_socket.async_receive_from(asio::buffer(_recvBuffer), _recvEndpoint,
+		[this](std::error_code ec, std::size_t sz)
+		{
+			_receiving = false;
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
+				{
+					std::cerr << __FILE__ << ':' << __LINE__ << " Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+				}
+			}
+			else if (_recvEndpoint == _srvEndpoint)
+			{
+				processResponse(sz);
+			}
+
+			// a new lookup may be started, while cancelled receive was completing
+
+			if (!_lookups.empty())
+			{
+				receive();
+			}
+		});
+}
+
+void DNSAsyncClient::processResponse(std::size_t size)
+{
+	DNSResponse dnsResponse;
+	try
+	{
+		dnsResponse.decode(_recvBuffer.data(), size);
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << __FILE__ << ':' << __LINE__ << " Exception: " << ex.what() << std::endl;
+		return;
+	}
+
+	auto it = _lookups.find(dnsResponse.getId());
+	if (it == _lookups.end() || it->second->_answered || !dnsResponse.getFlagQR()
+		|| !dnsResponse.hasQuestion(it->second->_name, static_cast<std::uint16_t>(it->second->_qtype), 1))
+	{
+		std::cout << "Received unexpected response, ID = " << std::hex << dnsResponse.getId() << std::dec << std::endl;
+		return;
+	}
+
+	Lookup& lookup = *it->second;
+	lookup._answered = true;
+	switch (dnsResponse.getRcode())
+	{
+	case DNSResponse::Rcode::NoError:
+		lookup._answers = dnsResponse.getAnswers();
+	break;
+
+	case DNSResponse::Rcode::NameError:
+		lookup._ec = asio::error::host_not_found;
+	break;
+
+	default:
+		lookup._ec = asio::error::no_recovery;
+	}
+
+	lookup._timer.cancel();
+}
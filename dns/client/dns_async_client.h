@@ -0,0 +1,187 @@
+#pragma once
+
+#include <cstdint>
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <asio.hpp>
+
+#include "dns_message.h"
+
+using asio::ip::udp;
+
+
+/*
+ Non-blocking counterpart of DNSClient.
+ Every lookup is a stackless coroutine (asio::coroutine), so thousands of
+ concurrent lookups cost a few hundred bytes each and run on one io_context.
+ All of them share one UDP socket. Message IDs are random and a response
+ is accepted only from the server, for a lookup in progress with its ID
+ and with the same question, so a spoofed response has to guess all that.
+
+ async_resolve() accepts any asio completion token: a callback,
+ asio::use_future or an awaitable token, when the toolchain supports it.
+ The client isn't thread-safe, its io_context has to be run by one thread.
+ */
+class DNSAsyncClient final
+{
+public:
+	using Answers = std::vector<std::string>;
+
+public:
+	DNSAsyncClient(const DNSAsyncClient&) = delete;
+	DNSAsyncClient& operator=(const DNSAsyncClient&) = delete;
+
+	DNSAsyncClient(asio::io_context& ioContext, const std::string& srvAddress, std::uint16_t srvPort);
+	~DNSAsyncClient();
+
+	void setUseRecursion(bool useRecursion)
+	{
+		_useRecursion = useRecursion;
+	}
+
+	void setTimeout(std::chrono::milliseconds timeout)
+	{
+		_timeout = timeout;
+	}
+
+	template <typename CompletionToken>
+	ASIO_INITFN_RESULT_TYPE(CompletionToken, void (std::error_code, Answers))
+	async_resolve(const std::string& name, DNSMessage::QType qtype, CompletionToken&& token);
+
+private:
+	struct Lookup
+	{
+		explicit Lookup(asio::io_context& ioContext)
+			: _timer(ioContext)
+		{
+		}
+
+		std::uint16_t _id = 0;
+		std::string _name;
+		DNSMessage::QType _qtype = DNSMessage::QType::A;
+		DNSMessage::Buffer _query;
+		asio::steady_timer _timer;
+		bool _answered = false;
+		std::error_code _ec;
+		Answers _answers;
+	};
+
+	template <typename Handler>
+	class ResolveOp;
+
+	std::shared_ptr<Lookup> createLookup(const std::string& name, DNSMessage::QType qtype);
+	void removeLookup(const std::shared_ptr<Lookup>& lookup);
+	void receive();
+	void processResponse(std::size_t size);
+
+private:
+	// at most half of IDs are in use, so a free one is drawn in two tries on average
+	static const std::size_t MAX_LOOKUPS = 0x8000;
+
+	asio::io_context& _ioContext;
+	udp::socket _socket;
+	udp::endpoint _srvEndpoint;
+	bool _useRecursion = false;
+	std::chrono::milliseconds _timeout{2000};
+
+	std::random_device _random;
+	std::unordered_map<std::uint16_t, std::shared_ptr<Lookup>> _lookups;
+	bool _receiving = false;
+	std::array<std::uint8_t, 512> _recvBuffer;
+	udp::endpoint _recvEndpoint;
+};
+
+
+// The operation reports the executor and the allocator associated with
+// the user's handler, so the intermediate steps run through the same
+// executor (e.g. a strand) and use the same memory as the final handler.
+template <typename Handler>
+class DNSAsyncClient::ResolveOp : asio::coroutine
+{
+public:
+	using executor_type = asio::associated_executor_t<Handler, asio::io_context::executor_type>;
+	using allocator_type = asio::associated_allocator_t<Handler>;
+
+public:
+	ResolveOp(DNSAsyncClient& client, const std::shared_ptr<Lookup>& lookup, Handler&& handler)
+		: _client(client)
+		, _lookup(lookup)
+		, _handler(std::move(handler))
+	{
+	}
+
+	executor_type get_executor() const noexcept
+	{
+		return asio::get_associated_executor(_handler, _client._ioContext.get_executor());
+	}
+
+	allocator_type get_allocator() const noexcept
+	{
+		return asio::get_associated_allocator(_handler);
+	}
+
+	void operator()(std::error_code ec = std::error_code(), std::size_t sz = 0)
+	{
+		ASIO_CORO_REENTER (*this)
+		{
+			ASIO_CORO_YIELD _client._socket.async_send_to(
+				asio::buffer(_lookup->_query.data(), _lookup->_query.size()), _client._srvEndpoint, std::move(*this));
+			if (ec)
+			{
+				_lookup->_ec = ec;
+			}
+			else
+			{
+				// the receiver cancels the timer when the response is arrived
+				_client.receive();
+				_lookup->_timer.expires_after(_client._timeout);
+				ASIO_CORO_YIELD _lookup->_timer.async_wait(std::move(*this));
+				if (!_lookup->_answered)
+				{
+					_lookup->_ec = asio::error::timed_out;
+				}
+			}
+
+			_client.removeLookup(_lookup);
+			_handler(_lookup->_ec, std::move(_lookup->_answers));
+		}
+	}
+
+private:
+	DNSAsyncClient& _client;
+	std::shared_ptr<Lookup> _lookup;
+	Handler _handler;
+};
+
+
+template <typename CompletionToken>
+ASIO_INITFN_RESULT_TYPE(CompletionToken, void (std::error_code, DNSAsyncClient::Answers))
+DNSAsyncClient::async_resolve(const std::string& name, DNSMessage::QType qtype, CompletionToken&& token)
+{
+	using Signature = void (std::error_code, Answers);
+	asio::async_completion<CompletionToken, Signature> init(token);
+	using Handler = typename asio::async_completion<CompletionToken, Signature>::completion_handler_type;
+
+	std::shared_ptr<Lookup> lookup(createLookup(name, qtype));
+	if (!lookup)
+	{
+		const auto executor = asio::get_associated_executor(init.completion_handler, _ioContext.get_executor());
+		asio::post(asio::bind_executor(executor, [handler = std::move(init.completion_handler)]() mutable
+			{
+				handler(asio::error::no_buffer_space, Answers());
+			}));
+	}
+	else
+	{
+		ResolveOp<Handler>(*this, lookup, std::move(init.completion_handler))();
+	}
+
+	return init.result.get();
+}
@@ -0,0 +1,400 @@
+#include "dns_bench.h"
+#include "dns_async_client.h"
+#include "dns_query.h"
+#include "dns_response.h"
+
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <openssl/ssl.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <asio/ssl.hpp>
+
+using asio::ip::tcp;
+
+namespace
+{
+
+const std::chrono::milliseconds TIMEOUT{2000};
+
+DNSMessage::Buffer makeQuery(std::uint16_t id, const std::string& name)
+{
+	DNSQuery dnsQuery;
+	dnsQuery.setId(id);
+	dnsQuery.setType(DNSMessage::QType::A);
+	dnsQuery.setQCount(1);
+	dnsQuery.setName(name);
+	return dnsQuery.encode();
+}
+
+bool checkResponse(const std::uint8_t* data, std::size_t size, std::uint16_t id, const std::string& name)
+{
+	DNSResponse dnsResponse;
+	try
+	{
+		dnsResponse.decode(data, size);
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+	return dnsResponse.getId() == id && dnsResponse.getRcode() == DNSResponse::Rcode::NoError
+		&& dnsResponse.hasQuestion(name, static_cast<std::uint16_t>(DNSMessage::QType::A), 1);
+}
+
+void report(const char* method, std::size_t lookupsCount, std::size_t errors, std::chrono::steady_clock::time_point started)
+{
+	const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+	std::cout << method << ": " << lookupsCount << " lookups in " << elapsed.count() / 1000 << " ms, "
+		<< static_cast<std::uint64_t>(lookupsCount * 1e6 / std::max<std::int64_t>(elapsed.count(), 1)) << " lookups/s, "
+		<< errors << " errors" << std::endl;
+}
+
+// threads are started in batches of the given concurrency
+void runThreads(const udp::endpoint& srvEndpoint, const std::string& name, std::size_t lookupsCount, std::size_t concurrency)
+{
+	std::atomic<std::size_t> errors{0};
+	const auto started = std::chrono::steady_clock::now();
+
+	for (std::size_t first = 0; first < lookupsCount; first += concurrency)
+	{
+		std::vector<std::thread> threads;
+		for (std::size_t i = first; i < std::min(first + concurrency, lookupsCount); i++)
+		{
+			threads.emplace_back([&srvEndpoint, &name, &errors, id = static_cast<std::uint16_t>(i)]()
+				{
+					asio::io_context ioContext(1);
+					udp::socket socket(ioContext, udp::v4());
+					struct timeval tv = { TIMEOUT.count() / 1000, 0 };
+					::setsockopt(socket.native_handle(), SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+					const DNSMessage::Buffer query(makeQuery(id, name));
+					std::array<std::uint8_t, 512> buffer;
+					udp::endpoint from;
+					std::error_code ec;
+					socket.send_to(asio::buffer(query.data(), query.size()), srvEndpoint, 0, ec);
+					const std::size_t n = ec ? 0 : socket.receive_from(asio::buffer(buffer), from, 0, ec);
+					if (ec || !checkResponse(buffer.data(), n, id, name))
+					{
+						errors++;
+					}
+				});
+		}
+
+		for (std::thread& thread : threads)
+		{
+			thread.join();
+		}
+	}
+
+	report("threads", lookupsCount, errors, started);
+}
+
+// Every slot runs one lookup after another: send, receive or time out, then the next one.
+class CallbackLookups
+{
+public:
+	CallbackLookups(asio::io_context& ioContext, const udp::endpoint& srvEndpoint, const std::string& name,
+		std::size_t lookupsCount, std::size_t concurrency)
+		: _srvEndpoint(srvEndpoint)
+		, _name(name)
+		, _lookupsCount(lookupsCount)
+	{
+		for (std::size_t i = 0; i < std::min(concurrency, lookupsCount); i++)
+		{
+			_slots.push_back(std::make_unique<Slot>(ioContext));
+		}
+	}
+
+	void start()
+	{
+		for (std::unique_ptr<Slot>& slot : _slots)
+		{
+			next(*slot);
+		}
+	}
+
+	std::size_t errors() const { return _errors; }
+
+private:
+	struct Slot
+	{
+		explicit Slot(asio::io_context& ioContext)
+			: _socket(ioContext, udp::v4())
+			, _timer(ioContext)
+		{
+		}
+
+		udp::socket _socket;
+		asio::steady_timer _timer;
+		std::uint16_t _id = 0;
+		DNSMessage::Buffer _query;
+		std::array<std::uint8_t, 512> _buffer;
+		udp::endpoint _from;
+	};
+
+	void next(Slot& slot)
+	{
+		if (_started == _lookupsCount)
+		{
+			return;
+		}
+
+		slot._id = static_cast<std::uint16_t>(_started++);
+		slot._query = makeQuery(slot._id, _name);
+		slot._socket.async_send_to(asio::buffer(slot._query.data(), slot._query.size()), _srvEndpoint,
+			[this, &slot](std::error_code ec, std::size_t sz)
+			{
+				if (ec)
+				{
+					_errors++;
+					next(slot);
+					return;
+				}
+
+				slot._timer.expires_after(TIMEOUT);
+				slot._timer.async_wait([&slot, id = slot._id](std::error_code ec)
+					{
+						if (!ec && slot._id == id)
+						{
+							slot._socket.cancel();
+						}
+					});
+
+				slot._socket.async_receive_from(asio::buffer(slot._buffer), slot._from,
+					[this, &slot](std::error_code ec, std::size_t sz)
+					{
+						slot._timer.cancel();
+						if (ec || !checkResponse(slot._buffer.data(), sz, slot._id, _name))
+						{
+							_errors++;
+						}
+						next(slot);
+					});
+			});
+	}
+
+private:
+	const udp::endpoint _srvEndpoint;
+	const std::string _name;
+	const std::size_t _lookupsCount;
+	std::size_t _started = 0;
+	std::size_t _errors = 0;
+	std::vector<std::unique_ptr<Slot>> _slots;
+};
+
+void runCallbacks(const udp::endpoint& srvEndpoint, const std::string& name, std::size_t lookupsCount, std::size_t concurrency)
+{
+	asio::io_context ioContext(1);
+	CallbackLookups lookups(ioContext, srvEndpoint, name, lookupsCount, concurrency);
+
+	const auto started = std::chrono::steady_clock::now();
+	lookups.start();
+	ioContext.run();
+	report("callbacks", lookupsCount, lookups.errors(), started);
+}
+
+void runCoroutines(const udp::endpoint& srvEndpoint, const std::string& name, std::size_t lookupsCount, std::size_t concurrency)
+{
+	asio::io_context ioContext(1);
+	DNSAsyncClient dnsClient(ioContext, srvEndpoint.address().to_string(), srvEndpoint.port());
+	dnsClient.setTimeout(TIMEOUT);
+
+	std::size_t started = 0;
+	std::size_t errors = 0;
+	std::function<void()> next = [&]()
+	{
+		if (started == lookupsCount)
+		{
+			return;
+		}
+
+		started++;
+		dnsClient.async_resolve(name, DNSMessage::QType::A,
+			[&](std::error_code ec, DNSAsyncClient::Answers answers)
+			{
+				if (ec)
+				{
+					errors++;
+				}
+				next();
+			});
+	};
+
+	const auto startTime = std::chrono::steady_clock::now();
+	for (std::size_t i = 0; i < std::min(concurrency, lookupsCount); i++)
+	{
+		next();
+	}
+	ioContext.run();
+	report("coroutine", lookupsCount, errors, startTime);
+}
+
+// Writes all queries of the batch at once, then reads their responses.
+template <typename Stream>
+std::size_t streamLookups(Stream& stream, const std::string& name, std::uint16_t firstId, std::size_t count)
+{
+	std::vector<std::uint8_t> frames;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		const DNSMessage::Buffer query(makeQuery(static_cast<std::uint16_t>(firstId + i), name));
+		frames.push_back(static_cast<std::uint8_t>(query.size() >> 8));
+		frames.push_back(static_cast<std::uint8_t>(query.size() & 0xFF));
+		frames.insert(frames.end(), query.cbegin(), query.cend());
+	}
+
+	std::error_code ec;
+	asio::write(stream, asio::buffer(frames), ec);
+
+	std::size_t errors = 0;
+	std::array<std::uint8_t, 2> length;
+	std::vector<std::uint8_t> response;
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (!ec)
+		{
+			asio::read(stream, asio::buffer(length), ec);
+		}
+		if (!ec)
+		{
+			response.resize((static_cast<std::size_t>(length[0]) << 8) | length[1]);
+			asio::read(stream, asio::buffer(response), ec);
+		}
+		if (ec || !checkResponse(response.data(), response.size(), static_cast<std::uint16_t>(firstId + i), name))
+		{
+			errors++;
+		}
+	}
+	return errors;
+}
+
+// a new connection for every lookup
+void runConnections(const tcp::endpoint& srvEndpoint, const std::string& name, std::size_t lookupsCount)
+{
+	asio::io_context ioContext(1);
+	std::size_t errors = 0;
+	const auto started = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < lookupsCount; i++)
+	{
+		tcp::socket socket(ioContext);
+		std::error_code ec;
+		socket.connect(srvEndpoint, ec);
+		errors += ec ? 1 : streamLookups(socket, name, static_cast<std::uint16_t>(i), 1);
+	}
+
+	report("tcp connections", lookupsCount, errors, started);
+}
+
+// A new connection with TLS handshake for every lookup. Resumed handshakes
+// offer the session (the ticket for TLS 1.3) of the previous connection.
+void runTlsConnections(const tcp::endpoint& srvEndpoint, const std::string& name, std::size_t lookupsCount,
+	asio::ssl::context& sslContext, bool resume)
+{
+	asio::io_context ioContext(1);
+	SSL_SESSION* session = nullptr;
+	std::size_t errors = 0;
+	std::size_t resumed = 0;
+	const auto started = std::chrono::steady_clock::now();
+
+	for (std::size_t i = 0; i < lookupsCount; i++)
+	{
+		asio::ssl::stream<tcp::socket> stream(ioContext, sslContext);
+		std::error_code ec;
+		stream.lowest_layer().connect(srvEndpoint, ec);
+		if (!ec && session != nullptr)
+		{
+			SSL_set_session(stream.native_handle(), session);
+		}
+		if (!ec)
+		{
+			stream.handshake(asio::ssl::stream_base::client, ec);
+		}
+		if (ec || streamLookups(stream, name, static_cast<std::uint16_t>(i), 1) != 0)
+		{
+			errors++;
+			continue;
+		}
+
+		resumed += SSL_session_reused(stream.native_handle());
+		if (resume)
+		{
+			// TLS 1.3 ticket arrives after the handshake, it has been read with the response
+			SSL_SESSION* next = SSL_get1_session(stream.native_handle());
+			SSL_SESSION_free(session);
+			session = next;
+		}
+		stream.shutdown(ec);
+	}
+
+	SSL_SESSION_free(session);
+	report(resume ? "tls resumed handshakes" : "tls full handshakes", lookupsCount, errors, started);
+	std::cout << "  " << resumed << " handshakes resumed" << std::endl;
+}
+
+// all lookups over one connection, the given number of queries in flight
+template <typename Stream>
+void runPipelined(const char* method, Stream& stream, const std::string& name, std::size_t lookupsCount, std::size_t depth)
+{
+	std::size_t errors = 0;
+	const auto started = std::chrono::steady_clock::now();
+
+	for (std::size_t first = 0; first < lookupsCount; first += depth)
+	{
+		errors += streamLookups(stream, name, static_cast<std::uint16_t>(first), std::min(depth, lookupsCount - first));
+	}
+
+	report(method, lookupsCount, errors, started);
+}
+
+}
+
+
+void runBenchmark(const std::string& srvAddress, std::uint16_t srvPort, const std::string& name,
+	std::size_t lookupsCount, std::size_t concurrency)
+{
+	const udp::endpoint srvEndpoint(asio::ip::make_address(srvAddress), srvPort);
+	concurrency = std::max<std::size_t>(concurrency, 1);
+
+	runThreads(srvEndpoint, name, lookupsCount, concurrency);
+	runCallbacks(srvEndpoint, name, lookupsCount, concurrency);
+	runCoroutines(srvEndpoint, name, lookupsCount, concurrency);
+}
+
+void runStreamBenchmark(const std::string& srvAddress, std::uint16_t srvPort, const std::string& name,
+	std::size_t lookupsCount, std::size_t depth, bool useTls)
+{
+	const tcp::endpoint srvEndpoint(asio::ip::make_address(srvAddress), srvPort);
+	depth = std::max<std::size_t>(depth, 1);
+
+	asio::io_context ioContext(1);
+	if (!useTls)
+	{
+		runConnections(srvEndpoint, name, lookupsCount);
+
+		tcp::socket socket(ioContext);
+		socket.connect(srvEndpoint);
+		runPipelined("tcp pipelined", socket, name, lookupsCount, depth);
+		return;
+	}
+
+	// the benchmark measures the server, its certificate isn't verified
+	asio::ssl::context sslContext(asio::ssl::context::tls_client);
+	sslContext.set_verify_mode(asio::ssl::verify_none);
+
+	runTlsConnections(srvEndpoint, name, lookupsCount, sslContext, false);
+	runTlsConnections(srvEndpoint, name, lookupsCount, sslContext, true);
+
+	asio::ssl::stream<tcp::socket> stream(ioContext, sslContext);
+	stream.lowest_layer().connect(srvEndpoint);
+	stream.handshake(asio::ssl::stream_base::client);
+	runPipelined("tls pipelined", stream, name, lookupsCount, depth);
+}
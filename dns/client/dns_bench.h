@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+
+/*
+ Throughput of the three ways to run many lookups at once:
+   threads   - a thread with the blocking socket per lookup,
+   callbacks - hand-written chains of completion handlers, a socket per lookup,
+   coroutine - DNSAsyncClient, all lookups on its one socket.
+ Every way keeps the given number of lookups in flight until all of them
+ are done and prints lookups per second.
+ */
+void runBenchmark(const std::string& srvAddress, std::uint16_t srvPort, const std::string& name,
+	std::size_t lookupsCount, std::size_t concurrency);
+
+/*
+ Cost of DNS over TCP and TLS (RFC 7766, RFC 7858) connections:
+   connections - a new connection per lookup, for TLS once with full
+                 and once with resumed handshakes,
+   pipelined   - all lookups over one connection, the given number
+                 of queries is written at once, then their responses read.
+ */
+void runStreamBenchmark(const std::string& srvAddress, std::uint16_t srvPort, const std::string& name,
+	std::size_t lookupsCount, std::size_t depth, bool useTls);
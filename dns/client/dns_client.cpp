@@ -37,7 +37,7 @@ std::string DNSClient::resolve(const std::string& addr)
 	dnsQuery.setQCount(1);
 	dnsQuery.setName(addr);
 
-	std::vector<std::uint8_t> dataToSend(dnsQuery.encode());
+	const DNSMessage::Buffer dataToSend(dnsQuery.encode());
 
     asio::ip::udp::endpoint ep(asio::ip::address::from_string(_srvAddress), _srvPort);
 
@@ -71,7 +71,7 @@ std::string DNSClient::resolve(const std::string& addr)
 
     DNSResponse dnsResponse;
 
-    n = dnsResponse.decode(std::vector<std::uint8_t>(recvBuffer.cbegin(), recvBuffer.cend()));
+    n = dnsResponse.decode(recvBuffer.data(), n);
     std::cout << " Decoded " << n << " bytes.\n";
 
     if (dnsResponse.getId() == 0xAAAA)
@@ -1,18 +1,103 @@
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
 
 #include <exception>
 #include <iostream>
+#include <string>
 
+#include "dns_async_client.h"
+#include "dns_bench.h"
 #include "dns_client.h"
 
 
 
+static void usage(const char* program)
+{
+	std::cerr << "usage: " << program << " [--async] <address-to-resolve> [<address-to-resolve>] \n"
+		<< "       " << program << " --bench <server-address> <server-port> <name> <lookups> <concurrency>\n"
+		<< "       " << program << " --bench-tcp|--bench-tls <server-address> <server-port> <name> <lookups> <pipeline-depth>\n";
+	std::exit(EXIT_FAILURE);
+}
+
+static std::size_t parseNumber(const char* program, const char* arg, std::size_t max)
+{
+	char* end = nullptr;
+	errno = 0;
+	const unsigned long long value = std::strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg || *end != '\0' || *arg == '-' || value == 0 || value > max)
+	{
+		std::cerr << "invalid number '" << arg << "'\n";
+		usage(program);
+	}
+	return static_cast<std::size_t>(value);
+}
+
 int main(int argc, char* argv[])
 {
 	if (argc < 2)
 	{
-		std::cerr << "usage: " << argv[0] << " <address-to-resolve> [<address-to-resolve>] \n";
-		std::exit(EXIT_FAILURE);
+		usage(argv[0]);
+	}
+
+	const std::string mode(argv[1]);
+	if (mode == "--bench" || mode == "--bench-tcp" || mode == "--bench-tls")
+	{
+		if (argc != 7)
+		{
+			usage(argv[0]);
+		}
+
+		const std::uint16_t srvPort = static_cast<std::uint16_t>(parseNumber(argv[0], argv[3], 65535));
+		const std::size_t lookupsCount = parseNumber(argv[0], argv[5], SIZE_MAX);
+		const std::size_t concurrency = parseNumber(argv[0], argv[6], SIZE_MAX);
+		try
+		{
+			if (mode == "--bench")
+			{
+				runBenchmark(argv[2], srvPort, argv[4], lookupsCount, concurrency);
+			}
+			else
+			{
+				runStreamBenchmark(argv[2], srvPort, argv[4], lookupsCount, concurrency, mode == "--bench-tls");
+			}
+		}
+		catch (const std::exception& ex)
+		{
+			std::cerr << "Exception: " << ex.what() << std::endl;
+			std::exit(EXIT_FAILURE);
+		}
+		std::exit(EXIT_SUCCESS);
+	}
+
+	if (mode == "--async")
+	{
+		// all lookups are running concurrently on single thread
+		asio::io_context ioContext(1);
+		DNSAsyncClient dnsClient(ioContext, "8.8.8.8", 53);
+		dnsClient.setUseRecursion(true);
+
+		for (int i = 2; i < argc; i++)
+		{
+			std::string name(argv[i]);
+			dnsClient.async_resolve(name, DNSMessage::QType::A,
+				[name](std::error_code ec, DNSAsyncClient::Answers answers)
+				{
+					if (ec)
+					{
+						std::cout << name << ": " << ec.message() << std::endl;
+						return;
+					}
+
+					for (const std::string& answer : answers)
+					{
+						std::cout << name << ": " << answer << std::endl;
+					}
+				});
+		}
+
+		ioContext.run();
+		std::exit(EXIT_SUCCESS);
 	}
 
 	try
@@ -3,6 +3,9 @@
 #include <cstdint>
 
 #include <iostream>
+#include <memory_resource>
+#include <string>
+#include <string_view>
 #include <vector>
 
 
@@ -44,9 +47,16 @@ public:
 	};	
 
 
+	// Every piece of memory of a message (names, records, encoded data)
+	// comes from the memory resource given at construction,
+	// so the server may keep all per-request allocations in an arena.
+	using Buffer = std::pmr::vector<std::uint8_t>;
+
+	static const std::size_t HEADER_SIZE = 6 * sizeof(std::uint16_t);
+
 protected:
-	DNSMessage() = default;
-	DNSMessage(std::uint16_t id, bool isResponse = false);
+	explicit DNSMessage(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+	DNSMessage(std::uint16_t id, bool isResponse, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
 public:	
 	~DNSMessage();
@@ -55,8 +65,8 @@ public:
 	DNSMessage& operator=(const DNSMessage&) = delete;
 
 protected:
-	std::size_t decode(const std::vector<std::uint8_t>& buffer);
-	std::vector<std::uint8_t> encode() const;
+	std::size_t decode(const std::uint8_t* data, std::size_t size);
+	Buffer encode() const;
 
 	void dump(std::ostream& os) const;
 
@@ -93,11 +103,18 @@ protected:
 	void setFieldRcode(std::uint8_t rcode);
 
 protected:
+	std::pmr::memory_resource* resource() const { return _resource; }
+
 	// static std::size_t decodeDomainName(const std::uint8_t* data, std::string& name);
-	static std::size_t decodeDomainName(const std::uint8_t* data, std::string& name, std::size_t& offset);
-	static std::vector<std::uint8_t> encodeDomainName(const std::string& name);
+	// throws std::length_error when the name runs past size bytes
+	static std::size_t decodeDomainName(const std::uint8_t* data, std::size_t size, std::pmr::string& name, std::size_t& offset);
+	static void encodeDomainName(std::string_view name, Buffer& buffer);
+
+	static void appendUint16(Buffer& buffer, std::uint16_t value);
+	static void appendUint32(Buffer& buffer, std::uint32_t value);
 
 private:
+	std::pmr::memory_resource* _resource = nullptr;
 	std::uint16_t _id = 0;		// identifier
 	std::uint16_t _flags = 0;	// flags and codes
 	std::uint16_t _qCount = 0;	// question count
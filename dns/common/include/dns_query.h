@@ -7,19 +7,29 @@
 class DNSQuery : public DNSMessage
 {
 public:
-	DNSQuery() = default;
+	explicit DNSQuery(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+		: DNSMessage(resource)
+		, _name(resource)
+	{
+	}
+
 	~DNSQuery() = default;
 
 
-	std::size_t decode(const std::vector<std::uint8_t>& buffer);
-	std::vector<std::uint8_t> encode() const;
+	std::size_t decode(const std::uint8_t* data, std::size_t size);
+	Buffer encode() const;
+
+	std::size_t decode(const std::vector<std::uint8_t>& buffer)
+	{
+		return decode(buffer.data(), buffer.size());
+	}
 
-	void setName(const std::string& name)
+	void setName(std::string_view name)
 	{
 		_name = name;
 	}
 
-	const std::string getName() const 
+	const std::pmr::string& getName() const 
 	{
 		return _name;
 	}
@@ -49,7 +59,7 @@ private:
 	std::size_t decodeName(const std::uint8_t* data, std::size_t size);
 
 private:
-	std::string _name;
+	std::pmr::string _name;
 	std::uint16_t _type = 0;
 	std::uint16_t _cls = 1;	// query class = 1 (IN) in 99% of cases
 };
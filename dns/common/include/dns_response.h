@@ -21,17 +21,22 @@ public:
 	};
 
 public:
-	DNSResponse();
+	explicit DNSResponse(std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 	~DNSResponse() = default;
-	explicit DNSResponse(std::uint16_t id);	
+	explicit DNSResponse(std::uint16_t id, std::pmr::memory_resource* resource = std::pmr::get_default_resource());
 
-	std::size_t decode(const std::vector<std::uint8_t>& buffer);
-	std::vector<std::uint8_t> encode() const;
+	std::size_t decode(const std::uint8_t* data, std::size_t size);
+	Buffer encode() const;
 
-	void setName(const std::string& name) { _name = name; }
+	std::size_t decode(const std::vector<std::uint8_t>& buffer)
+	{
+		return decode(buffer.data(), buffer.size());
+	}
+
+	void setName(std::string_view name) { _name = name; }
 	void setType(std::uint16_t type) { _type = type; }
 	void setClass(std::uint16_t cls) { _cls = cls; }
-	void setData(const std::string& data) { _data = data; }
+	void setData(std::string_view data) { _data = data; }
 	void setRCode(std::uint8_t rcode);
 
 	bool isAuthoritative() const;
@@ -44,11 +49,16 @@ public:
 		return _ttl;
 	}
 
-	const std::string& getRdata() const
+	const std::pmr::string& getRdata() const
 	{
 		return _data;
 	}	
 
+	// answers of received response as text (address, domain name)
+	std::vector<std::string> getAnswers() const;
+	// the received response has the only question, which is the given one (names are case-insensitive)
+	bool hasQuestion(std::string_view name, std::uint16_t type, std::uint16_t cls) const;
+
 	void dump(std::ostream& os) const;
 
 	static std::string responseCodeToString(std::uint8_t rcode);
@@ -56,15 +66,36 @@ public:
 private:
 	// TO DO: have to be refactored
 	// these fields are used when sending response
-	std::string _name;
-	std::uint16_t _type;
-	std::uint16_t _cls;
-	std::uint32_t _ttl;
-	std::string _data;
+	std::pmr::string _name;
+	std::uint16_t _type = 0;
+	std::uint16_t _cls = 0;
+	std::uint32_t _ttl = 0;
+	std::pmr::string _data;
 	//  these structures and fields are used when response is received
+	//  (allocator-aware, so pmr containers pass the memory resource down)
 	struct Question
 	{
-		std::string _name;
+		using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+		explicit Question(const allocator_type& alloc = allocator_type())
+			: _name(alloc)
+		{
+		}
+
+		Question(const Question& other, const allocator_type& alloc)
+			: _name(other._name, alloc), _type(other._type), _cls(other._cls)
+		{
+		}
+
+		Question(Question&& other, const allocator_type& alloc)
+			: _name(std::move(other._name), alloc), _type(other._type), _cls(other._cls)
+		{
+		}
+
+		Question(const Question&) = default;
+		Question(Question&&) = default;
+
+		std::pmr::string _name;
 		std::uint16_t _type = 0;
 		std::uint16_t _cls = 0;
 
@@ -73,20 +104,49 @@ private:
 
 	struct ResourceRecord
 	{
-		std::string _name;
+		using allocator_type = std::pmr::polymorphic_allocator<char>;
+
+		explicit ResourceRecord(const allocator_type& alloc = allocator_type())
+			: _name(alloc), _data(alloc), _text(alloc)
+		{
+		}
+
+		ResourceRecord(const ResourceRecord& other, const allocator_type& alloc)
+			: _name(other._name, alloc), _type(other._type), _cls(other._cls), _ttl(other._ttl)
+			, _data(other._data, alloc), _text(other._text, alloc)
+		{
+		}
+
+		ResourceRecord(ResourceRecord&& other, const allocator_type& alloc)
+			: _name(std::move(other._name), alloc), _type(other._type), _cls(other._cls), _ttl(other._ttl)
+			, _data(std::move(other._data), alloc), _text(std::move(other._text), alloc)
+		{
+		}
+
+		ResourceRecord(const ResourceRecord&) = default;
+		ResourceRecord(ResourceRecord&&) = default;
+
+		std::pmr::string _name;
 		std::uint16_t _type = 0;
 		std::uint16_t _cls = 0;
 		std::uint32_t _ttl = 0;
-		std::vector<std::uint8_t> _data;
-		std::string _text;	// data as text
+		std::pmr::vector<std::uint8_t> _data;
+		std::pmr::string _text;	// data as text
 
 		void dump(std::ostream& os) const;
 	};
 
-	static std::size_t readResourceRecord(const std::uint8_t* msgBegin, std::size_t recOffset, ResourceRecord& record);
+	// every read is checked against the size of the message, std::length_error is thrown when it's outside
+	static std::size_t readResourceRecord(const std::uint8_t* msgBegin, std::size_t msgSize, std::size_t recOffset, ResourceRecord& record);
+	static void readCompressedName(const std::uint8_t* msgBegin, std::size_t msgSize, std::pmr::string& name, std::size_t offset);
+
+	// compression pointers followed for one name, more of them is a loop
+	static const std::size_t MAX_NAME_POINTERS = 16;
+	static const std::size_t MIN_QUESTION_SIZE = 1 + 2 * sizeof(std::uint16_t);
+	static const std::size_t MIN_RESOURCE_RECORD_SIZE = 1 + 3 * sizeof(std::uint16_t) + sizeof(std::uint32_t);
 
-	std::vector<Question> _questions;
-	std::vector<ResourceRecord> _answerResourceRecords;
-	std::vector<ResourceRecord> _authorityResourceRecords;
-	std::vector<ResourceRecord> _additionalResourceRecords;
+	std::pmr::vector<Question> _questions;
+	std::pmr::vector<ResourceRecord> _answerResourceRecords;
+	std::pmr::vector<ResourceRecord> _authorityResourceRecords;
+	std::pmr::vector<ResourceRecord> _additionalResourceRecords;
 };
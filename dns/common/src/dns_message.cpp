@@ -3,10 +3,18 @@
 #include <arpa/inet.h>
 
 #include <iomanip>
+#include <stdexcept>
 
 
-DNSMessage::DNSMessage(std::uint16_t id, bool isResponse /*= false*/)
-	: _id(id)
+DNSMessage::DNSMessage(std::pmr::memory_resource* resource /*= std::pmr::get_default_resource()*/)
+	: _resource(resource)
+{
+
+}
+
+DNSMessage::DNSMessage(std::uint16_t id, bool isResponse, std::pmr::memory_resource* resource /*= std::pmr::get_default_resource()*/)
+	: _resource(resource)
+	, _id(id)
 {
 	if (isResponse)
 	{
@@ -19,10 +27,15 @@ DNSMessage::~DNSMessage()
 
 }
 
-std::size_t DNSMessage::decode(const std::vector<std::uint8_t>& buffer)
+std::size_t DNSMessage::decode(const std::uint8_t* data, std::size_t size)
 {
+	if (size < HEADER_SIZE)
+	{
+		throw std::length_error("DNS message is shorter than header.");
+	}
+
 	std::size_t bytesCount = 0;
-	const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(buffer.data());	
+	const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(data);	
 
 	_id = ntohs(*src);
 	src += 1;
@@ -51,9 +64,9 @@ std::size_t DNSMessage::decode(const std::vector<std::uint8_t>& buffer)
 	return bytesCount;
 }
 
-std::vector<std::uint8_t> DNSMessage::encode() const
+DNSMessage::Buffer DNSMessage::encode() const
 {
-	std::vector<std::uint8_t> result(6 * sizeof(std::uint16_t));
+	Buffer result(HEADER_SIZE, _resource);
 
 	std::uint16_t* dst = reinterpret_cast<std::uint16_t*>(result.data());
 	*dst = htons(_id);
@@ -217,12 +230,17 @@ void DNSMessage::setFieldRcode(std::uint8_t rcode)
 // 	return bytesCount + 1;
 // }
 
-std::size_t DNSMessage::decodeDomainName(const std::uint8_t* data, std::string& name, std::size_t& offset)
+std::size_t DNSMessage::decodeDomainName(const std::uint8_t* data, std::size_t size, std::pmr::string& name, std::size_t& offset)
 {
 	std::size_t bytesCount = 0;
 	name.clear();
 	offset = 0;
 
+	if (size == 0 || ((*data & 0xC0) && size < 2))
+	{
+		throw std::length_error("DNS name is truncated.");
+	}
+
 	if (*data & 0xC0)
 	{
 		offset = (*data) & 0x3F;
@@ -234,6 +252,12 @@ std::size_t DNSMessage::decodeDomainName(const std::uint8_t* data, std::string&
 	std::size_t length = *data;
 	while (length != 0)
 	{
+		// the label and the next length byte
+		if (bytesCount + length + 2 > size)
+		{
+			throw std::length_error("DNS name is truncated.");
+		}
+
 		bytesCount += 1;
 		data += 1;
 
@@ -245,6 +269,11 @@ std::size_t DNSMessage::decodeDomainName(const std::uint8_t* data, std::string&
 
 		if (*data & 0xC0)
 		{
+			if (bytesCount + 2 > size)
+			{
+				throw std::length_error("DNS name is truncated.");
+			}
+
 			offset = (*data) & 0x3F;
 			offset <<= 8;
 			offset += *(data + 1);
@@ -261,19 +290,16 @@ std::size_t DNSMessage::decodeDomainName(const std::uint8_t* data, std::string&
 	return bytesCount + 1;
 }
 
-std::vector<std::uint8_t> DNSMessage::encodeDomainName(const std::string& name)
+void DNSMessage::encodeDomainName(std::string_view name, Buffer& buffer)
 {
-	std::vector<std::uint8_t> result;
-	result.reserve(name.length() + 2);
-
 	std::size_t p0 = 0, p1 = name.find('.');
-	while (p1 != std::string::npos)
+	while (p1 != std::string_view::npos)
 	{
 		std::size_t n = p1 - p0;
-		result.push_back(static_cast<std::uint8_t>(n));
+		buffer.push_back(static_cast<std::uint8_t>(n));
 		for (; p0 < p1; p0++)
 		{
-			result.push_back(static_cast<std::uint8_t>(name[p0]));
+			buffer.push_back(static_cast<std::uint8_t>(name[p0]));
 		}
 
 		p0 = p1 + 1;
@@ -281,13 +307,23 @@ std::vector<std::uint8_t> DNSMessage::encodeDomainName(const std::string& name)
 	}	
 
 	std::size_t n = name.length() - p0;
-	result.push_back(static_cast<std::uint8_t>(n));
+	buffer.push_back(static_cast<std::uint8_t>(n));
 	for (; p0 < name.length(); p0++)
 	{
-		result.push_back(static_cast<std::uint8_t>(name[p0]));
+		buffer.push_back(static_cast<std::uint8_t>(name[p0]));
 	}
 
-	result.push_back(0);
+	buffer.push_back(0);
+}
+
+void DNSMessage::appendUint16(Buffer& buffer, std::uint16_t value)
+{
+	buffer.push_back(static_cast<std::uint8_t>(value >> 8));
+	buffer.push_back(static_cast<std::uint8_t>(value & 0xFF));
+}
 
-	return result;
+void DNSMessage::appendUint32(Buffer& buffer, std::uint32_t value)
+{
+	appendUint16(buffer, static_cast<std::uint16_t>(value >> 16));
+	appendUint16(buffer, static_cast<std::uint16_t>(value & 0xFFFF));
 }
@@ -2,13 +2,20 @@
 
 #include <arpa/inet.h>
 
+#include <stdexcept>
 
-std::size_t DNSQuery::decode(const std::vector<std::uint8_t>& buffer)
+
+std::size_t DNSQuery::decode(const std::uint8_t* data, std::size_t size)
 {
-	std::size_t bytesCount = DNSMessage::decode(buffer);
-	bytesCount += decodeName(buffer.data() + bytesCount, buffer.size() - bytesCount);
+	std::size_t bytesCount = DNSMessage::decode(data, size);
+	bytesCount += decodeName(data + bytesCount, size - bytesCount);
+
+	if (bytesCount + 2 * sizeof(std::uint16_t) > size)
+	{
+		throw std::length_error("DNS query is truncated.");
+	}
 
-	const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(buffer.data() + bytesCount);
+	const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(data + bytesCount);
 
 	_type = ntohs(*src);
 	src += 1;
@@ -21,20 +28,14 @@ std::size_t DNSQuery::decode(const std::vector<std::uint8_t>& buffer)
 	return bytesCount;
 }
 
-std::vector<std::uint8_t> DNSQuery::encode() const
+DNSMessage::Buffer DNSQuery::encode() const
 {
-	std::vector<std::uint8_t> result(DNSMessage::encode());
-	std::vector<std::uint8_t> name(encodeDomainName(_name));
-
-	result.reserve(result.size() + name.size() + 2 * sizeof(std::uint16_t));
+	Buffer result(DNSMessage::encode());
+	result.reserve(result.size() + _name.length() + 2 + 2 * sizeof(std::uint16_t));
 
-	std::uint16_t type = htons(_type);
-	std::uint16_t cls = htons(_cls);
-	result.insert(result.end(), name.cbegin(), name.cend());
-	const std::uint8_t* src = reinterpret_cast<std::uint8_t*>(&type);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-	src = reinterpret_cast<std::uint8_t*>(&cls);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
+	encodeDomainName(_name, result);
+	appendUint16(result, _type);
+	appendUint16(result, _cls);
 
 	return result;
 }
@@ -57,9 +58,19 @@ std::size_t DNSQuery::decodeName(const std::uint8_t* data, std::size_t size)
 	std::size_t bytesCount = 0;
 	_name.clear();
 
+	if (size == 0)
+	{
+		throw std::length_error("DNS query is truncated.");
+	}
+
 	std::size_t length = *data;
 	while (length != 0)
 	{
+		if (bytesCount + length + 2 > size)
+		{
+			throw std::length_error("DNS query is truncated.");
+		}
+
 		bytesCount += 1;
 		data += 1;
 
@@ -2,44 +2,57 @@
 
 #include <arpa/inet.h>
 
-#include <algorithm>
-#include <sstream>
+#include <strings.h>
 
-DNSResponse::DNSResponse()
-	: DNSMessage(0, true)
+#include <algorithm>
+#include <cstdio>
+#include <stdexcept>
+
+DNSResponse::DNSResponse(std::pmr::memory_resource* resource /*= std::pmr::get_default_resource()*/)
+	: DNSMessage(0, true, resource)
+	, _name(resource)
+	, _data(resource)
+	, _questions(resource)
+	, _answerResourceRecords(resource)
+	, _authorityResourceRecords(resource)
+	, _additionalResourceRecords(resource)
 {
 
 }
 
-DNSResponse::DNSResponse(std::uint16_t id)
-	: DNSMessage(id, true)
+DNSResponse::DNSResponse(std::uint16_t id, std::pmr::memory_resource* resource /*= std::pmr::get_default_resource()*/)
+	: DNSMessage(id, true, resource)
+	, _name(resource)
+	, _data(resource)
+	, _questions(resource)
+	, _answerResourceRecords(resource)
+	, _authorityResourceRecords(resource)
+	, _additionalResourceRecords(resource)
 {
 
 }
 
-std::size_t DNSResponse::decode(const std::vector<std::uint8_t>& buffer)
+std::size_t DNSResponse::decode(const std::uint8_t* data, std::size_t size)
 {
-	std::size_t bytesCount = DNSMessage::decode(buffer);
+	std::size_t bytesCount = DNSMessage::decode(data, size);
 	
+	// the counts come from the message, so they don't reserve more than the message may hold
 	std::size_t n = getQCount();
-	_questions.resize(n);
+	_questions.clear();
+	_questions.reserve(std::min(n, (size - bytesCount) / MIN_QUESTION_SIZE));
 	for (std::size_t i = 0; i < n; i++)
 	{
-		Question question;
+		Question& question = _questions.emplace_back();
 		std::size_t offset = 0;
-		bytesCount += DNSMessage::decodeDomainName(buffer.data() + bytesCount, question._name, offset);
-		while (offset != 0)
+		bytesCount += DNSMessage::decodeDomainName(data + bytesCount, size - bytesCount, question._name, offset);
+		readCompressedName(data, size, question._name, offset);
+
+		if (bytesCount + 2 * sizeof(std::uint16_t) > size)
 		{
-			std::string name;
-			DNSMessage::decodeDomainName(buffer.data() + offset, name, offset);
-			if (!question._name.empty())
-			{
-				question._name.push_back('.');
-			}
-			question._name.append(name);
+			throw std::length_error("DNS response is truncated.");
 		}
 
-		const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(buffer.data() + bytesCount);
+		const std::uint16_t* src = reinterpret_cast<const std::uint16_t*>(data + bytesCount);
 
 		question._type = ntohs(*src);
 		bytesCount += sizeof(std::uint16_t);
@@ -48,86 +61,100 @@ std::size_t DNSResponse::decode(const std::vector<std::uint8_t>& buffer)
 		question._cls = ntohs(*src);
 		bytesCount += sizeof(std::uint16_t);
 		src += 1;
-
-		_questions[i] = question;
 	}
 
 
 	n = getACount();
-	_answerResourceRecords.resize(n);
+	_answerResourceRecords.clear();
+	_answerResourceRecords.reserve(std::min(n, (size - bytesCount) / MIN_RESOURCE_RECORD_SIZE));
 	for (std::size_t i = 0; i < n; i++)
 	{
-		ResourceRecord record;
-		bytesCount += readResourceRecord(buffer.data(), bytesCount, record);
-		_answerResourceRecords[i] = record;
+		bytesCount += readResourceRecord(data, size, bytesCount, _answerResourceRecords.emplace_back());
 	}
 
 
 	n = getNSCount();
-	_authorityResourceRecords.reserve(n);
+	_authorityResourceRecords.clear();
+	_authorityResourceRecords.reserve(std::min(n, (size - bytesCount) / MIN_RESOURCE_RECORD_SIZE));
 	for (std::size_t i = 0; i < n; i++)
 	{
-		ResourceRecord record;
-		bytesCount += readResourceRecord(buffer.data(), bytesCount, record);
-		_authorityResourceRecords[i] = record;
+		bytesCount += readResourceRecord(data, size, bytesCount, _authorityResourceRecords.emplace_back());
 	}
 
 
 	n = getARCount();
-	_additionalResourceRecords.reserve(n);
+	_additionalResourceRecords.clear();
+	_additionalResourceRecords.reserve(std::min(n, (size - bytesCount) / MIN_RESOURCE_RECORD_SIZE));
 	for (std::size_t i = 0; i < n; i++)
 	{
-		ResourceRecord record;
-		bytesCount += readResourceRecord(buffer.data(), bytesCount, record);
-		_additionalResourceRecords[i] = record;
+		bytesCount += readResourceRecord(data, size, bytesCount, _additionalResourceRecords.emplace_back());
 	}
 
 	return bytesCount;
 }
 
-std::vector<std::uint8_t> DNSResponse::encode() const
+DNSMessage::Buffer DNSResponse::encode() const
 {
-	std::vector<std::uint8_t> result(DNSMessage::encode());
-	std::vector<std::uint8_t> name(DNSMessage::encodeDomainName(_name));
-
-	// assume, that data contains domain name.
-	// this assumption is correct for query with type A (1)
-	std::vector<std::uint8_t> data(DNSMessage::encodeDomainName(_data));
+	Buffer result(DNSMessage::encode());
 
 	result.reserve(result.size() 									// header
-				+ name.size() + 2 * sizeof(std::uint16_t)			// question section
+				+ _name.length() + 2 + 2 * sizeof(std::uint16_t)	// question section
 				// answer section
-				+ name.size() + 2 * sizeof(std::uint16_t) + sizeof(std::uint32_t) + sizeof(std::uint16_t) + data.size());
+				+ sizeof(std::uint16_t) + 2 * sizeof(std::uint16_t) + sizeof(std::uint32_t) + sizeof(std::uint16_t) + _data.length() + 2);
 
 	// write question section
-	std::uint16_t type = htons(_type);
-	std::uint16_t cls = htons(_cls);
-	result.insert(result.end(), name.cbegin(), name.cend());
-	const std::uint8_t* src = reinterpret_cast<std::uint8_t*>(&type);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-	src = reinterpret_cast<std::uint8_t*>(&cls);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-
-	// write answer section
-	std::uint32_t ttl = htonl(_ttl);
-
-	result.insert(result.end(), name.cbegin(), name.cend());
-	src = reinterpret_cast<std::uint8_t*>(&type);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-	src = reinterpret_cast<std::uint8_t*>(&cls);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-	src = reinterpret_cast<std::uint8_t*>(&ttl);
-	result.insert(result.end(), src, src + sizeof(std::uint32_t));
-
-	std::uint16_t rlength = htons(static_cast<std::uint16_t>(data.size()));
-	src = reinterpret_cast<std::uint8_t*>(&rlength);
-	result.insert(result.end(), src, src + sizeof(std::uint16_t));
-
-	result.insert(result.end(), data.cbegin(), data.cend());	
+	encodeDomainName(_name, result);
+	appendUint16(result, _type);
+	appendUint16(result, _cls);
+
+	// write answer section (there is no answer in refused response)
+	if (getACount() == 0)
+	{
+		return result;
+	}
+
+	// the name is a pointer to the name in question section
+	appendUint16(result, 0xC000 | HEADER_SIZE);
+	appendUint16(result, _type);
+	appendUint16(result, _cls);
+	appendUint32(result, _ttl);
 
+	// assume, that data contains domain name.
+	// this assumption is correct for query with type A (1)
+	const std::size_t rlengthPos = result.size();
+	appendUint16(result, 0);
+	encodeDomainName(_data, result);
+
+	const std::size_t rlength = result.size() - rlengthPos - sizeof(std::uint16_t);
+	result[rlengthPos] = static_cast<std::uint8_t>(rlength >> 8);
+	result[rlengthPos + 1] = static_cast<std::uint8_t>(rlength & 0xFF);
+
+	return result;
+}
+
+std::vector<std::string> DNSResponse::getAnswers() const
+{
+	std::vector<std::string> result;
+	result.reserve(_answerResourceRecords.size());
+	for (const ResourceRecord& rr : _answerResourceRecords)
+	{
+		result.emplace_back(rr._text);
+	}
 	return result;
 }
 
+bool DNSResponse::hasQuestion(std::string_view name, std::uint16_t type, std::uint16_t cls) const
+{
+	if (_questions.size() != 1)
+	{
+		return false;
+	}
+
+	const Question& question = _questions.front();
+	return question._type == type && question._cls == cls && question._name.length() == name.length()
+		&& ::strncasecmp(question._name.data(), name.data(), name.length()) == 0;
+}
+
 void DNSResponse::dump(std::ostream& os) const
 {
 	DNSMessage::dump(os);
@@ -241,21 +268,18 @@ void DNSResponse::ResourceRecord::dump(std::ostream& os) const
 	os << std::endl;
 }
 
-std::size_t DNSResponse::readResourceRecord(const std::uint8_t* msgBegin, std::size_t recOffset, ResourceRecord& record)
+std::size_t DNSResponse::readResourceRecord(const std::uint8_t* msgBegin, std::size_t msgSize, std::size_t recOffset, ResourceRecord& record)
 {	
 	std::size_t bytesCount = 0;
 
 	std::size_t nameOffset = 0;
-	bytesCount += DNSMessage::decodeDomainName(msgBegin + recOffset, record._name, nameOffset);
-	while (nameOffset != 0)
+	bytesCount += DNSMessage::decodeDomainName(msgBegin + recOffset, msgSize - recOffset, record._name, nameOffset);
+	readCompressedName(msgBegin, msgSize, record._name, nameOffset);
+
+	// type, class, TTL and RDATA length
+	if (recOffset + bytesCount + 3 * sizeof(std::uint16_t) + sizeof(std::uint32_t) > msgSize)
 	{
-		std::string name;
-		DNSMessage::decodeDomainName(msgBegin + nameOffset, name, nameOffset);
-		if (!record._name.empty())
-		{
-			record._name.push_back('.');
-		}
-		record._name.append(name);
+		throw std::length_error("DNS response is truncated.");
 	}
 
 	const std::uint16_t* src16 = reinterpret_cast<const std::uint16_t*>(msgBegin + (recOffset + bytesCount));
@@ -276,6 +300,11 @@ std::size_t DNSResponse::readResourceRecord(const std::uint8_t* msgBegin, std::s
 	std::uint16_t rdataLength = ntohs(*src16);
 	bytesCount += sizeof(std::uint16_t);
 
+	if (recOffset + bytesCount + rdataLength > msgSize)
+	{
+		throw std::length_error("DNS response is truncated.");
+	}
+
 	record._data.resize(rdataLength);
 	std::copy_n(msgBegin + (recOffset + bytesCount), rdataLength, record._data.begin());
 	bytesCount += rdataLength;
@@ -284,30 +313,20 @@ std::size_t DNSResponse::readResourceRecord(const std::uint8_t* msgBegin, std::s
 	{
 	case static_cast<std::uint8_t>(QType::A):
 	{
-		std::ostringstream oss;
-		std::size_t i = 0, n = record._data.size() - 1;
-		for (; i < n; i++)
+		char text[4 * 4];
+		int n = 0;
+		for (std::size_t i = 0; i < record._data.size() && i < 4; i++)
 		{
-			oss << static_cast<std::uint16_t>(record._data[i]) << '.';
+			n += std::snprintf(text + n, sizeof(text) - n, i == 0 ? "%u" : ".%u", static_cast<unsigned>(record._data[i]));
 		}
-		oss << static_cast<std::uint16_t>(record._data[i]);
-		record._text = oss.str();
+		record._text.assign(text, n);
 	}
 	break;
 
 	case static_cast<std::uint8_t>(QType::CNAME):
 	{
-		DNSMessage::decodeDomainName(record._data.data(), record._text, nameOffset);
-		while (nameOffset != 0)
-		{
-			std::string name;
-			DNSMessage::decodeDomainName(msgBegin + nameOffset, name, nameOffset);
-			if (!record._text.empty())
-			{
-				record._text.push_back('.');
-			}
-			record._text.append(name);
-		}		
+		DNSMessage::decodeDomainName(record._data.data(), record._data.size(), record._text, nameOffset);
+		readCompressedName(msgBegin, msgSize, record._text, nameOffset);
 	}
 	break;
 
@@ -318,3 +337,27 @@ std::size_t DNSResponse::readResourceRecord(const std::uint8_t* msgBegin, std::s
 
 	return bytesCount;
 }
+
+void DNSResponse::readCompressedName(const std::uint8_t* msgBegin, std::size_t msgSize, std::pmr::string& name, std::size_t offset)
+{
+	std::pmr::string label(name.get_allocator());
+	std::size_t pointersCount = 0;
+	while (offset != 0)
+	{
+		if (offset >= msgSize)
+		{
+			throw std::length_error("DNS name points outside of the message.");
+		}
+		if (++pointersCount > MAX_NAME_POINTERS)
+		{
+			throw std::length_error("DNS name has too many compression pointers.");
+		}
+
+		DNSMessage::decodeDomainName(msgBegin + offset, msgSize - offset, label, offset);
+		if (!name.empty())
+		{
+			name.push_back('.');
+		}
+		name.append(label);
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstddef>
+#include <memory_resource>
+
+
+/*
+ Per-thread bump allocator for memory needed while a request is processed
+ (decoded query, response, encoded message). Allocation is a pointer bump,
+ deallocation does nothing and the whole arena is reset after the request.
+ Only requests, which don't fit in the initial buffer, reach the heap.
+ */
+class DNSArena final
+{
+public:
+	DNSArena(const DNSArena&) = delete;
+	DNSArena& operator=(const DNSArena&) = delete;
+
+	static DNSArena& local()
+	{
+		static thread_local DNSArena arena;
+		return arena;
+	}
+
+	std::pmr::memory_resource* resource()
+	{
+		return &_resource;
+	}
+
+	void reset()
+	{
+		_resource.release();
+	}
+
+private:
+	DNSArena()
+		: _resource(_buffer, sizeof(_buffer))
+	{
+	}
+
+	~DNSArena() = default;
+
+private:
+	static const std::size_t ARENA_SIZE = 64 * 1024;
+
+	alignas(std::max_align_t) std::byte _buffer[ARENA_SIZE];
+	std::pmr::monotonic_buffer_resource _resource;
+};
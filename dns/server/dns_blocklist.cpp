@@ -0,0 +1,388 @@
+#include "dns_blocklist.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+
+namespace
+{
+
+const char IMAGE_MAGIC[8] = { 'D', 'N', 'S', 'B', 'L', 'K', '0', '1' };
+
+struct ImageHeader
+{
+	char magic[8];
+	std::uint64_t blockCount;
+	std::uint64_t hashCount;
+};
+
+const std::uint64_t FNV_OFFSET = 0xCBF29CE484222325ULL;
+const std::uint64_t FNV_PRIME = 0x100000001B3ULL;
+
+const std::size_t WORDS_PER_BLOCK = 8;	// 512 bits, one cache line
+const std::size_t BITS_PER_ENTRY = 12;
+const unsigned PROBES_COUNT = 6;
+const std::size_t MAX_SUFFIXES = 128;	// a name has at most 127 labels
+const unsigned INTERPOLATION_STEPS = 4;
+
+inline std::uint64_t finalize(std::uint64_t h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// hosts files start with entries for the machine itself, these are never blocked
+const char* const LOCAL_NAMES[] = {
+	"localhost", "localhost.localdomain", "local", "broadcasthost",
+	"ip6-localhost", "ip6-loopback", "ip6-localnet", "ip6-mcastprefix",
+	"ip6-allnodes", "ip6-allrouters", "ip6-allhosts", "0.0.0.0"
+};
+
+bool isAddress(const std::string& token)
+{
+	return token.find(':') != std::string::npos
+		|| token.find_first_not_of("0123456789.") == std::string::npos;
+}
+
+bool isSinkhole(const std::string& address)
+{
+	return address == "0.0.0.0" || address == "127.0.0.1" || address == "::" || address == "::1";
+}
+
+bool isLocalName(const std::string& name)
+{
+	return std::any_of(std::begin(LOCAL_NAMES), std::end(LOCAL_NAMES),
+		[&name](const char* local) { return ::strcasecmp(name.c_str(), local) == 0; });
+}
+
+inline std::uint64_t step(std::uint64_t h, char c)
+{
+	const unsigned char x = static_cast<unsigned char>(c);
+	return (h ^ ((x >= 'A' && x <= 'Z') ? (x | 0x20) : x)) * FNV_PRIME;
+}
+
+}
+
+
+DNSBlocklist::~DNSBlocklist()
+{
+	if (_mapping != nullptr)
+	{
+		::munmap(_mapping, _mappingSize);
+	}
+}
+
+std::shared_ptr<const DNSBlocklist> DNSBlocklist::loadFromFile(const std::string& filename)
+{
+	std::ifstream inFile(filename, std::ios::binary);
+	if (!inFile)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromFile() ): could not open file '" << filename << "'\n";
+		return nullptr;
+	}
+
+	char magic[sizeof(IMAGE_MAGIC)] = { 0 };
+	inFile.read(magic, sizeof(magic));
+	inFile.close();
+
+	if (std::memcmp(magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0)
+	{
+		return loadFromImage(filename);
+	}
+	return loadFromText(filename);
+}
+
+std::shared_ptr<DNSBlocklist> DNSBlocklist::loadFromText(const std::string& filename)
+{
+	std::ifstream inFile(filename);
+	if (!inFile)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromText() ): could not open file '" << filename << "'\n";
+		return nullptr;
+	}
+
+	std::vector<std::uint64_t> hashes;
+	std::string line;
+	while (std::getline(inFile, line))
+	{
+		std::size_t p = line.find('#');
+		if (p != std::string::npos)
+		{
+			line.erase(p);
+		}
+
+		// plain list of domains or hosts file format ("0.0.0.0 domain [domain ...]")
+		std::istringstream iss(line);
+		std::string first;
+		if (!(iss >> first))
+		{
+			continue;
+		}
+
+		if (!isAddress(first))
+		{
+			hashes.push_back(hashName(first.data(), first.length()));
+			continue;
+		}
+
+		// only sinkhole addresses block, other lines map real hosts
+		if (!isSinkhole(first))
+		{
+			continue;
+		}
+
+		std::string domain;
+		while (iss >> domain)
+		{
+			if (!isLocalName(domain))
+			{
+				hashes.push_back(hashName(domain.data(), domain.length()));
+			}
+		}
+	}
+
+	std::shared_ptr<DNSBlocklist> blocklist(new DNSBlocklist());
+	blocklist->build(std::move(hashes));
+	return blocklist;
+}
+
+std::shared_ptr<DNSBlocklist> DNSBlocklist::loadFromImage(const std::string& filename)
+{
+	int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromImage() ): could not open file '" << filename << "'\n";
+		return nullptr;
+	}
+
+	struct stat st;
+	if (::fstat(fd, &st) == -1 || static_cast<std::size_t>(st.st_size) < sizeof(ImageHeader))
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromImage() ): invalid image '" << filename << "'\n";
+		::close(fd);
+		return nullptr;
+	}
+
+	void* mapping = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+	::close(fd);
+	if (mapping == MAP_FAILED)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromImage() ): mmap failed for '" << filename << "'\n";
+		return nullptr;
+	}
+
+	std::shared_ptr<DNSBlocklist> blocklist(new DNSBlocklist());
+	blocklist->_mapping = mapping;
+	blocklist->_mappingSize = st.st_size;
+
+	const ImageHeader* header = static_cast<const ImageHeader*>(mapping);
+	const std::uint64_t blockCount = header->blockCount;
+	const std::uint64_t hashCount = header->hashCount;
+	if (blockCount == 0 || (blockCount & (blockCount - 1)) != 0
+		|| sizeof(ImageHeader) + (blockCount * WORDS_PER_BLOCK + hashCount) * sizeof(std::uint64_t) != blocklist->_mappingSize)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::loadFromImage() ): invalid image '" << filename << "'\n";
+		return nullptr;
+	}
+
+	const std::uint64_t* words = reinterpret_cast<const std::uint64_t*>(header + 1);
+	blocklist->_bloom = words;
+	blocklist->_blockMask = blockCount - 1;
+	blocklist->_hashes = words + blockCount * WORDS_PER_BLOCK;
+	blocklist->_hashCount = hashCount;
+
+	return blocklist;
+}
+
+bool DNSBlocklist::writeImage(const std::string& filename) const
+{
+	std::ofstream outFile(filename, std::ios::binary | std::ios::trunc);
+	if (!outFile)
+	{
+		std::cerr << "ERROR ( DNSBlocklist::writeImage() ): could not open file '" << filename << "'\n";
+		return false;
+	}
+
+	ImageHeader header;
+	std::memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	header.blockCount = _blockMask + 1;
+	header.hashCount = _hashCount;
+
+	outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	outFile.write(reinterpret_cast<const char*>(_bloom), header.blockCount * WORDS_PER_BLOCK * sizeof(std::uint64_t));
+	outFile.write(reinterpret_cast<const char*>(_hashes), _hashCount * sizeof(std::uint64_t));
+
+	return static_cast<bool>(outFile);
+}
+
+bool DNSBlocklist::contains(const char* name, std::size_t length) const
+{
+	if (_hashCount == 0)
+	{
+		return false;
+	}
+
+	if (length != 0 && name[length - 1] == '.')
+	{
+		length -= 1;
+	}
+
+	// The name is hashed from the last character to the first one,
+	// so the hash of every parent domain is obtained on the way
+	// when the label boundary is reached. Filter blocks of all suffixes
+	// are prefetched before the first one is checked, so their cache
+	// misses overlap instead of following each other.
+	std::uint64_t hashes[MAX_SUFFIXES];
+	std::size_t count = 0;
+	std::uint64_t h = FNV_OFFSET;
+	for (const char* p = name + length; p != name; )
+	{
+		--p;
+		if (*p == '.' && count < MAX_SUFFIXES - 1)
+		{
+			hashes[count] = finalize(h);
+			bloomPrefetch(hashes[count++]);
+		}
+		h = step(h, *p);
+	}
+	hashes[count] = finalize(h);
+	bloomPrefetch(hashes[count++]);
+
+	for (std::size_t i = 0; i < count; i++)
+	{
+		if (bloomCheck(hashes[i]) && confirm(hashes[i]))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+void DNSBlocklist::build(std::vector<std::uint64_t>&& hashes)
+{
+	std::sort(hashes.begin(), hashes.end());
+	hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+
+	std::size_t blockCount = 1;
+	while (blockCount * WORDS_PER_BLOCK * 64 < hashes.size() * BITS_PER_ENTRY)
+	{
+		blockCount <<= 1;
+	}
+
+	_bloomStorage.assign(blockCount * WORDS_PER_BLOCK, 0);
+	_bloom = _bloomStorage.data();
+	_blockMask = blockCount - 1;
+
+	for (const std::uint64_t hash : hashes)
+	{
+		bloomAdd(hash);
+	}
+
+	_hashStorage = std::move(hashes);
+	_hashes = _hashStorage.data();
+	_hashCount = _hashStorage.size();
+}
+
+void DNSBlocklist::bloomPrefetch(std::uint64_t hash) const
+{
+	__builtin_prefetch(_bloom + (hash & _blockMask) * WORDS_PER_BLOCK);
+}
+
+bool DNSBlocklist::bloomCheck(std::uint64_t hash) const
+{
+	const std::uint64_t* block = _bloom + (hash & _blockMask) * WORDS_PER_BLOCK;
+	std::uint64_t bits = (hash * 0x9E3779B97F4A7C15ULL) >> 10;
+	for (unsigned i = 0; i < PROBES_COUNT; i++, bits >>= 9)
+	{
+		const unsigned bit = bits & 511;
+		if ((block[bit >> 6] & (1ULL << (bit & 63))) == 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+void DNSBlocklist::bloomAdd(std::uint64_t hash)
+{
+	std::uint64_t* block = _bloomStorage.data() + (hash & _blockMask) * WORDS_PER_BLOCK;
+	std::uint64_t bits = (hash * 0x9E3779B97F4A7C15ULL) >> 10;
+	for (unsigned i = 0; i < PROBES_COUNT; i++, bits >>= 9)
+	{
+		const unsigned bit = bits & 511;
+		block[bit >> 6] |= 1ULL << (bit & 63);
+	}
+}
+
+bool DNSBlocklist::confirm(std::uint64_t hash) const
+{
+	// Hashes are spread uniformly, so interpolation finds the position
+	// in a few probes where binary search takes a cache miss per step.
+	// Unlucky distributions fall back to binary search of the rest.
+	std::size_t lo = 0;
+	std::size_t hi = _hashCount - 1;
+	for (unsigned i = 0; i < INTERPOLATION_STEPS; i++)
+	{
+		if (hash < _hashes[lo] || hash > _hashes[hi])
+		{
+			return false;
+		}
+		if (_hashes[hi] == _hashes[lo])
+		{
+			return _hashes[lo] == hash;
+		}
+
+		const double fraction = static_cast<double>(hash - _hashes[lo]) / static_cast<double>(_hashes[hi] - _hashes[lo]);
+		const std::size_t pos = lo + std::min(static_cast<std::size_t>(fraction * (hi - lo)), hi - lo);
+		if (_hashes[pos] == hash)
+		{
+			return true;
+		}
+		if (_hashes[pos] < hash)
+		{
+			lo = pos + 1;
+		}
+		else if (pos == 0)
+		{
+			return false;
+		}
+		else
+		{
+			hi = pos - 1;
+		}
+		if (lo > hi)
+		{
+			return false;
+		}
+	}
+
+	return std::binary_search(_hashes + lo, _hashes + hi + 1, hash);
+}
+
+std::uint64_t DNSBlocklist::hashName(const char* name, std::size_t length)
+{
+	if (length != 0 && name[length - 1] == '.')
+	{
+		length -= 1;
+	}
+
+	std::uint64_t h = FNV_OFFSET;
+	for (const char* p = name + length; p != name; )
+	{
+		h = step(h, *--p);
+	}
+	return finalize(h);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/*
+ Immutable set of blocked domains. A name matches, if it or any of its
+ parent domains (label suffixes) is listed.
+
+ Every listed domain is stored as 64-bit hash only. Lookup goes through
+ a blocked Bloom filter first (all probes of a key hit one cache line),
+ positive answers are confirmed by binary search in the sorted hash array.
+
+ The list may be loaded either from a text file (one domain per line,
+ '#' starts a comment) or from a binary image produced by writeImage().
+ Hosts files are accepted too: names on 0.0.0.0/127.0.0.1/::/::1 lines
+ are blocked except localhost and the like, other lines are ignored.
+ The image is mapped into memory as is, so startup with several million
+ entries doesn't require to parse and hash the text again.
+ */
+class DNSBlocklist final
+{
+public:
+	~DNSBlocklist();
+
+	DNSBlocklist(const DNSBlocklist&) = delete;
+	DNSBlocklist& operator=(const DNSBlocklist&) = delete;
+
+	static std::shared_ptr<const DNSBlocklist> loadFromFile(const std::string& filename);
+
+	bool writeImage(const std::string& filename) const;
+
+	bool contains(const char* name, std::size_t length) const;
+
+	bool contains(const std::string& name) const
+	{
+		return contains(name.data(), name.length());
+	}
+
+	std::size_t size() const { return _hashCount; }
+
+private:
+	DNSBlocklist() = default;
+
+	static std::shared_ptr<DNSBlocklist> loadFromText(const std::string& filename);
+	static std::shared_ptr<DNSBlocklist> loadFromImage(const std::string& filename);
+
+	void build(std::vector<std::uint64_t>&& hashes);
+
+	void bloomPrefetch(std::uint64_t hash) const;
+	bool bloomCheck(std::uint64_t hash) const;
+	void bloomAdd(std::uint64_t hash);
+	bool confirm(std::uint64_t hash) const;
+
+	static std::uint64_t hashName(const char* name, std::size_t length);
+
+private:
+	// memory of the filter and of the hash array is owned by
+	// either vectors below or by mapping of the image file
+	std::vector<std::uint64_t> _bloomStorage;
+	std::vector<std::uint64_t> _hashStorage;
+	void* _mapping = nullptr;
+	std::size_t _mappingSize = 0;
+
+	const std::uint64_t* _bloom = nullptr;
+	std::uint64_t _blockMask = 0;
+	const std::uint64_t* _hashes = nullptr;
+	std::size_t _hashCount = 0;
+};
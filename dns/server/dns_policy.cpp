@@ -0,0 +1,76 @@
+#include "dns_policy.h"
+
+#include <iostream>
+
+#include "dns_query.h"
+#include "dns_response.h"
+
+
+DNSPolicy::DNSPolicy(Action action, const std::string& sinkholeAddress /*= std::string()*/)
+	: _action(action)
+	, _sinkholeAddress(sinkholeAddress)
+{
+
+}
+
+bool DNSPolicy::loadBlocklist(const std::string& filename)
+{
+	_filename = filename;
+	return reload();
+}
+
+bool DNSPolicy::reload()
+{
+	if (_filename.empty())
+	{
+		return false;
+	}
+
+	std::shared_ptr<const DNSBlocklist> blocklist(DNSBlocklist::loadFromFile(_filename));
+	if (!blocklist)
+	{
+		std::cerr << "ERROR ( DNSPolicy::reload() ): blocklist '" << _filename << "' is not loaded, keep the previous one\n";
+		return false;
+	}
+
+	std::cout << "TRACE ( DNSPolicy::reload() ) Blocklist '" << _filename << "' loaded, "
+		<< blocklist->size() << " domains\n";
+
+	std::atomic_store(&_blocklist, blocklist);
+	return true;
+}
+
+bool DNSPolicy::apply(const DNSQuery& query, DNSResponse& response) const
+{
+	std::shared_ptr<const DNSBlocklist> blocklist(std::atomic_load(&_blocklist));
+	if (!blocklist)
+	{
+		return false;
+	}
+
+	const std::pmr::string& qname(query.getName());
+	if (!blocklist->contains(qname.data(), qname.length()))
+	{
+		return false;
+	}
+
+	response.setId(query.getId());
+	response.setQCount(1);
+	response.setName(qname);
+	response.setType(query.getType());
+	response.setClass(query.getClass());
+
+	if (_action == Action::Sinkhole)
+	{
+		response.setACount(1);
+		response.setData(_sinkholeAddress);
+		response.setRCode(DNSResponse::Rcode::NoError);
+	}
+	else
+	{
+		response.setACount(0);
+		response.setRCode(DNSResponse::Rcode::Refused);
+	}
+
+	return true;
+}
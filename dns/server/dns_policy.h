@@ -0,0 +1,41 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "dns_blocklist.h"
+
+
+class DNSQuery;
+class DNSResponse;
+
+// Response policy, applied to every query before it reaches the resolver.
+class DNSPolicy final
+{
+public:
+	enum class Action
+	{
+		Refuse,		// answer with rcode REFUSED
+		Sinkhole,	// answer with the sinkhole address
+	};
+
+public:
+	explicit DNSPolicy(Action action, const std::string& sinkholeAddress = std::string());
+	~DNSPolicy() = default;
+
+	DNSPolicy(const DNSPolicy&) = delete;
+	DNSPolicy& operator=(const DNSPolicy&) = delete;
+
+	bool loadBlocklist(const std::string& filename);
+	bool reload();
+
+	// returns true, if the query matched the blocklist and response is prepared
+	bool apply(const DNSQuery& query, DNSResponse& response) const;
+
+private:
+	Action _action;
+	std::string _sinkholeAddress;
+	std::string _filename;
+	// replaced atomically (std::atomic_load/atomic_store) on reload
+	std::shared_ptr<const DNSBlocklist> _blocklist;
+};
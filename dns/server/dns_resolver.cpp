@@ -1,34 +1,42 @@
 #include "dns_resolver.h"
 
 #include <cctype>
+#include <cstdlib>
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include "dns_query.h"
 #include "dns_response.h"
 
+
+static const std::uint32_t MAX_WEIGHT = 100;
+
 void DNSResolver::process(const DNSQuery& query, DNSResponse& response)
 {
-	const std::string qname(query.getName());
+	const std::string_view qname(query.getName());
 
-	// TO DO: check, if qname ends with suffix .in-addr.arpa
-	std::string rdata;
+	std::string_view rdata;
 
-	const std::string ipAddr(getIpAddrFromQname(qname));
-	if (!ipAddr.empty())
+	char ipAddr[16];
+	std::size_t ipAddrLength = 0;
+	if (getIpAddrFromQname(qname, ipAddr, ipAddrLength))
 	{
-		rdata = findDomainName(ipAddr);		// const std::string domainName(findDomainName(ipAddr));
+		rdata = findDomainName(std::string_view(ipAddr, ipAddrLength));
 	}
 	else
 	{
 		rdata = findAddress(qname);
 	}
 
-	std::cout << "Processing DNS query: "
-		<< "\nrequested name " << qname
-		<< "\nresponse data " << rdata
-		<< "\n--------------" << std::endl;
+	if (_trace)
+	{
+		std::cout << "Processing DNS query: "
+			<< "\nrequested name " << qname
+			<< "\nresponse data " << rdata
+			<< "\n--------------" << std::endl;
+	}
 
 	response.setId(query.getId());
 	response.setQCount(1);
@@ -63,6 +71,58 @@ void DNSResolver::loadRecordsFromFile(const std::string& filename)
 	{
 		addLine(line);
 	}
+
+	for (auto& rrset : _rrsets)
+	{
+		buildSchedule(rrset.second);
+	}
+}
+
+void DNSResolver::loadHealthFromFile(const std::string& filename)
+{
+	_healthFile = filename;
+	reloadHealth();
+}
+
+void DNSResolver::reloadHealth()
+{
+	if (_healthFile.empty())
+	{
+		return;
+	}
+
+	std::ifstream inFile(_healthFile);
+	if (!inFile)
+	{
+		std::cerr << "ERROR ( DNSResolver::reloadHealth() ): DNS resolver could not open file '" << _healthFile << "'\n";
+		return;
+	}
+
+	std::string line;
+	while (std::getline(inFile, line))
+	{
+		std::istringstream iss(line);
+		std::string ipAddr, state;
+		if (!(iss >> ipAddr >> state) || (state != "up" && state != "down"))
+		{
+			std::cerr << "ERROR ( DNSResolver::reloadHealth() ): Invalid line " << line << std::endl;
+			continue;
+		}
+
+		auto it = _health.find(ipAddr);
+		if (it == _health.end())
+		{
+			std::cerr << "ERROR ( DNSResolver::reloadHealth() ): Unknown address " << ipAddr << std::endl;
+			continue;
+		}
+
+		it->second.store(state == "up", std::memory_order_relaxed);
+	}
+
+	for (auto& rrset : _rrsets)
+	{
+		buildSchedule(rrset.second);
+	}
 }
 
 // std::string DNSResolver::lookup(const std::string& ipAddr) const
@@ -76,76 +136,142 @@ void DNSResolver::loadRecordsFromFile(const std::string& filename)
 
 void DNSResolver::addLine(const std::string& line)
 {
-	std::size_t p = line.find(' ');
-	if (p == std::string::npos)
+	std::istringstream iss(line);
+	std::string ipAddr, domainName;
+	if (!(iss >> ipAddr >> domainName))
 	{
 		std::cerr << "ERROR ( DNSResolver::addLine() ): Invalid line " << line << std::endl;
 		return;
 	}
 
-	const std::string ipAddr(line.substr(0, p));
-
-	while (p < line.length() && std::isspace(line[p]))
+	// a mistyped weight would silently make the address the lightest or the heaviest one
+	std::uint32_t weight = 1;
+	std::string weightText;
+	if (iss >> weightText)
 	{
-		p += 1;
+		char* end = nullptr;
+		const long value = std::strtol(weightText.c_str(), &end, 10);
+		if (*end != '\0' || value < 1 || value > static_cast<long>(MAX_WEIGHT))
+		{
+			std::cerr << "ERROR ( DNSResolver::addLine() ): Invalid weight " << weightText << " in line " << line << std::endl;
+			return;
+		}
+		weight = static_cast<std::uint32_t>(value);
 	}
 
-	if (p == line.length())
+	const std::string_view ip(intern(ipAddr));
+	const std::string_view name(intern(domainName));
+
+	std::atomic<bool>& healthy = _health[ip];
+	healthy.store(true, std::memory_order_relaxed);
+
+	Address address;
+	address._ip = ip;
+	address._weight = weight;
+	address._healthy = &healthy;
+	_rrsets[name]._addresses.push_back(address);
+
+	_domainNames.emplace(ip, name);
+}
+
+std::string_view DNSResolver::intern(const std::string& s)
+{
+	return *_strings.insert(s).first;
+}
+
+void DNSResolver::buildSchedule(RRSet& rrset)
+{
+	// Smooth weighted round-robin: heavier addresses are spread over
+	// the cycle instead of being returned several times in a row.
+	// Only healthy addresses take part, so the share of a down address
+	// is split by weight among the others rather than given to whichever
+	// address follows it. If all of them are down, all take part.
+	const auto isUp = [](const Address& address) { return address._healthy->load(std::memory_order_relaxed); };
+	const bool anyUp = std::any_of(rrset._addresses.cbegin(), rrset._addresses.cend(), isUp);
+
+	std::uint32_t total = 0;
+	for (const Address& address : rrset._addresses)
 	{
-		std::cerr << "ERROR ( DNSResolver::addLine() ): Invalid line " << line << std::endl;
-		return;
+		total += !anyUp || isUp(address) ? address._weight : 0;
 	}
 
-	const std::string domainName(line.substr(p));
-
-	_records.emplace_back(std::make_pair(ipAddr, domainName));
+	std::vector<std::int64_t> current(rrset._addresses.size(), 0);
+	rrset._schedule.clear();
+	rrset._schedule.reserve(total);
+	for (std::uint32_t n = 0; n < total; n++)
+	{
+		std::size_t best = rrset._addresses.size();
+		for (std::size_t i = 0; i < current.size(); i++)
+		{
+			if (anyUp && !isUp(rrset._addresses[i]))
+			{
+				continue;
+			}
+			current[i] += rrset._addresses[i]._weight;
+			if (best == rrset._addresses.size() || current[i] > current[best])
+			{
+				best = i;
+			}
+		}
+		current[best] -= total;
+		rrset._schedule.push_back(static_cast<std::uint32_t>(best));
+	}
 }
 
-std::string DNSResolver::findAddress(const std::string& domainName) const
+std::string_view DNSResolver::findAddress(std::string_view domainName) const
 {
-	std::list<Record>::const_iterator it = 
-		std::find_if(_records.cbegin(), _records.cend(), 
-			[&domainName](const Record& record)
-			{ return record.second == domainName; });
-	return it != _records.cend() ? it->first : std::string();
+	auto it = _rrsets.find(domainName);
+	if (it == _rrsets.cend() || it->second._schedule.empty())
+	{
+		return std::string_view();
+	}
+
+	// the schedule is rebuilt when health changes, it holds healthy addresses only
+	const RRSet& rrset = it->second;
+	const std::uint32_t n = rrset._counter.fetch_add(1, std::memory_order_relaxed);
+	return rrset._addresses[rrset._schedule[n % rrset._schedule.size()]]._ip;
 }
 
-std::string DNSResolver::findDomainName(const std::string& ipAddr) const
+std::string_view DNSResolver::findDomainName(std::string_view ipAddr) const
 {
-	std::list<Record>::const_iterator it = 
-		std::find_if(_records.cbegin(), _records.cend(), 
-			[&ipAddr](const Record& record)
-			{ return record.first == ipAddr; });
-	return it != _records.cend() ? it->second : std::string();
+	auto it = _domainNames.find(ipAddr);
+	return it != _domainNames.cend() ? it->second : std::string_view();
 }
 
-std::string DNSResolver::getIpAddrFromQname(const std::string& qname)
+bool DNSResolver::getIpAddrFromQname(std::string_view qname, char (&ipAddr)[16], std::size_t& length)
 {
 	std::size_t p = qname.find(".in-addr.arpa");
-	if (p == std::string::npos)
+	if (p == std::string_view::npos || p >= sizeof(ipAddr))
 	{
-		return std::string();
+		return false;
 	}
 
-	std::string ipAddr;
-	std::string tmp(qname, 0, p);
-	while ((p = tmp.rfind('.')) != std::string::npos)
+	// octets are in reverse order: 4.3.2.1.in-addr.arpa
+	length = 0;
+	std::string_view tmp(qname.substr(0, p));
+	while ((p = tmp.rfind('.')) != std::string_view::npos)
 	{
-		ipAddr.append(tmp, p + 1);
-		ipAddr.push_back('.');
-		tmp.erase(p);
+		tmp.copy(ipAddr + length, tmp.length() - p - 1, p + 1);
+		length += tmp.length() - p - 1;
+		ipAddr[length++] = '.';
+		tmp.remove_suffix(tmp.length() - p);
 	}
-	ipAddr.append(tmp);
+	tmp.copy(ipAddr + length, tmp.length());
+	length += tmp.length();
 
-	return ipAddr;
+	return true;
 }
 
 void DNSResolver::printRecords() const
 {
 	std::cout << "TRACE ( DNSResolver::printRecords() ) Records, known to DNS resolver:\n";
-	for (const Record& record : _records)
+	for (const auto& rrset : _rrsets)
 	{
-		std::cout << record.first << " ---- " << record.second << std::endl;
+		for (const Address& address : rrset.second._addresses)
+		{
+			std::cout << address._ip << " ---- " << rrset.first
+				<< " (weight " << address._weight << (address._healthy->load() ? ", up)" : ", down)") << std::endl;
+		}
 	}
 	std::cout << "-------------------------------\n";
 }
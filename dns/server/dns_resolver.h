@@ -1,7 +1,12 @@
 #pragma once
 
-#include <list>
+#include <atomic>
+#include <cstdint>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 
 class DNSQuery;
@@ -9,7 +14,20 @@ class DNSResponse;
 
 class DNSResolver final
 {
-	using Record = std::pair<std::string, std::string>;
+	struct Address
+	{
+		std::string_view _ip;
+		std::uint32_t _weight = 1;
+		const std::atomic<bool>* _healthy = nullptr;
+	};
+
+	// addresses of one name, answers rotate in smooth weighted round-robin order
+	struct RRSet
+	{
+		std::vector<Address> _addresses;
+		std::vector<std::uint32_t> _schedule;
+		mutable std::atomic<std::uint32_t> _counter{0};
+	};
 
 public:
 	DNSResolver() = default;
@@ -20,20 +38,43 @@ public:
 
 	void process(const DNSQuery& query, DNSResponse& response);
 
+	// prints every query and its answer, slows the server down
+	void setTrace(bool trace)
+	{
+		_trace = trace;
+	}
+
 public:
+	// line format: <ip-address> <domain-name> [<weight>], the weight is 1..100,
+	// a line with any other weight is skipped
 	void loadRecordsFromFile(const std::string& filename);
 
+	// line format: <ip-address> up|down
+	// unhealthy addresses are skipped in answers, unless all addresses of the name are down
+	void loadHealthFromFile(const std::string& filename);
+	void reloadHealth();
+
 	void printRecords() const;
 
 
 private:
 	void addLine(const std::string& line);
+	void buildSchedule(RRSet& rrset);
+
+	std::string_view intern(const std::string& s);
 
-	std::string findAddress(const std::string& domainName) const;
-	std::string findDomainName(const std::string& ipAddr) const;
+	std::string_view findAddress(std::string_view domainName) const;
+	std::string_view findDomainName(std::string_view ipAddr) const;
 
-	static std::string getIpAddrFromQname(const std::string& qname);
+	static bool getIpAddrFromQname(std::string_view qname, char (&ipAddr)[16], std::size_t& length);
 
 private:
-	std::list<Record> _records;
+	// keys of the maps refer to the strings owned by this set,
+	// so lookup by a name from query doesn't need a std::string
+	std::unordered_set<std::string> _strings;
+	std::unordered_map<std::string_view, RRSet> _rrsets;
+	std::unordered_map<std::string_view, std::string_view> _domainNames;
+	std::unordered_map<std::string_view, std::atomic<bool>> _health;
+	std::string _healthFile;
+	bool _trace = false;
 };
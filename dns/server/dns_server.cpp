@@ -1,10 +1,15 @@
 #include <csignal>
 
+#include <openssl/ssl.h>
+
 #include <iostream>
 #include <stdexcept>
 #include <vector>
 
 #include "dns_server.h"
+#include "dns_arena.h"
+#include "dns_policy.h"
+#include "dns_stream_session.h"
 #include "dns_query.h"
 #include "dns_response.h"
 #include "dns_resolver.h"
@@ -14,8 +19,10 @@ DNSServer::DNSServer(const std::string& addr, std::uint16_t port, bool reuseAddr
 	: _addr(addr)
 	, _port(port)
 	, _ioContext(1)
-	, _signal(_ioContext, SIGINT, SIGTERM)
+	, _signal(_ioContext, SIGINT, SIGTERM, SIGHUP)
 	, _socket(_ioContext)
+	, _tcpAcceptor(_ioContext)
+	, _tlsAcceptor(_ioContext)
 {
 	// TO DO: reuseAddr
 }
@@ -44,6 +51,18 @@ void DNSServer::start()
         throw std::runtime_error("Could not start server (socket bind failed)");
     }
 
+    if (_tcpPort != 0)
+    {
+        openAcceptor(_tcpAcceptor, _tcpPort);
+        acceptTcp();
+    }
+
+    if (_tlsPort != 0)
+    {
+        openAcceptor(_tlsAcceptor, _tlsPort);
+        acceptTls();
+    }
+
     waitSignal();
     receive();
 
@@ -67,70 +86,22 @@ void DNSServer::stop()
 
 void DNSServer::receive()
 {
-	/* Article about reading unspecified amount of bytes,
-	 and how to allocate read buffer "on the fly" 
-	 http://breese.github.io/2016/12/03/receiving-datagrams.html
-	 */
-
-	_socket.async_receive_from(asio::null_buffers(), _clientEndpoint,
+	// the buffer fits any datagram, so there is no need to ask
+	// for amount of readable bytes and allocate buffer per request
+	_socket.async_receive_from(asio::buffer(_request), _clientEndpoint,
 		[this](std::error_code ec, std::size_t sz)
 		{
 			if (!ec)
 			{
 				// std::cout << "Received " << sz << " bytes.\n";
-				udp::socket::bytes_readable cmdReadable(true);
-
-				_socket.io_control(cmdReadable, ec);
-				if (!ec)
+				_response.clear();
+				if (handleQuery(_request.data(), sz, _response))
 				{
-					std::size_t readableAmount = cmdReadable.get();
-					// std::cout << "Available to read: " << readableAmount << " bytes.\n";
-
-					std::vector<std::uint8_t> buffer(readableAmount);
-					sz = _socket.receive_from(asio::buffer(buffer.data(), buffer.size()), _clientEndpoint, 0, ec);
-					if (!ec)
-					{
-						// std::cout << "Received " << sz << " bytes.\n";
-						// TO DO: process received data and send back response
-						// TO DO: implement asynchronous processing
-						try
-						{
-							DNSQuery dnsQuery;
-							std::size_t n = dnsQuery.decode(buffer);
-							// std::cout << "Decoded " << n << " bytes.\n";
-
-							if (dnsQuery.getFlagQR())
-							{
-								throw std::logic_error("Received message is not query.");
-							}
-
-							// DNSResponse dnsResponse(dnsQuery.getId());
-							DNSResponse dnsResponse;
-
-							assert(_resolver != NULL);
-							_resolver->process(dnsQuery, dnsResponse);
-
-							// std::cout << "Response is:\n";
-							// dnsResponse.dump(std::cout);
-							// std::cout << std::endl;
-							sendResponse(dnsResponse.encode());
-						}
-						catch (const std::exception& ex)
-						{
-							std::cerr << "Exception when processing DNS message: "
-								<< ex.what() << std::endl;
-						}
-					}
-					else
-					{
-						std::cerr << "Read failed. ";
-						std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
-					}
+					sendResponse();
 				}
 				else
 				{
-					std::cerr << "IOControl failed. ";
-					std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+					receive();
 				}
 			}
 			else
@@ -143,9 +114,9 @@ void DNSServer::receive()
 		});
 }
 
-void DNSServer::sendResponse(std::vector<std::uint8_t>&& buffer)
+void DNSServer::sendResponse()
 {
-	_socket.async_send_to(asio::buffer(buffer.data(), buffer.size()), _clientEndpoint,
+	_socket.async_send_to(asio::buffer(_response.data(), _response.size()), _clientEndpoint,
 		[this](std::error_code ec, std::size_t sz)
 		{
 			if (ec)
@@ -161,13 +132,176 @@ void DNSServer::sendResponse(std::vector<std::uint8_t>&& buffer)
 		});
 }
 
+bool DNSServer::handleQuery(const std::uint8_t* query, std::size_t size, std::vector<std::uint8_t>& response)
+{
+	// TO DO: implement asynchronous processing
+	DNSArena& arena = DNSArena::local();
+	bool result = false;
+
+	try
+	{
+		DNSQuery dnsQuery(arena.resource());
+		std::size_t n = dnsQuery.decode(query, size);
+		// std::cout << "Decoded " << n << " bytes.\n";
+
+		if (dnsQuery.getFlagQR())
+		{
+			throw std::logic_error("Received message is not query.");
+		}
+
+		// DNSResponse dnsResponse(dnsQuery.getId());
+		DNSResponse dnsResponse(arena.resource());
+
+		if (_policy == NULL || !_policy->apply(dnsQuery, dnsResponse))
+		{
+			assert(_resolver != NULL);
+			_resolver->process(dnsQuery, dnsResponse);
+		}
+
+		// std::cout << "Response is:\n";
+		// dnsResponse.dump(std::cout);
+		// std::cout << std::endl;
+		const DNSMessage::Buffer encoded(dnsResponse.encode());
+		response.insert(response.end(), encoded.cbegin(), encoded.cend());
+		result = true;
+	}
+	catch (const std::exception& ex)
+	{
+		std::cerr << "Exception when processing DNS message: "
+			<< ex.what() << std::endl;
+	}
+
+	arena.reset();
+	return result;
+}
+
+void DNSServer::enableTcp(std::uint16_t port)
+{
+	_tcpPort = port;
+}
+
+void DNSServer::enableTls(std::uint16_t port, const std::string& certFile, const std::string& keyFile)
+{
+	_sslContext = std::make_unique<asio::ssl::context>(asio::ssl::context::tls_server);
+	_sslContext->set_options(asio::ssl::context::default_workarounds
+		| asio::ssl::context::no_sslv2 | asio::ssl::context::no_sslv3
+		| asio::ssl::context::no_tlsv1 | asio::ssl::context::no_tlsv1_1
+		| asio::ssl::context::single_dh_use);
+	_sslContext->use_certificate_chain_file(certFile);
+	_sslContext->use_private_key_file(keyFile, asio::ssl::context::pem);
+
+	// Resumption makes reconnect cheap: TLS 1.3 resumes with stateless tickets
+	// (the key is generated by OpenSSL and rotated with the process),
+	// TLS 1.2 clients may use either tickets or the server side session cache.
+	static const unsigned char SESSION_ID_CONTEXT[] = "dns-server";
+	SSL_CTX* ctx = _sslContext->native_handle();
+	SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_session_id_context(ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, 20480);
+	SSL_CTX_set_timeout(ctx, 7200);
+	SSL_CTX_set_num_tickets(ctx, 2);
+
+	_tlsPort = port;
+}
+
+void DNSServer::openAcceptor(tcp::acceptor& acceptor, std::uint16_t port)
+{
+	std::error_code ec;
+
+	acceptor.open(tcp::v4(), ec);
+	if (!ec)
+	{
+		acceptor.set_option(tcp::acceptor::reuse_address(true), ec);
+	}
+	if (!ec)
+	{
+		acceptor.bind({asio::ip::make_address(_addr), port}, ec);
+	}
+	if (!ec)
+	{
+		acceptor.listen(asio::socket_base::max_listen_connections, ec);
+	}
+
+	if (ec)
+	{
+		std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+		throw std::runtime_error("Could not start server (stream listener failed)");
+	}
+}
+
+void DNSServer::acceptTcp()
+{
+	_tcpAcceptor.async_accept(
+		[this](std::error_code ec, tcp::socket socket)
+		{
+			if (!_tcpAcceptor.is_open())
+			{
+				return;
+			}
+
+			if (!ec)
+			{
+				using namespace std::placeholders;
+				std::make_shared<DNSStreamSession<tcp::socket>>(
+					std::bind(&DNSServer::handleQuery, this, _1, _2, _3), std::move(socket))->start();
+			}
+			else
+			{
+				std::cerr << "AsyncAccept failed. ";
+				std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+			}
+
+			acceptTcp();
+		});
+}
+
+void DNSServer::acceptTls()
+{
+	_tlsAcceptor.async_accept(
+		[this](std::error_code ec, tcp::socket socket)
+		{
+			if (!_tlsAcceptor.is_open())
+			{
+				return;
+			}
+
+			if (!ec)
+			{
+				using namespace std::placeholders;
+				std::make_shared<DNSStreamSession<asio::ssl::stream<tcp::socket>>>(
+					std::bind(&DNSServer::handleQuery, this, _1, _2, _3), std::move(socket), *_sslContext)->start();
+			}
+			else
+			{
+				std::cerr << "AsyncAccept failed. ";
+				std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+			}
+
+			acceptTls();
+		});
+}
+
 void DNSServer::waitSignal()
 {
 	_signal.async_wait([this](std::error_code ec, int signo)
 		{
 			if (!ec)
 			{
-				std::cout << " signal #" << signal << std::endl;
+				std::cout << " signal #" << signo << std::endl;
+				if (signo == SIGHUP)
+				{
+					if (_policy != NULL)
+					{
+						_policy->reload();
+					}
+					if (_resolver != NULL)
+					{
+						_resolver->reloadHealth();
+					}
+					waitSignal();
+					return;
+				}
 				stop();
 			}
 			else
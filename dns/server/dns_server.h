@@ -1,14 +1,21 @@
 #pragma once
 
 #include <cstdint>
+#include <array>
+#include <memory>
 #include <string>
+#include <vector>
 
 #include <asio/io_context.hpp>
 #include <asio/signal_set.hpp>
+#include <asio/ip/tcp.hpp>
 #include <asio/ip/udp.hpp>
+#include <asio/ssl/context.hpp>
 
+using asio::ip::tcp;
 using asio::ip::udp;
 
+class DNSPolicy;
 class DNSResolver;
 
 class DNSServer final
@@ -28,9 +35,26 @@ public:
 		_resolver = resolver;
 	}
 
+	void setPolicy(DNSPolicy* policy)
+	{
+		_policy = policy;
+	}
+
+	// must be called before start()
+	void enableTcp(std::uint16_t port);
+	void enableTls(std::uint16_t port, const std::string& certFile, const std::string& keyFile);
+
+	// Processes one query synchronously, the encoded response is appended
+	// to the buffer. Every transport calls it, tests use it directly.
+	bool handleQuery(const std::uint8_t* query, std::size_t size, std::vector<std::uint8_t>& response);
+
 private:	
 	void receive();
-	void sendResponse(std::vector<std::uint8_t>&& buffer);
+	void sendResponse();
+
+	void acceptTcp();
+	void acceptTls();
+	void openAcceptor(tcp::acceptor& acceptor, std::uint16_t port);
 
 	void waitSignal();
 
@@ -41,5 +65,14 @@ private:
 	asio::signal_set _signal;
 	udp::socket _socket;
 	udp::endpoint _clientEndpoint;
+	static const std::size_t MAX_DATAGRAM_SIZE = 65536;
+	std::array<std::uint8_t, MAX_DATAGRAM_SIZE> _request;
+	std::vector<std::uint8_t> _response;
+	std::uint16_t _tcpPort = 0;
+	tcp::acceptor _tcpAcceptor;
+	std::uint16_t _tlsPort = 0;
+	tcp::acceptor _tlsAcceptor;
+	std::unique_ptr<asio::ssl::context> _sslContext;
 	DNSResolver* _resolver = NULL;
+	DNSPolicy* _policy = NULL;
 };
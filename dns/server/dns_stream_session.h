@@ -0,0 +1,327 @@
+#pragma once
+
+#include <cstdint>
+
+#include <array>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <asio/ip/tcp.hpp>
+#include <asio/read.hpp>
+#include <asio/steady_timer.hpp>
+#include <asio/write.hpp>
+#include <asio/ssl/stream.hpp>
+
+using asio::ip::tcp;
+
+
+/*
+ DNS over stream transport (RFC 7766 for TCP, RFC 7858 for TLS).
+ Every message is prefixed with 2-byte length. The next query is read
+ while responses for previous ones are written, so a client may pipeline
+ queries over one connection. Reading stops while too many responses wait
+ to be written and resumes when the client has taken them, and a connection
+ which makes no progress for IDLE_TIMEOUT is closed (RFC 7766, 6.2.3).
+ The Stream is either tcp::socket or asio::ssl::stream<tcp::socket>,
+ everything but handshake is the same for both of them.
+ */
+template <typename Stream>
+class DNSStreamSession final : public std::enable_shared_from_this<DNSStreamSession<Stream>>
+{
+public:
+	// appends the response to the buffer, false if there is nothing to send
+	using QueryHandler = std::function<bool (const std::uint8_t*, std::size_t, std::vector<std::uint8_t>&)>;
+
+public:
+	template <typename... Args>
+	DNSStreamSession(const QueryHandler& queryHandler, Args&&... args)
+		: _stream(std::forward<Args>(args)...)
+		, _idleTimer(_stream.lowest_layer().get_executor().context())
+		, _queryHandler(queryHandler)
+	{
+
+	}
+
+	~DNSStreamSession() = default;
+
+	DNSStreamSession(const DNSStreamSession&) = delete;
+	DNSStreamSession& operator=(const DNSStreamSession&) = delete;
+
+	void start()
+	{
+		// responses queued behind a write in progress must not wait for
+		// the client's delayed ACK of the previous one
+		std::error_code ignored;
+		_stream.lowest_layer().set_option(tcp::no_delay(true), ignored);
+
+		auto self(this->shared_from_this());
+		waitIdle();
+		handshake(_stream, [this, self](std::error_code ec)
+			{
+				if (ec)
+				{
+					if (ec != asio::error::operation_aborted)
+					{
+						std::cerr << "Handshake failed. ";
+						std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+					}
+					closeSocket();
+					return;
+				}
+				readLength();
+			});
+	}
+
+private:
+	static constexpr std::chrono::seconds IDLE_TIMEOUT{10};
+	static constexpr std::chrono::seconds SHUTDOWN_TIMEOUT{2};
+	static const std::size_t MAX_OUTSTANDING_RESPONSES = 64;
+
+	// Restarted whenever a query has been read or responses have been written.
+	// A connection which is idle, sends a query too slowly or doesn't read
+	// its responses gets its operations cancelled, and is closed by them.
+	void waitIdle()
+	{
+		auto self(this->shared_from_this());
+		_idleTimer.expires_after(IDLE_TIMEOUT);
+		_idleTimer.async_wait([this, self](std::error_code ec)
+			{
+				if (ec || _closing)
+				{
+					return;
+				}
+
+				std::error_code ignored;
+				_stream.lowest_layer().cancel(ignored);
+			});
+	}
+
+	void readLength()
+	{
+		auto self(this->shared_from_this());
+		asio::async_read(_stream, asio::buffer(_length),
+			[this, self](std::error_code ec, std::size_t sz)
+			{
+				if (ec)
+				{
+					finishReading(ec);
+					return;
+				}
+
+				std::size_t length = (static_cast<std::size_t>(_length[0]) << 8) | _length[1];
+				_query.resize(length);
+				readQuery();
+			});
+	}
+
+	void readQuery()
+	{
+		auto self(this->shared_from_this());
+		asio::async_read(_stream, asio::buffer(_query.data(), _query.size()),
+			[this, self](std::error_code ec, std::size_t sz)
+			{
+				if (ec)
+				{
+					finishReading(ec);
+					return;
+				}
+
+				waitIdle();
+				// the response is appended after room for its length
+				std::vector<std::uint8_t> frame(takeFrame());
+				frame.resize(2);
+				if (_queryHandler(_query.data(), _query.size(), frame))
+				{
+					const std::size_t length = frame.size() - 2;
+					frame[0] = static_cast<std::uint8_t>(length >> 8);
+					frame[1] = static_cast<std::uint8_t>(length & 0xFF);
+					sendResponse(std::move(frame));
+				}
+				else
+				{
+					frame.clear();
+					_freeFrames.push_back(std::move(frame));
+				}
+
+				if (_pendingFrames.size() + _writingFrames.size() >= MAX_OUTSTANDING_RESPONSES)
+				{
+					_readPaused = true;
+					return;
+				}
+				readLength();
+			});
+	}
+
+	// Frame buffers are recycled and responses queued while a write is in
+	// progress go out together with one gather write, so a busy connection
+	// doesn't allocate per query.
+	std::vector<std::uint8_t> takeFrame()
+	{
+		if (_freeFrames.empty())
+		{
+			return std::vector<std::uint8_t>();
+		}
+
+		std::vector<std::uint8_t> frame(std::move(_freeFrames.back()));
+		_freeFrames.pop_back();
+		return frame;
+	}
+
+	void sendResponse(std::vector<std::uint8_t>&& frame)
+	{
+		_pendingFrames.push_back(std::move(frame));
+		if (_writingFrames.empty())
+		{
+			writeResponses();
+		}
+	}
+
+	void writeResponses()
+	{
+		_writingFrames.swap(_pendingFrames);
+		_writeBuffers.clear();
+		for (const std::vector<std::uint8_t>& frame : _writingFrames)
+		{
+			_writeBuffers.push_back(asio::buffer(frame.data(), frame.size()));
+		}
+
+		auto self(this->shared_from_this());
+		asio::async_write(_stream, _writeBuffers,
+			[this, self](std::error_code ec, std::size_t sz)
+			{
+				if (ec)
+				{
+					if (ec != asio::error::operation_aborted)
+					{
+						std::cerr << "AsyncWrite failed. ";
+						std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+					}
+					closeSocket();
+					return;
+				}
+
+				waitIdle();
+				for (std::vector<std::uint8_t>& frame : _writingFrames)
+				{
+					frame.clear();
+					_freeFrames.push_back(std::move(frame));
+				}
+				_writingFrames.clear();
+
+				if (_readPaused && !_readFinished)
+				{
+					_readPaused = false;
+					readLength();
+				}
+
+				if (!_pendingFrames.empty())
+				{
+					writeResponses();
+				}
+				else if (_readFinished)
+				{
+					close();
+				}
+			});
+	}
+
+	void finishReading(const std::error_code& ec)
+	{
+		if (ec != asio::error::eof && ec != asio::error::operation_aborted
+			&& ec != asio::ssl::error::stream_truncated)
+		{
+			std::cerr << "AsyncRead failed. ";
+			std::cerr << "Error: " << ec.message() << '(' << ec.value() << ')' << std::endl;
+		}
+
+		// the client has sent all queries, close after last response is written
+		_readFinished = true;
+		if (_writingFrames.empty())
+		{
+			close();
+		}
+	}
+
+	// TLS sends close_notify first, a peer which doesn't answer it
+	// gets the socket closed after SHUTDOWN_TIMEOUT.
+	void close()
+	{
+		if (_closing)
+		{
+			return;
+		}
+		_closing = true;
+
+		auto self(this->shared_from_this());
+		_idleTimer.expires_after(SHUTDOWN_TIMEOUT);
+		_idleTimer.async_wait([this, self](std::error_code ec)
+			{
+				if (!ec)
+				{
+					closeSocket();
+				}
+			});
+
+		shutdown(_stream, [this, self](std::error_code)
+			{
+				closeSocket();
+			});
+	}
+
+	void closeSocket()
+	{
+		_closing = true;
+		_idleTimer.cancel();
+
+		std::error_code ec;
+		_stream.lowest_layer().shutdown(tcp::socket::shutdown_both, ec);
+		_stream.lowest_layer().close(ec);
+	}
+
+	template <typename Handler>
+	static void handshake(tcp::socket&, Handler&& handler)
+	{
+		handler(std::error_code());
+	}
+
+	template <typename Handler>
+	static void handshake(asio::ssl::stream<tcp::socket>& stream, Handler&& handler)
+	{
+		stream.async_handshake(asio::ssl::stream_base::server, std::forward<Handler>(handler));
+	}
+
+	template <typename Handler>
+	static void shutdown(tcp::socket&, Handler&& handler)
+	{
+		handler(std::error_code());
+	}
+
+	template <typename Handler>
+	static void shutdown(asio::ssl::stream<tcp::socket>& stream, Handler&& handler)
+	{
+		stream.async_shutdown(std::forward<Handler>(handler));
+	}
+
+private:
+	Stream _stream;
+	asio::steady_timer _idleTimer;
+	QueryHandler _queryHandler;
+	std::array<std::uint8_t, 2> _length;
+	std::vector<std::uint8_t> _query;
+	std::vector<std::vector<std::uint8_t>> _pendingFrames;
+	std::vector<std::vector<std::uint8_t>> _writingFrames;
+	std::vector<std::vector<std::uint8_t>> _freeFrames;
+	std::vector<asio::const_buffer> _writeBuffers;
+	bool _readFinished = false;
+	bool _readPaused = false;
+	bool _closing = false;
+};
+
+template <typename Stream>
+constexpr std::chrono::seconds DNSStreamSession<Stream>::IDLE_TIMEOUT;
+
+template <typename Stream>
+constexpr std::chrono::seconds DNSStreamSession<Stream>::SHUTDOWN_TIMEOUT;
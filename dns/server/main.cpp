@@ -1,23 +1,109 @@
 #include <cstdint>
+#include <cstdlib>
 
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <exception>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
 
+#include "dns_policy.h"
 #include "dns_resolver.h"
 #include "dns_server.h"
 
 static const std::uint16_t DNS_PORT = 10053;
+static const std::uint16_t DNS_TLS_PORT = 10853;
 static const char* RECORDS_FILE = "dns-records";
+static const char* HEALTH_FILE = "dns-health";
+static const char* BLOCKLIST_FILE = "dns-blocklist";
+// DNS over TLS is enabled when both files exist, for local testing use self-signed ones:
+// openssl req -x509 -newkey rsa:2048 -nodes -days 365 -subj /CN=localhost -keyout dns-server.key -out dns-server.crt
+static const char* TLS_CERT_FILE = "dns-server.crt";
+static const char* TLS_KEY_FILE = "dns-server.key";
+
+static bool benchBlocklist(const DNSBlocklist& blocklist, const char* namesFile, int rounds)
+{
+	std::ifstream inFile(namesFile);
+	if (!inFile)
+	{
+		std::cerr << "ERROR ( benchBlocklist() ): could not open file '" << namesFile << "'\n";
+		return false;
+	}
+
+	std::vector<std::string> names;
+	for (std::string name; inFile >> name; )
+	{
+		names.push_back(name);
+	}
+
+	std::size_t hits = 0;
+	const auto started = std::chrono::steady_clock::now();
+	for (int i = 0; i < rounds; i++)
+	{
+		for (const std::string& name : names)
+		{
+			hits += blocklist.contains(name);
+		}
+	}
+	const auto elapsed = std::chrono::steady_clock::now() - started;
+
+	const std::size_t lookups = names.size() * rounds;
+	std::cout << blocklist.size() << " entries, " << lookups << " lookups, "
+		<< hits / rounds << " of " << names.size() << " names blocked, "
+		<< std::chrono::duration<double, std::nano>(elapsed).count() / std::max<std::size_t>(lookups, 1)
+		<< " ns/lookup" << std::endl;
+	return true;
+}
 
 int main(int argc, char* argv[])
 {
+	// dns-server --compile-blocklist <list> <image>
+	// converts text blocklist into the binary image, which is mapped at startup
+	if (argc == 4 && std::string(argv[1]) == "--compile-blocklist")
+	{
+		std::shared_ptr<const DNSBlocklist> blocklist(DNSBlocklist::loadFromFile(argv[2]));
+		return blocklist && blocklist->writeImage(argv[3]) ? 0 : -1;
+	}
+
+	// dns-server --bench-blocklist <list> <names> [<rounds>]
+	// measures lookup time of every name from the file against the list
+	if ((argc == 4 || argc == 5) && std::string(argv[1]) == "--bench-blocklist")
+	{
+		std::shared_ptr<const DNSBlocklist> blocklist(DNSBlocklist::loadFromFile(argv[2]));
+		const int rounds = argc == 5 ? std::atoi(argv[4]) : 100;
+		return blocklist && rounds > 0 && benchBlocklist(*blocklist, argv[3], rounds) ? 0 : -1;
+	}
+
+	// dns-server [--trace]
+	// --trace prints every query and its answer
+	const bool trace = argc == 2 && std::string(argv[1]) == "--trace";
+
 	try
 	{
 		DNSResolver dnsResolver;
+		dnsResolver.setTrace(trace);
 		dnsResolver.loadRecordsFromFile(RECORDS_FILE);
+		if (std::ifstream(HEALTH_FILE))
+		{
+			// health state of addresses is updated with SIGHUP
+			dnsResolver.loadHealthFromFile(HEALTH_FILE);
+		}
+
+		// blocked names are refused, reload the list with SIGHUP
+		DNSPolicy dnsPolicy(DNSPolicy::Action::Refuse);
+		dnsPolicy.loadBlocklist(BLOCKLIST_FILE);
 
 		DNSServer dnsServer("127.0.0.1", DNS_PORT);
 		dnsServer.setResolver(&dnsResolver);
+		dnsServer.setPolicy(&dnsPolicy);
+		dnsServer.enableTcp(DNS_PORT);
+		if (std::ifstream(TLS_CERT_FILE) && std::ifstream(TLS_KEY_FILE))
+		{
+			dnsServer.enableTls(DNS_TLS_PORT, TLS_CERT_FILE, TLS_KEY_FILE);
+		}
 		dnsServer.start();
 	}
 	catch (const std::exception& ex)
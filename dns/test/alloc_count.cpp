@@ -0,0 +1,119 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "dns_policy.h"
+#include "dns_query.h"
+#include "dns_resolver.h"
+#include "dns_server.h"
+
+
+/*
+ Every heap allocation of the process is counted. Queries of all kinds
+ (forward, reverse, unknown and blocked names) are passed through
+ DNSServer::handleQuery, which is what UDP, TCP and TLS transports call.
+ After the warm up, which lets the response buffer reach its size, the
+ query path must not allocate at all.
+ */
+
+namespace
+{
+
+std::size_t allocationsCount = 0;
+bool counting = false;
+
+const std::size_t WARMUP_ROUNDS = 100;
+const std::size_t ROUNDS = 10000;
+
+const char* const RECORDS_FILE = "alloc_count-records";
+const char* const BLOCKLIST_FILE = "alloc_count-blocklist";
+
+std::vector<std::uint8_t> makeQuery(std::uint16_t id, const std::string& name)
+{
+	DNSQuery dnsQuery;
+	dnsQuery.setId(id);
+	dnsQuery.setType(DNSMessage::QType::A);
+	dnsQuery.setQCount(1);
+	dnsQuery.setName(name);
+	const DNSMessage::Buffer encoded(dnsQuery.encode());
+	return std::vector<std::uint8_t>(encoded.cbegin(), encoded.cend());
+}
+
+}
+
+
+void* operator new(std::size_t size)
+{
+	if (counting)
+	{
+		allocationsCount++;
+	}
+
+	void* p = std::malloc(size != 0 ? size : 1);
+	if (p == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+
+int main()
+{
+	std::ofstream(RECORDS_FILE) << "10.0.0.1 www.example.com 5\n10.0.0.2 www.example.com 1\n10.0.0.3 mail.example.com\n";
+	std::ofstream(BLOCKLIST_FILE) << "0.0.0.0 ads.example.net\n";
+
+	DNSResolver dnsResolver;
+	dnsResolver.loadRecordsFromFile(RECORDS_FILE);
+
+	DNSPolicy dnsPolicy(DNSPolicy::Action::Refuse);
+	dnsPolicy.loadBlocklist(BLOCKLIST_FILE);
+
+	DNSServer dnsServer("127.0.0.1", 0);
+	dnsServer.setResolver(&dnsResolver);
+	dnsServer.setPolicy(&dnsPolicy);
+
+	const std::vector<std::vector<std::uint8_t>> queries = {
+		makeQuery(1, "www.example.com"),
+		makeQuery(2, "1.0.0.10.in-addr.arpa"),
+		makeQuery(3, "unknown.example.com"),
+		makeQuery(4, "tracker.ads.example.net"),
+	};
+
+	std::vector<std::uint8_t> response;
+	std::size_t failures = 0;
+	for (std::size_t round = 0; round < WARMUP_ROUNDS + ROUNDS; round++)
+	{
+		counting = round >= WARMUP_ROUNDS;
+		for (const std::vector<std::uint8_t>& query : queries)
+		{
+			response.clear();
+			failures += !dnsServer.handleQuery(query.data(), query.size(), response);
+		}
+	}
+	counting = false;
+
+	std::remove(RECORDS_FILE);
+	std::remove(BLOCKLIST_FILE);
+
+	const std::size_t queriesCount = ROUNDS * queries.size();
+	std::cout << queriesCount << " queries, " << allocationsCount << " allocations, "
+		<< failures << " failures" << std::endl;
+
+	return allocationsCount == 0 && failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,428 @@
+#include <cstdint>
+#include <cstdlib>
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ftp_client.h"
+#include "log.h"
+#include "string_utils.h"
+
+
+/*
+ Load generator: every session runs in its own thread with the blocking
+ client. A session logs in, runs the script of commands the given number
+ of rounds and quits, then the next session is opened, until the time is
+ over. RETR fetches a file uploaded before the run, STOR uploads a file of
+ the same size, each session to its own name, and the files are removed
+ afterwards. Latency of a command is measured from sending it (PASV for
+ the transfers) to the final reply.
+ */
+
+namespace
+{
+
+const std::size_t TRANSFER_BUFFER_SIZE = 256 * 1024;
+
+enum Operation
+{
+	Operation_Login,
+	Operation_List,
+	Operation_Retr,
+	Operation_Stor,
+	OPERATIONS_COUNT
+};
+
+const char* const OPERATION_NAMES[OPERATIONS_COUNT] = { "USER/PASS", "LIST", "RETR", "STOR" };
+
+struct Options
+{
+	std::string _address;
+	std::uint16_t _port = 0;
+	std::string _username;
+	std::string _password;
+	std::size_t _sessionsCount = 8;
+	std::chrono::seconds _duration{10};
+	std::vector<Operation> _script = { Operation_List, Operation_Retr, Operation_Stor };
+	std::uint64_t _fileSize = 1024 * 1024;
+	std::size_t _rounds = 10;		// 0 - the session runs until the end
+	std::string _remoteDir;
+};
+
+// latencies in microseconds
+struct Results
+{
+	std::vector<std::uint32_t> _latencies[OPERATIONS_COUNT];
+	std::uint64_t _sessions = 0;
+	std::uint64_t _bytes = 0;
+	std::uint64_t _errors = 0;
+
+	void merge(const Results& other)
+	{
+		for (std::size_t i = 0; i < OPERATIONS_COUNT; i++)
+		{
+			_latencies[i].insert(_latencies[i].end(), other._latencies[i].begin(), other._latencies[i].end());
+		}
+		_sessions += other._sessions;
+		_bytes += other._bytes;
+		_errors += other._errors;
+	}
+};
+
+void usage(const char* program)
+{
+	std::cerr << "usage: " << program << " <address> <port> <username> <password> [options]\n"
+		<< "  -s <sessions>  concurrent sessions (8)\n"
+		<< "  -d <seconds>   duration of the run (10)\n"
+		<< "  -m <script>    commands of a round, e.g. list,retr*4,stor (list,retr,stor)\n"
+		<< "  -f <size>      size of the transferred files, K, M and G suffixes allowed (1M)\n"
+		<< "  -r <rounds>    rounds of the script per session, 0 - until the end (10)\n"
+		<< "  -t <dir>       remote directory for the files (current)\n";
+	std::exit(EXIT_FAILURE);
+}
+
+bool parseSize(const std::string& arg, std::uint64_t& size)
+{
+	char* end = nullptr;
+	const unsigned long long value = std::strtoull(arg.c_str(), &end, 10);
+	if (end == arg.c_str())
+	{
+		return false;
+	}
+
+	switch (*end)
+	{
+	case '\0':
+		size = value;
+		return true;
+	case 'K': case 'k':
+		size = value << 10;
+		break;
+	case 'M': case 'm':
+		size = value << 20;
+		break;
+	case 'G': case 'g':
+		size = value << 30;
+		break;
+	default:
+		return false;
+	}
+	return end[1] == '\0';
+}
+
+bool parseScript(const std::string& arg, std::vector<Operation>& script)
+{
+	script.clear();
+	for (const std::string& item : string_utils::split(arg, ','))
+	{
+		const std::size_t p = item.find('*');
+		const std::string name(item.substr(0, p));
+		const int repeat = p != std::string::npos ? std::atoi(item.c_str() + p + 1) : 1;
+
+		Operation operation = Operation_List;
+		if (name == "list")
+		{
+			operation = Operation_List;
+		}
+		else if (name == "retr")
+		{
+			operation = Operation_Retr;
+		}
+		else if (name == "stor")
+		{
+			operation = Operation_Stor;
+		}
+		else
+		{
+			return false;
+		}
+
+		if (repeat <= 0)
+		{
+			return false;
+		}
+		script.insert(script.end(), repeat, operation);
+	}
+	return !script.empty();
+}
+
+Options parseOptions(int argc, char* argv[])
+{
+	if (argc < 5 || (argc - 5) % 2 != 0)
+	{
+		usage(argv[0]);
+	}
+
+	Options options;
+	options._address = argv[1];
+	options._port = static_cast<std::uint16_t>(std::stoi(argv[2]));
+	options._username = argv[3];
+	options._password = argv[4];
+
+	for (int i = 5; i < argc; i += 2)
+	{
+		const std::string option(argv[i]);
+		const std::string value(argv[i + 1]);
+		bool valid = true;
+		if (option == "-s")
+		{
+			options._sessionsCount = std::stoul(value);
+			valid = options._sessionsCount != 0;
+		}
+		else if (option == "-d")
+		{
+			options._duration = std::chrono::seconds(std::stoul(value));
+		}
+		else if (option == "-m")
+		{
+			valid = parseScript(value, options._script);
+		}
+		else if (option == "-f")
+		{
+			valid = parseSize(value, options._fileSize);
+		}
+		else if (option == "-r")
+		{
+			options._rounds = std::stoul(value);
+		}
+		else if (option == "-t")
+		{
+			options._remoteDir = value + '/';
+		}
+		else
+		{
+			valid = false;
+		}
+
+		if (!valid)
+		{
+			std::cerr << "Invalid option " << option << ' ' << value << '\n';
+			usage(argv[0]);
+		}
+	}
+	return options;
+}
+
+void uploadFile(FTPClient& client, const std::string& path, std::uint64_t size, const std::vector<char>& data)
+{
+	tcp::socket& dataSocket = client.store(path);
+	for (std::uint64_t sent = 0; sent < size; )
+	{
+		const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(data.size(), size - sent));
+		asio::write(dataSocket, asio::buffer(data.data(), n));
+		sent += n;
+	}
+
+	const FTPClient::Reply reply(client.finishTransfer());
+	if (reply._code != 226)
+	{
+		throw std::runtime_error("STOR failed: '" + reply._text + "'");
+	}
+}
+
+std::uint64_t downloadFile(tcp::socket& dataSocket, std::vector<char>& buffer)
+{
+	std::uint64_t received = 0;
+	while (true)
+	{
+		std::error_code ec;
+		received += dataSocket.read_some(asio::buffer(buffer), ec);
+		if (ec)
+		{
+			return received;
+		}
+	}
+}
+
+void removeFile(const Options& options, const std::string& path)
+{
+	try
+	{
+		FTPClient client;
+		client.connect(options._address, options._port);
+		client.login(options._username, options._password);
+		client.command("DELE " + path);
+		client.quit();
+	}
+	catch (const std::exception& ex)
+	{
+		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+	}
+}
+
+void runSessions(const Options& options, std::size_t index, std::chrono::steady_clock::time_point deadline, Results& results)
+{
+	const std::string retrPath(options._remoteDir + "ftp-bench.bin");
+	const std::string storPath(options._remoteDir + "ftp-bench-" + std::to_string(index) + ".bin");
+	std::vector<char> buffer(TRANSFER_BUFFER_SIZE, 'x');
+	bool stored = false;
+
+	auto measure = [&results](Operation operation, std::chrono::steady_clock::time_point started)
+	{
+		const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started);
+		results._latencies[operation].push_back(static_cast<std::uint32_t>(elapsed.count()));
+	};
+
+	while (std::chrono::steady_clock::now() < deadline)
+	{
+		try
+		{
+			FTPClient client;
+			client.connect(options._address, options._port);
+
+			auto started = std::chrono::steady_clock::now();
+			client.login(options._username, options._password);
+			measure(Operation_Login, started);
+			client.setBinaryMode();
+
+			for (std::size_t round = 0; (options._rounds == 0 || round < options._rounds)
+				&& std::chrono::steady_clock::now() < deadline; round++)
+			{
+				for (const Operation operation : options._script)
+				{
+					started = std::chrono::steady_clock::now();
+					FTPClient::Reply reply;
+					switch (operation)
+					{
+					case Operation_List:
+						results._bytes += downloadFile(client.list(options._remoteDir), buffer);
+						reply = client.finishTransfer();
+						break;
+					case Operation_Retr:
+						results._bytes += downloadFile(client.retrieve(retrPath), buffer);
+						reply = client.finishTransfer();
+						break;
+					case Operation_Stor:
+						uploadFile(client, storPath, options._fileSize, buffer);
+						results._bytes += options._fileSize;
+						reply._code = 226;
+						stored = true;
+						break;
+					default:
+						break;
+					}
+
+					if (reply._code != 226)
+					{
+						throw std::runtime_error(std::string(OPERATION_NAMES[operation]) + " failed: '" + reply._text + "'");
+					}
+					measure(operation, started);
+				}
+			}
+
+			client.quit();
+			results._sessions++;
+		}
+		catch (const std::exception& ex)
+		{
+			LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+			results._errors++;
+		}
+	}
+
+	if (stored)
+	{
+		removeFile(options, storPath);
+	}
+}
+
+void report(const Results& results, double seconds)
+{
+	std::uint64_t commands = 0;
+	for (const auto& latencies : results._latencies)
+	{
+		commands += latencies.size();
+	}
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< "Sessions: " << results._sessions << " in " << seconds << " s, " << results._sessions / seconds << "/s\n"
+		<< "Commands: " << commands << ", " << commands / seconds << "/s\n"
+		<< "Data:     " << results._bytes / (1024.0 * 1024) << " MB, " << results._bytes / seconds / (1024 * 1024) << " MB/s\n"
+		<< "Errors:   " << results._errors << "\n\n"
+		<< std::left << std::setw(12) << "Latency ms" << std::right
+		<< std::setw(10) << "count" << std::setw(10) << "p50" << std::setw(10) << "p90"
+		<< std::setw(10) << "p99" << std::setw(10) << "max" << '\n'
+		<< std::setprecision(2);
+
+	for (std::size_t i = 0; i < OPERATIONS_COUNT; i++)
+	{
+		std::vector<std::uint32_t> latencies(results._latencies[i]);
+		if (latencies.empty())
+		{
+			continue;
+		}
+		std::sort(latencies.begin(), latencies.end());
+
+		auto percentile = [&latencies](double p)
+		{
+			return latencies[std::min(latencies.size() - 1, static_cast<std::size_t>(latencies.size() * p))] / 1000.0;
+		};
+		std::cout << std::left << std::setw(12) << OPERATION_NAMES[i] << std::right
+			<< std::setw(10) << latencies.size() << std::setw(10) << percentile(0.5) << std::setw(10) << percentile(0.9)
+			<< std::setw(10) << percentile(0.99) << std::setw(10) << latencies.back() / 1000.0 << '\n';
+	}
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	const Options options(parseOptions(argc, argv));
+	const bool retrieves = std::find(options._script.begin(), options._script.end(), Operation_Retr) != options._script.end();
+	const std::string retrPath(options._remoteDir + "ftp-bench.bin");
+
+	// the file of RETR is uploaded once, before the run
+	if (retrieves)
+	{
+		try
+		{
+			FTPClient client;
+			client.connect(options._address, options._port);
+			client.login(options._username, options._password);
+			client.setBinaryMode();
+			uploadFile(client, retrPath, options._fileSize, std::vector<char>(TRANSFER_BUFFER_SIZE, 'x'));
+			client.quit();
+		}
+		catch (const std::exception& ex)
+		{
+			LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	std::cout << "Running " << options._sessionsCount << " sessions for " << options._duration.count() << " s, "
+		<< options._script.size() << " commands a round, " << options._fileSize << " bytes files\n";
+
+	std::vector<Results> results(options._sessionsCount);
+	std::vector<std::thread> workers;
+	const auto started = std::chrono::steady_clock::now();
+	const auto deadline = started + options._duration;
+	for (std::size_t i = 0; i < options._sessionsCount; i++)
+	{
+		workers.emplace_back(runSessions, std::cref(options), i, deadline, std::ref(results[i]));
+	}
+
+	Results total;
+	for (std::size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+		total.merge(results[i]);
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+	if (retrieves)
+	{
+		removeFile(options, retrPath);
+	}
+
+	report(total, seconds);
+	return total._errors != 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
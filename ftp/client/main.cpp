@@ -0,0 +1,312 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ftp_client.h"
+#include "log.h"
+
+
+/*
+ Segmented download: the file is split into byte ranges, every range is
+ fetched over its own connection and written at its place in the local
+ file. Progress of every range is kept in "<local-file>.segments", so an
+ interrupted download continues where it stopped when started again.
+ */
+
+namespace
+{
+
+const std::size_t RECV_BUFFER_SIZE = 256 * 1024;
+const std::uint64_t SAVE_PROGRESS_PERIOD = 4 * 1024 * 1024;
+
+// Fixed width records, so every segment rewrites its own record in place.
+const std::size_t HEADER_LENGTH = 42;	// "<size> <segments>\n"
+const std::size_t RECORD_LENGTH = 63;	// "<first> <last> <done>\n"
+
+struct Segment
+{
+	std::uint64_t _first = 0;
+	std::uint64_t _last = 0;	// inclusive
+	std::uint64_t _done = 0;
+};
+
+struct Options
+{
+	std::string _address;
+	std::uint16_t _port = 0;
+	std::string _username;
+	std::string _password;
+	std::string _remotePath;
+	std::string _localPath;
+	std::size_t _segmentsCount = 4;
+};
+
+bool writeRecord(int fd, std::size_t index, const Segment& segment)
+{
+	char record[RECORD_LENGTH + 1];
+	std::snprintf(record, sizeof(record), "%020llu %020llu %020llu\n",
+		static_cast<unsigned long long>(segment._first),
+		static_cast<unsigned long long>(segment._last),
+		static_cast<unsigned long long>(segment._done));
+	return ::pwrite(fd, record, RECORD_LENGTH, HEADER_LENGTH + index * RECORD_LENGTH) == static_cast<ssize_t>(RECORD_LENGTH);
+}
+
+bool writeState(int fd, std::uint64_t size, const std::vector<Segment>& segments)
+{
+	char header[HEADER_LENGTH + 1];
+	std::snprintf(header, sizeof(header), "%020llu %020llu\n",
+		static_cast<unsigned long long>(size), static_cast<unsigned long long>(segments.size()));
+	if (::ftruncate(fd, 0) == -1 || ::pwrite(fd, header, HEADER_LENGTH, 0) != static_cast<ssize_t>(HEADER_LENGTH))
+	{
+		return false;
+	}
+
+	for (std::size_t i = 0; i < segments.size(); i++)
+	{
+		if (!writeRecord(fd, i, segments[i]))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Loads progress of the previous attempt, if it was the download of the same file.
+bool readState(int fd, std::uint64_t size, std::vector<Segment>& segments)
+{
+	char header[HEADER_LENGTH + 1] = { 0 };
+	unsigned long long savedSize = 0, savedCount = 0;
+	if (::pread(fd, header, HEADER_LENGTH, 0) != static_cast<ssize_t>(HEADER_LENGTH)
+		|| std::sscanf(header, "%llu %llu", &savedSize, &savedCount) != 2
+		|| savedSize != size || savedCount == 0)
+	{
+		return false;
+	}
+
+	std::vector<Segment> saved(savedCount);
+	for (std::size_t i = 0; i < saved.size(); i++)
+	{
+		char record[RECORD_LENGTH + 1] = { 0 };
+		unsigned long long first = 0, last = 0, done = 0;
+		if (::pread(fd, record, RECORD_LENGTH, HEADER_LENGTH + i * RECORD_LENGTH) != static_cast<ssize_t>(RECORD_LENGTH)
+			|| std::sscanf(record, "%llu %llu %llu", &first, &last, &done) != 3
+			|| last < first || done > last - first + 1)
+		{
+			return false;
+		}
+		saved[i]._first = first;
+		saved[i]._last = last;
+		saved[i]._done = done;
+	}
+
+	segments.swap(saved);
+	return true;
+}
+
+std::vector<Segment> splitFile(std::uint64_t size, std::size_t count)
+{
+	std::vector<Segment> segments;
+	const std::uint64_t length = (size + count - 1) / count;
+	for (std::uint64_t first = 0; first < size; first += length)
+	{
+		Segment segment;
+		segment._first = first;
+		segment._last = std::min(first + length, size) - 1;
+		segments.push_back(segment);
+	}
+	return segments;
+}
+
+bool downloadSegment(const Options& options, std::uint64_t size, int fileFd, int stateFd,
+	std::size_t index, Segment& segment, std::atomic<std::uint64_t>& received)
+{
+	const std::uint64_t length = segment._last - segment._first + 1;
+	if (segment._done == length)
+	{
+		return true;
+	}
+
+	try
+	{
+		FTPClient client;
+		client.connect(options._address, options._port);
+		client.login(options._username, options._password);
+		client.setBinaryMode();
+
+		const std::uint64_t offset = segment._first + segment._done;
+		const bool ranged = client.range(offset, segment._last);
+		if (!ranged && !client.restart(offset))
+		{
+			std::cerr << "Server supports neither RANG nor REST.\n";
+			return false;
+		}
+
+		tcp::socket& dataSocket = client.retrieve(options._remotePath);
+
+		std::vector<char> buffer(RECV_BUFFER_SIZE);
+		std::uint64_t unsaved = 0;
+		while (segment._done < length)
+		{
+			std::error_code ec;
+			const std::size_t toRead = std::min<std::uint64_t>(buffer.size(), length - segment._done);
+			const std::size_t n = dataSocket.read_some(asio::buffer(buffer.data(), toRead), ec);
+			if (ec)
+			{
+				break;
+			}
+
+			if (::pwrite(fileFd, buffer.data(), n, segment._first + segment._done) != static_cast<ssize_t>(n))
+			{
+				LOG_ERROR() << " - Error 'Could not write local file'\n";
+				return false;
+			}
+
+			segment._done += n;
+			received += n;
+			unsaved += n;
+			if (unsaved >= SAVE_PROGRESS_PERIOD)
+			{
+				writeRecord(stateFd, index, segment);
+				unsaved = 0;
+			}
+		}
+
+		writeRecord(stateFd, index, segment);
+
+		// without RANG support the server keeps sending after the end of the segment,
+		// the transfer is aborted then and the final reply isn't expected
+		if (ranged || segment._last + 1 == size)
+		{
+			client.finishTransfer();
+			client.quit();
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+		writeRecord(stateFd, index, segment);
+		return false;
+	}
+
+	return segment._done == length;
+}
+
+}
+
+
+int main(int argc, char* argv[])
+{
+	if (argc < 7)
+	{
+		std::cerr << "usage: " << argv[0]
+			<< " <address> <port> <username> <password> <remote-file> <local-file> [<segments>]\n";
+		std::exit(EXIT_FAILURE);
+	}
+
+	Options options;
+	options._address = argv[1];
+	options._port = static_cast<std::uint16_t>(std::stoi(argv[2]));
+	options._username = argv[3];
+	options._password = argv[4];
+	options._remotePath = argv[5];
+	options._localPath = argv[6];
+	if (argc > 7)
+	{
+		options._segmentsCount = std::max(1, std::stoi(argv[7]));
+	}
+
+	std::uint64_t size = 0;
+	try
+	{
+		FTPClient client;
+		client.connect(options._address, options._port);
+		client.login(options._username, options._password);
+		size = client.size(options._remotePath);
+		client.quit();
+	}
+	catch (const std::exception& ex)
+	{
+		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+		std::exit(EXIT_FAILURE);
+	}
+
+	const std::string statePath(options._localPath + ".segments");
+	const int stateFd = ::open(statePath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	const int fileFd = ::open(options._localPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+	if (stateFd == -1 || fileFd == -1)
+	{
+		std::cerr << "Could not open '" << options._localPath << "' or '" << statePath << "'\n";
+		std::exit(EXIT_FAILURE);
+	}
+
+	std::vector<Segment> segments;
+	if (readState(stateFd, size, segments))
+	{
+		std::cout << "Resuming download of " << segments.size() << " segments\n";
+	}
+	else
+	{
+		segments = splitFile(size, options._segmentsCount);
+		if (::ftruncate(fileFd, size) == -1 || !writeState(stateFd, size, segments))
+		{
+			std::cerr << "Could not prepare '" << options._localPath << "'\n";
+			std::exit(EXIT_FAILURE);
+		}
+	}
+
+	std::uint64_t alreadyDone = 0;
+	for (const Segment& segment : segments)
+	{
+		alreadyDone += segment._done;
+	}
+
+	std::atomic<std::uint64_t> received{0};
+	std::atomic<std::size_t> failed{0};
+	const auto started = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (std::size_t i = 0; i < segments.size(); i++)
+	{
+		workers.emplace_back([&, i]()
+			{
+				if (!downloadSegment(options, size, fileFd, stateFd, i, segments[i], received))
+				{
+					failed++;
+				}
+			});
+	}
+
+	for (std::thread& worker : workers)
+	{
+		worker.join();
+	}
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+	std::cout << "Received " << received << " bytes (" << alreadyDone << " bytes were received earlier) in " << seconds << " s, "
+		<< (seconds > 0 ? received / seconds / (1024 * 1024) : 0) << " MB/s over " << segments.size() << " connections\n";
+
+	::close(fileFd);
+	::close(stateFd);
+
+	if (failed != 0)
+	{
+		std::cerr << failed << " segments aren't completed, run again to resume\n";
+		std::exit(EXIT_FAILURE);
+	}
+
+	::unlink(statePath.c_str());
+	return 0;
+}
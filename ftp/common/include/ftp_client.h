@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <asio.hpp>
+
+using asio::ip::tcp;
+
+
+/*
+ Minimal blocking FTP client, passive mode only.
+ Every method throws std::runtime_error when the server replies
+ with unexpected code or the connection fails.
+ */
+class FTPClient final
+{
+public:
+	struct Reply
+	{
+		std::uint16_t _code = 0;
+		std::string _text;
+	};
+
+public:
+	FTPClient(const FTPClient&) = delete;
+	FTPClient& operator=(const FTPClient&) = delete;
+
+	FTPClient();
+	~FTPClient();
+
+	void connect(const std::string& address, std::uint16_t port);
+	void login(const std::string& username, const std::string& password);
+	void quit();
+
+	Reply command(const std::string& cmd);
+
+	void setBinaryMode();
+	std::uint64_t size(const std::string& path);
+
+	// return false if the server doesn't support them
+	bool restart(std::uint64_t offset);
+	bool range(std::uint64_t first, std::uint64_t last);
+
+	// open the data connection and start the transfer,
+	// finishTransfer() closes it and waits for the final reply
+	tcp::socket& retrieve(const std::string& path);
+	tcp::socket& store(const std::string& path);
+	tcp::socket& list(const std::string& path);
+	Reply finishTransfer();
+
+private:
+	void openDataConnection();
+	tcp::socket& startTransfer(const std::string& cmd);
+	Reply readReply();
+	std::string readLine();
+
+	static void expect(const Reply& reply, std::uint16_t code, const std::string& cmd);
+
+private:
+	asio::io_context _ioContext;
+	tcp::socket _ctrlSocket;
+	tcp::socket _dataSocket;
+	asio::streambuf _buffer;
+};
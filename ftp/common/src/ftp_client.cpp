@@ -0,0 +1,184 @@
+#include "ftp_client.h"
+#include "string_utils.h"
+
+#include <istream>
+#include <stdexcept>
+
+
+FTPClient::FTPClient()
+	: _ioContext(1)
+	, _ctrlSocket(_ioContext)
+	, _dataSocket(_ioContext)
+{
+
+}
+
+FTPClient::~FTPClient()
+{
+	std::error_code ec;
+	_dataSocket.close(ec);
+	_ctrlSocket.close(ec);
+}
+
+void FTPClient::connect(const std::string& address, std::uint16_t port)
+{
+	_ctrlSocket.connect(tcp::endpoint(asio::ip::make_address(address), port));
+	expect(readReply(), 220, "connect");
+}
+
+void FTPClient::login(const std::string& username, const std::string& password)
+{
+	expect(command("USER " + username), 331, "USER");
+	expect(command("PASS " + password), 230, "PASS");
+}
+
+void FTPClient::quit()
+{
+	command("QUIT");
+
+	std::error_code ec;
+	_ctrlSocket.shutdown(tcp::socket::shutdown_both, ec);
+	_ctrlSocket.close(ec);
+}
+
+FTPClient::Reply FTPClient::command(const std::string& cmd)
+{
+	const std::string line(cmd + "\r\n");
+	asio::write(_ctrlSocket, asio::buffer(line));
+	return readReply();
+}
+
+void FTPClient::setBinaryMode()
+{
+	expect(command("TYPE I"), 200, "TYPE");
+}
+
+std::uint64_t FTPClient::size(const std::string& path)
+{
+	const Reply reply(command("SIZE " + path));
+	expect(reply, 213, "SIZE");
+	return std::stoull(reply._text.substr(4));
+}
+
+bool FTPClient::restart(std::uint64_t offset)
+{
+	const Reply reply(command("REST " + std::to_string(offset)));
+	if (reply._code / 100 == 5)
+	{
+		return false;
+	}
+	expect(reply, 350, "REST");
+	return true;
+}
+
+bool FTPClient::range(std::uint64_t first, std::uint64_t last)
+{
+	const Reply reply(command("RANG " + std::to_string(first) + ' ' + std::to_string(last)));
+	if (reply._code / 100 == 5)
+	{
+		return false;
+	}
+	expect(reply, 350, "RANG");
+	return true;
+}
+
+tcp::socket& FTPClient::retrieve(const std::string& path)
+{
+	return startTransfer("RETR " + path);
+}
+
+tcp::socket& FTPClient::store(const std::string& path)
+{
+	return startTransfer("STOR " + path);
+}
+
+tcp::socket& FTPClient::list(const std::string& path)
+{
+	return startTransfer(path.empty() ? std::string("LIST") : "LIST " + path);
+}
+
+FTPClient::Reply FTPClient::finishTransfer()
+{
+	std::error_code ec;
+	_dataSocket.shutdown(tcp::socket::shutdown_both, ec);
+	_dataSocket.close(ec);
+	return readReply();
+}
+
+void FTPClient::openDataConnection()
+{
+	const Reply reply(command("PASV"));
+	expect(reply, 227, "PASV");
+
+	// 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2).
+	const std::size_t begin = reply._text.find('(');
+	const std::size_t end = reply._text.find(')', begin);
+	if (begin == std::string::npos || end == std::string::npos)
+	{
+		throw std::runtime_error("FTPClient - invalid PASV reply '" + reply._text + "'");
+	}
+
+	const std::vector<std::string> h(string_utils::split(reply._text.substr(begin + 1, end - begin - 1), ','));
+	if (h.size() != 6)
+	{
+		throw std::runtime_error("FTPClient - invalid PASV reply '" + reply._text + "'");
+	}
+
+	const std::string address(h[0] + '.' + h[1] + '.' + h[2] + '.' + h[3]);
+	const std::uint16_t port = std::stoi(h[4]) * 256 + std::stoi(h[5]);
+	_dataSocket.connect(tcp::endpoint(asio::ip::make_address(address), port));
+}
+
+tcp::socket& FTPClient::startTransfer(const std::string& cmd)
+{
+	openDataConnection();
+
+	const Reply reply(command(cmd));
+	if (reply._code != 125 && reply._code != 150)
+	{
+		std::error_code ec;
+		_dataSocket.close(ec);
+		expect(reply, 150, cmd);
+	}
+	return _dataSocket;
+}
+
+FTPClient::Reply FTPClient::readReply()
+{
+	// multiline reply ends with the line starting with the same code and space
+	Reply reply;
+	reply._text = readLine();
+	if (reply._text.length() < 3)
+	{
+		throw std::runtime_error("FTPClient - invalid reply '" + reply._text + "'");
+	}
+	reply._code = std::stoi(reply._text.substr(0, 3));
+
+	if (reply._text.length() > 3 && reply._text[3] == '-')
+	{
+		const std::string last(reply._text.substr(0, 3) + ' ');
+		std::string line;
+		do
+		{
+			line = readLine();
+			reply._text.append("\n").append(line);
+		} while (line.compare(0, 4, last) != 0);
+	}
+	return reply;
+}
+
+std::string FTPClient::readLine()
+{
+	const std::size_t n = asio::read_until(_ctrlSocket, _buffer, "\r\n");
+	std::string line(asio::buffers_begin(_buffer.data()), asio::buffers_begin(_buffer.data()) + n - 2);
+	_buffer.consume(n);
+	return line;
+}
+
+void FTPClient::expect(const Reply& reply, std::uint16_t code, const std::string& cmd)
+{
+	if (reply._code != code)
+	{
+		throw std::runtime_error("FTPClient - unexpected reply to " + cmd + ": '" + reply._text + "'");
+	}
+}
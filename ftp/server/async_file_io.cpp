@@ -0,0 +1,553 @@
+#include "async_file_io.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+
+// there is no liburing here, the ring is set up by the system calls
+static int ioUringSetup(unsigned entries, io_uring_params* params)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+static int ioUringRegister(int fd, unsigned opcode, const void* arg, unsigned argsCount)
+{
+	return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, argsCount));
+}
+
+static unsigned* ringField(void* ring, std::uint32_t offset)
+{
+	return reinterpret_cast<unsigned*>(static_cast<char*>(ring) + offset);
+}
+
+
+AsyncFileIO::AsyncFileIO(asio::io_context& ioContext, std::size_t buffersCount, std::size_t bufferSize)
+	: _ioContext(ioContext)
+	, _buffersCount(buffersCount)
+	, _bufferSize(bufferSize)
+	, _eventStream(ioContext)
+{
+
+}
+
+AsyncFileIO::~AsyncFileIO()
+{
+	stop();
+
+	if (_buffers != nullptr)
+	{
+		::munmap(_buffers, _buffersCount * _bufferSize);
+	}
+}
+
+void AsyncFileIO::start()
+{
+	if (_buffers == nullptr)
+	{
+		void* buffers = ::mmap(nullptr, _buffersCount * _bufferSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffers != MAP_FAILED)
+		{
+			_buffers = static_cast<char*>(buffers);
+			for (std::size_t i = 0; i < _buffersCount; i++)
+			{
+				_freeBuffers.push_back(_buffers + i * _bufferSize);
+			}
+		}
+	}
+
+	_stopping = false;
+	if (setupRing())
+	{
+		LOG_INFO() << " - File I/O uses io_uring" << (_buffersRegistered ? " with registered buffers" : "") << "\n";
+		readCompletions();
+		return;
+	}
+
+	LOG_INFO() << " - File I/O runs on " << WORKERS_COUNT << " threads\n";
+	for (std::size_t i = 0; i < WORKERS_COUNT; i++)
+	{
+		_workers.emplace_back(&AsyncFileIO::worker, this);
+	}
+}
+
+void AsyncFileIO::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+	}
+	_wakeup.notify_all();
+
+	for (std::thread& worker : _workers)
+	{
+		worker.join();
+	}
+	_workers.clear();
+	_queue.clear();
+
+	// the handlers of the requests which aren't completed are dropped
+	closeRing();
+}
+
+char* AsyncFileIO::allocateBuffer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_buffersMutex);
+		if (!_freeBuffers.empty())
+		{
+			char* buffer = _freeBuffers.back();
+			_freeBuffers.pop_back();
+			return buffer;
+		}
+	}
+	return new char[_bufferSize];
+}
+
+void AsyncFileIO::releaseBuffer(char* buffer)
+{
+	if (_buffers != nullptr && buffer >= _buffers && buffer < _buffers + _buffersCount * _bufferSize)
+	{
+		std::lock_guard<std::mutex> lock(_buffersMutex);
+		_freeBuffers.push_back(buffer);
+		return;
+	}
+	delete[] buffer;
+}
+
+void AsyncFileIO::read(int fd, char* data, std::size_t length, off_t offset, Handler handler)
+{
+	std::unique_ptr<Operation> operation(std::make_unique<Operation>());
+	operation->_type = Operation_Read;
+	operation->_fd = fd;
+	operation->_data = data;
+	operation->_length = length;
+	operation->_offset = offset;
+	operation->_handler = std::move(handler);
+	submit(std::move(operation));
+}
+
+void AsyncFileIO::write(int fd, const char* data, std::size_t length, off_t offset, Handler handler)
+{
+	std::unique_ptr<Operation> operation(std::make_unique<Operation>());
+	operation->_type = Operation_Write;
+	operation->_fd = fd;
+	operation->_data = const_cast<char*>(data);
+	operation->_length = length;
+	operation->_offset = offset;
+	operation->_handler = std::move(handler);
+	submit(std::move(operation));
+}
+
+void AsyncFileIO::splice(int pipeFd, int fd, std::size_t length, off_t offset, Handler handler)
+{
+	std::unique_ptr<Operation> operation(std::make_unique<Operation>());
+	operation->_type = Operation_Splice;
+	operation->_fd = fd;
+	operation->_pipeFd = pipeFd;
+	operation->_length = length;
+	operation->_offset = offset;
+	operation->_handler = std::move(handler);
+	submit(std::move(operation));
+}
+
+void AsyncFileIO::advise(int fd, off_t offset, std::size_t length, int advice, Handler handler)
+{
+	std::unique_ptr<Operation> operation(std::make_unique<Operation>());
+	operation->_type = Operation_Advise;
+	operation->_fd = fd;
+	operation->_advice = advice;
+	operation->_length = length;
+	operation->_offset = offset;
+	operation->_handler = std::move(handler);
+	submit(std::move(operation));
+}
+
+void AsyncFileIO::submit(std::unique_ptr<Operation> operation)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_stopping)
+	{
+		return;
+	}
+
+	if (_ringFd == -1)
+	{
+		_queue.push_back(std::move(operation));
+		_wakeup.notify_one();
+		return;
+	}
+
+	// no more requests in flight than the completion ring may hold
+	if (_submitted.size() >= _sqEntries)
+	{
+		_backlog.push_back(operation.release());
+		return;
+	}
+
+	pushToRing(operation.release());
+	enterRing();
+}
+
+int AsyncFileIO::bufferIndex(const char* data, std::size_t length) const
+{
+	if (!_buffersRegistered || data < _buffers || data >= _buffers + _buffersCount * _bufferSize)
+	{
+		return -1;
+	}
+
+	const std::size_t index = (data - _buffers) / _bufferSize;
+	const char* end = _buffers + (index + 1) * _bufferSize;
+	return (data + length <= end) ? static_cast<int>(index) : -1;
+}
+
+bool AsyncFileIO::setupRing()
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	_ringFd = ioUringSetup(RING_ENTRIES, &params);
+	if (_ringFd == -1)
+	{
+		LOG_INFO() << " - io_uring isn't available: " << std::strerror(errno) << "\n";
+		return false;
+	}
+
+	// IORING_OP_READ/WRITE and SPLICE came with the same kernels as FAST_POLL (5.7)
+	if ((params.features & IORING_FEAT_FAST_POLL) == 0)
+	{
+		LOG_INFO() << " - io_uring of this kernel is too old\n";
+		closeRing();
+		return false;
+	}
+
+	_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		_sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+	}
+
+	_sqRing = ::mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQ_RING);
+	if (_sqRing == MAP_FAILED)
+	{
+		_sqRing = nullptr;
+		closeRing();
+		return false;
+	}
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		_cqRing = _sqRing;
+	}
+	else
+	{
+		_cqRing = ::mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_CQ_RING);
+		if (_cqRing == MAP_FAILED)
+		{
+			_cqRing = nullptr;
+			closeRing();
+			return false;
+		}
+	}
+
+	void* sqes = ::mmap(nullptr, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, _ringFd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		closeRing();
+		return false;
+	}
+	_sqes = static_cast<io_uring_sqe*>(sqes);
+
+	_sqHead = ringField(_sqRing, params.sq_off.head);
+	_sqTail = ringField(_sqRing, params.sq_off.tail);
+	_sqMask = *ringField(_sqRing, params.sq_off.ring_mask);
+	_sqArray = ringField(_sqRing, params.sq_off.array);
+	_sqEntries = params.sq_entries;
+	_cqHead = ringField(_cqRing, params.cq_off.head);
+	_cqTail = ringField(_cqRing, params.cq_off.tail);
+	_cqMask = *ringField(_cqRing, params.cq_off.ring_mask);
+	_cqes = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(_cqRing) + params.cq_off.cqes);
+
+	_eventFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (_eventFd == -1 || ioUringRegister(_ringFd, IORING_REGISTER_EVENTFD, &_eventFd, 1) == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not register eventfd: " << std::strerror(errno) << "'\n";
+		closeRing();
+		return false;
+	}
+	_eventStream.assign(_eventFd);
+
+	if (_buffers != nullptr)
+	{
+		std::vector<iovec> iovecs(_buffersCount);
+		for (std::size_t i = 0; i < _buffersCount; i++)
+		{
+			iovecs[i].iov_base = _buffers + i * _bufferSize;
+			iovecs[i].iov_len = _bufferSize;
+		}
+
+		// the buffers are pinned, it may exceed RLIMIT_MEMLOCK
+		_buffersRegistered = ioUringRegister(_ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), iovecs.size()) == 0;
+		if (!_buffersRegistered)
+		{
+			LOG_ERROR() << " - Error 'Could not register buffers: " << std::strerror(errno) << "'\n";
+		}
+	}
+	return true;
+}
+
+void AsyncFileIO::closeRing()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	std::error_code ec;
+	if (_eventStream.is_open())
+	{
+		_eventStream.close(ec);
+	}
+	else if (_eventFd != -1)
+	{
+		::close(_eventFd);
+	}
+	_eventFd = -1;
+
+	if (_ringFd != -1)
+	{
+		// closing the ring cancels or waits for the requests in flight
+		::close(_ringFd);
+		_ringFd = -1;
+	}
+
+	if (_sqes != nullptr)
+	{
+		::munmap(_sqes, _sqEntries * sizeof(io_uring_sqe));
+		_sqes = nullptr;
+	}
+
+	if (_cqRing != nullptr && _cqRing != _sqRing)
+	{
+		::munmap(_cqRing, _cqRingSize);
+	}
+	_cqRing = nullptr;
+
+	if (_sqRing != nullptr)
+	{
+		::munmap(_sqRing, _sqRingSize);
+		_sqRing = nullptr;
+	}
+
+	_buffersRegistered = false;
+
+	for (Operation* operation : _submitted)
+	{
+		delete operation;
+	}
+	_submitted.clear();
+
+	for (Operation* operation : _backlog)
+	{
+		delete operation;
+	}
+	_backlog.clear();
+}
+
+// has to be called under the lock
+void AsyncFileIO::pushToRing(Operation* operation)
+{
+	const unsigned tail = *_sqTail;
+	const unsigned index = tail & _sqMask;
+	io_uring_sqe* sqe = &_sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+
+	sqe->fd = operation->_fd;
+	sqe->off = operation->_offset;
+	sqe->len = static_cast<std::uint32_t>(operation->_length);
+	sqe->user_data = reinterpret_cast<std::uint64_t>(operation);
+
+	if (operation->_type == Operation_Advise)
+	{
+		sqe->opcode = IORING_OP_FADVISE;
+		sqe->fadvise_advice = operation->_advice;
+	}
+	else if (operation->_type == Operation_Splice)
+	{
+		sqe->opcode = IORING_OP_SPLICE;
+		sqe->splice_fd_in = operation->_pipeFd;
+		sqe->splice_off_in = static_cast<std::uint64_t>(-1);
+		sqe->splice_flags = SPLICE_F_MOVE;
+	}
+	else
+	{
+		const int buffer = bufferIndex(operation->_data, operation->_length);
+		sqe->addr = reinterpret_cast<std::uint64_t>(operation->_data);
+		if (buffer != -1)
+		{
+			sqe->opcode = (operation->_type == Operation_Read) ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+			sqe->buf_index = static_cast<std::uint16_t>(buffer);
+		}
+		else
+		{
+			sqe->opcode = (operation->_type == Operation_Read) ? IORING_OP_READ : IORING_OP_WRITE;
+		}
+	}
+
+	_sqArray[index] = index;
+	__atomic_store_n(_sqTail, tail + 1, __ATOMIC_RELEASE);
+	_submitted.insert(operation);
+}
+
+// has to be called under the lock
+void AsyncFileIO::enterRing()
+{
+	const unsigned pending = *_sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+	while (pending != 0 && ioUringEnter(_ringFd, pending, 0, 0) == -1)
+	{
+		if (errno != EINTR)
+		{
+			// the requests stay in the ring and are submitted with the next ones
+			LOG_ERROR() << " - Error 'io_uring_enter() failed: " << std::strerror(errno) << "'\n";
+			break;
+		}
+	}
+}
+
+void AsyncFileIO::readCompletions()
+{
+	_eventStream.async_read_some(asio::buffer(&_eventCount, sizeof(_eventCount)),
+		[this](std::error_code ec, std::size_t length)
+		{
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				}
+				return;
+			}
+
+			reapCompletions();
+			readCompletions();
+		});
+}
+
+void AsyncFileIO::reapCompletions()
+{
+	std::vector<std::pair<Operation*, ssize_t>> completed;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (_ringFd == -1)
+		{
+			return;
+		}
+
+		unsigned head = *_cqHead;
+		const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const io_uring_cqe& cqe = _cqes[head & _cqMask];
+			Operation* operation = reinterpret_cast<Operation*>(cqe.user_data);
+			completed.emplace_back(operation, cqe.res);
+			_submitted.erase(operation);
+		}
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+
+		bool pushed = false;
+		while (!_backlog.empty() && _submitted.size() < _sqEntries)
+		{
+			pushToRing(_backlog.front());
+			_backlog.pop_front();
+			pushed = true;
+		}
+		if (pushed)
+		{
+			enterRing();
+		}
+	}
+
+	for (const std::pair<Operation*, ssize_t>& completion : completed)
+	{
+		std::unique_ptr<Operation> operation(completion.first);
+		if (operation->_handler)
+		{
+			operation->_handler(completion.second);
+		}
+	}
+}
+
+void AsyncFileIO::worker()
+{
+	while (true)
+	{
+		std::unique_ptr<Operation> operation;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wakeup.wait(lock, [this]() { return _stopping || !_queue.empty(); });
+			if (_stopping)
+			{
+				return;
+			}
+			operation = std::move(_queue.front());
+			_queue.pop_front();
+		}
+
+		const ssize_t result = perform(*operation);
+		if (!operation->_handler)
+		{
+			continue;
+		}
+
+		std::shared_ptr<Operation> completed(std::move(operation));
+		asio::post(_ioContext, [completed, result]()
+			{
+				completed->_handler(result);
+			});
+	}
+}
+
+ssize_t AsyncFileIO::perform(const Operation& operation)
+{
+	ssize_t n = 0;
+	do
+	{
+		switch (operation._type)
+		{
+		case Operation_Read:
+			n = ::pread(operation._fd, operation._data, operation._length, operation._offset);
+			break;
+		case Operation_Write:
+			n = ::pwrite(operation._fd, operation._data, operation._length, operation._offset);
+			break;
+		case Operation_Splice:
+			{
+				loff_t offset = operation._offset;
+				n = ::splice(operation._pipeFd, nullptr, operation._fd, &offset, operation._length, SPLICE_F_MOVE);
+			}
+			break;
+		case Operation_Advise:
+			// returns the error instead of setting errno
+			n = ::posix_fadvise(operation._fd, operation._offset, operation._length, operation._advice);
+			if (n != 0)
+			{
+				return -n;
+			}
+			break;
+		}
+	} while (n == -1 && errno == EINTR);
+
+	return (n == -1) ? -errno : n;
+}
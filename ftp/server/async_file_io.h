@@ -0,0 +1,138 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <asio.hpp>
+
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*
+ Asynchronous reads and writes of regular files, asio 1.12 has none.
+ Requests go to an io_uring ring, its completions are signalled by an
+ eventfd which is read by the io_context. The pool buffers are registered
+ with the ring, so reads and writes into them are done with READ_FIXED and
+ WRITE_FIXED and the kernel doesn't map them on every request.
+ When io_uring isn't available (old kernel, seccomp) the requests are done
+ by a small pool of threads instead.
+ Handlers are called by a thread of the io_context with the number of
+ bytes transferred or -errno, the handler of a hint may be empty.
+ */
+class AsyncFileIO final
+{
+public:
+	using Handler = std::function<void(ssize_t)>;
+
+public:
+	explicit AsyncFileIO(asio::io_context& ioContext, std::size_t buffersCount = 16, std::size_t bufferSize = 256 * 1024);
+	~AsyncFileIO();
+
+	AsyncFileIO(const AsyncFileIO&) = delete;
+	AsyncFileIO& operator=(const AsyncFileIO&) = delete;
+
+	void start();
+	void stop();
+
+	bool usesUring() const { return _ringFd != -1; }
+
+	// Buffers of the pool, when it's exhausted they are allocated
+	// from the heap and the requests just don't use registered buffers.
+	char* allocateBuffer();
+	void releaseBuffer(char* buffer);
+	std::size_t bufferSize() const { return _bufferSize; }
+
+	void read(int fd, char* data, std::size_t length, off_t offset, Handler handler);
+	void write(int fd, const char* data, std::size_t length, off_t offset, Handler handler);
+	// moves data from the pipe to the file
+	void splice(int pipeFd, int fd, std::size_t length, off_t offset, Handler handler);
+	// posix_fadvise(), which may block on WILLNEED while it starts the reads
+	void advise(int fd, off_t offset, std::size_t length, int advice, Handler handler);
+
+private:
+	enum OperationType
+	{
+		Operation_Read,
+		Operation_Write,
+		Operation_Splice,
+		Operation_Advise,
+	};
+
+	struct Operation
+	{
+		OperationType _type = Operation_Read;
+		int _fd = -1;
+		int _pipeFd = -1;
+		int _advice = 0;
+		char* _data = nullptr;
+		std::size_t _length = 0;
+		off_t _offset = 0;
+		Handler _handler;
+	};
+
+	void submit(std::unique_ptr<Operation> operation);
+	int bufferIndex(const char* data, std::size_t length) const;
+
+	bool setupRing();
+	void closeRing();
+	void pushToRing(Operation* operation);
+	void enterRing();
+	void readCompletions();
+	void reapCompletions();
+
+	void worker();
+	static ssize_t perform(const Operation& operation);
+
+private:
+	static const unsigned RING_ENTRIES = 256;
+	static const std::size_t WORKERS_COUNT = 4;
+
+	asio::io_context& _ioContext;
+	const std::size_t _buffersCount;
+	const std::size_t _bufferSize;
+
+	std::mutex _buffersMutex;
+	char* _buffers = nullptr;
+	std::vector<char*> _freeBuffers;
+	bool _buffersRegistered = false;
+
+	std::mutex _mutex;
+
+	// io_uring, the rings are shared with the kernel
+	int _ringFd = -1;
+	int _eventFd = -1;
+	asio::posix::stream_descriptor _eventStream;
+	std::uint64_t _eventCount = 0;
+	void* _sqRing = nullptr;
+	void* _cqRing = nullptr;
+	std::size_t _sqRingSize = 0;
+	std::size_t _cqRingSize = 0;
+	io_uring_sqe* _sqes = nullptr;
+	io_uring_cqe* _cqes = nullptr;
+	unsigned* _sqHead = nullptr;
+	unsigned* _sqTail = nullptr;
+	unsigned* _sqArray = nullptr;
+	unsigned* _cqHead = nullptr;
+	unsigned* _cqTail = nullptr;
+	unsigned _sqMask = 0;
+	unsigned _cqMask = 0;
+	unsigned _sqEntries = 0;
+	std::unordered_set<Operation*> _submitted;
+	std::deque<Operation*> _backlog;
+
+	// the fallback
+	std::vector<std::thread> _workers;
+	std::condition_variable _wakeup;
+	std::deque<std::unique_ptr<Operation>> _queue;
+	bool _stopping = false;
+};
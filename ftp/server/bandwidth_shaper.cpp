@@ -0,0 +1,268 @@
+#include "bandwidth_shaper.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+
+// a bucket holds at least this much, so the shaper may grant it at once
+static const double MIN_BURST = 64 * 1024;
+
+void TokenBucket::setRate(std::uint64_t rate)
+{
+	_rate = rate;
+	_burst = std::max(rate / 4.0, MIN_BURST);
+	_tokens = std::min(_tokens, _burst);
+}
+
+std::uint64_t TokenBucket::available(std::chrono::steady_clock::time_point now)
+{
+	if (_rate == 0)
+	{
+		return UNLIMITED;
+	}
+
+	if (_updated == std::chrono::steady_clock::time_point())
+	{
+		_tokens = _burst;
+	}
+	else
+	{
+		const double elapsed = std::chrono::duration<double>(now - _updated).count();
+		_tokens = std::min(_burst, _tokens + elapsed * _rate);
+	}
+	_updated = now;
+	return _tokens > 0 ? static_cast<std::uint64_t>(_tokens) : 0;
+}
+
+void TokenBucket::consume(std::uint64_t amount)
+{
+	if (_rate != 0)
+	{
+		_tokens -= amount;
+	}
+}
+
+
+const std::size_t BandwidthShaper::QUANTUM;
+const std::size_t BandwidthShaper::MIN_GRANT;
+constexpr std::chrono::milliseconds BandwidthShaper::TICK;
+
+BandwidthShaper::BandwidthShaper(asio::io_context& ioContext)
+	: _timer(ioContext)
+{
+
+}
+
+void BandwidthShaper::setGlobalRate(std::uint64_t rate)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_global.setRate(rate);
+}
+
+void BandwidthShaper::setUserRate(const std::string& username, std::uint64_t rate)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	userBucket(username)->setRate(rate);
+}
+
+void BandwidthShaper::setDefaultSessionRate(std::uint64_t rate)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_defaultSessionRate = rate;
+}
+
+bool BandwidthShaper::limitSessionRate(const std::shared_ptr<Flow>& flow, std::uint64_t rate)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_defaultSessionRate != 0 && (rate == 0 || rate > _defaultSessionRate))
+	{
+		return false;
+	}
+	flow->_bucket.setRate(rate);
+	return true;
+}
+
+BandwidthShaper::Rates BandwidthShaper::getRates(const std::shared_ptr<Flow>& flow)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	Rates rates;
+	rates._global = _global.getRate();
+	rates._user = flow->_user->getRate();
+	rates._session = flow->_bucket.getRate();
+	return rates;
+}
+
+std::shared_ptr<BandwidthShaper::Flow> BandwidthShaper::openFlow(const std::string& username)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	std::shared_ptr<Flow> flow(std::make_shared<Flow>());
+	flow->_bucket.setRate(_defaultSessionRate);
+	flow->_user = userBucket(username);
+	return flow;
+}
+
+void BandwidthShaper::closeFlow(const std::shared_ptr<Flow>& flow)
+{
+	Grant grant;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		flow->_closed = true;
+		if (flow->_waiting)
+		{
+			_waiting.erase(std::find(_waiting.begin(), _waiting.end(), flow));
+			flow->_waiting = false;
+		}
+		// released out of the lock, it may hold the last reference to the session
+		grant.swap(flow->_grant);
+	}
+}
+
+std::size_t BandwidthShaper::acquire(const std::shared_ptr<Flow>& flow, std::size_t wanted, Grant grant)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (flow->_closed)
+	{
+		return 0;
+	}
+
+	if (_waiting.empty())
+	{
+		const std::size_t amount = available(*flow, std::chrono::steady_clock::now(), wanted);
+		if (amount >= std::min(wanted, MIN_GRANT))
+		{
+			consume(*flow, amount);
+			return amount;
+		}
+	}
+
+	flow->_wanted = wanted;
+	flow->_grant = std::move(grant);
+	flow->_waiting = true;
+	_waiting.push_back(flow);
+
+	if (!_ticking)
+	{
+		_ticking = true;
+		wait();
+	}
+	return 0;
+}
+
+void BandwidthShaper::stop()
+{
+	// the grants hold their sessions, they are released out of the lock
+	std::vector<Grant> grants;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		std::error_code ec;
+		_timer.cancel(ec);
+		_ticking = false;
+
+		for (const std::shared_ptr<Flow>& flow : _waiting)
+		{
+			flow->_waiting = false;
+			grants.push_back(std::move(flow->_grant));
+			flow->_grant = nullptr;
+		}
+		_waiting.clear();
+	}
+}
+
+std::size_t BandwidthShaper::available(Flow& flow, std::chrono::steady_clock::time_point now, std::size_t wanted)
+{
+	std::uint64_t amount = std::min<std::uint64_t>(wanted, flow._bucket.available(now));
+	amount = std::min(amount, flow._user->available(now));
+	amount = std::min(amount, _global.available(now));
+	return static_cast<std::size_t>(amount);
+}
+
+void BandwidthShaper::consume(Flow& flow, std::size_t amount)
+{
+	flow._bucket.consume(amount);
+	flow._user->consume(amount);
+	_global.consume(amount);
+}
+
+std::shared_ptr<TokenBucket> BandwidthShaper::userBucket(const std::string& username)
+{
+	std::shared_ptr<TokenBucket>& bucket = _users[username];
+	if (!bucket)
+	{
+		bucket = std::make_shared<TokenBucket>();
+	}
+	return bucket;
+}
+
+void BandwidthShaper::wait()
+{
+	_timer.expires_after(TICK);
+	_timer.async_wait([this](std::error_code ec)
+		{
+			if (!ec)
+			{
+				serve();
+			}
+		});
+}
+
+// Rounds of deficit round robin over the waiting flows, as long as any of
+// them gets something. A flow waiting for its own (or its user's) bucket
+// doesn't hold the others up.
+void BandwidthShaper::serve()
+{
+	std::vector<std::pair<Grant, std::size_t>> grants;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_ticking)
+		{
+			return;
+		}
+
+		const std::chrono::steady_clock::time_point now(std::chrono::steady_clock::now());
+		bool granted = true;
+		while (granted && !_waiting.empty())
+		{
+			granted = false;
+			const std::size_t count = _waiting.size();
+			for (std::size_t i = 0; i < count; i++)
+			{
+				std::shared_ptr<Flow> flow(std::move(_waiting.front()));
+				_waiting.pop_front();
+
+				if (flow->_deficit < flow->_wanted)
+				{
+					flow->_deficit = std::min(flow->_deficit + QUANTUM, flow->_wanted);
+				}
+
+				const std::size_t amount = available(*flow, now, flow->_deficit);
+				if (amount < std::min(flow->_wanted, MIN_GRANT))
+				{
+					_waiting.push_back(std::move(flow));
+					continue;
+				}
+
+				consume(*flow, amount);
+				flow->_deficit -= amount;
+				flow->_waiting = false;
+				grants.emplace_back(std::move(flow->_grant), amount);
+				flow->_grant = nullptr;
+				granted = true;
+			}
+		}
+
+		if (_waiting.empty())
+		{
+			_ticking = false;
+		}
+		else
+		{
+			wait();
+		}
+	}
+
+	for (std::pair<Grant, std::size_t>& grant : grants)
+	{
+		grant.first(grant.second);
+	}
+}
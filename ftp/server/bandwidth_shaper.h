@@ -0,0 +1,119 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+
+/*
+ Token bucket, rate is in bytes per second and 0 means unlimited.
+ The bucket holds up to a quarter of a second worth of tokens, but never
+ less than a chunk the transfers are granted, so a low rate still lets
+ data go in large chunks, just less often.
+ */
+class TokenBucket final
+{
+public:
+	static const std::uint64_t UNLIMITED = UINT64_MAX;
+
+public:
+	void setRate(std::uint64_t rate);
+	std::uint64_t getRate() const { return _rate; }
+
+	std::uint64_t available(std::chrono::steady_clock::time_point now);
+	void consume(std::uint64_t amount);
+
+private:
+	std::uint64_t _rate = 0;
+	double _burst = 0;
+	double _tokens = 0;
+	std::chrono::steady_clock::time_point _updated;
+};
+
+
+/*
+ Shapes data connection writes of all sessions. Every transfer takes bytes
+ from three buckets: its session's, its user's and the global one.
+ While the buckets have tokens and nobody waits, a chunk is granted at once.
+ Otherwise the transfer joins the queue, which is served by deficit round
+ robin every TICK: each waiting transfer gets QUANTUM more bytes of credit
+ per round, so a bulk download can't starve the others.
+ Without any limit set grants are immediate and the queue is never used.
+ */
+class BandwidthShaper final
+{
+public:
+	class Flow;
+	using Grant = std::function<void(std::size_t)>;
+
+	struct Rates
+	{
+		std::uint64_t _global = 0;
+		std::uint64_t _user = 0;
+		std::uint64_t _session = 0;
+	};
+
+public:
+	explicit BandwidthShaper(asio::io_context& ioContext);
+
+	BandwidthShaper(const BandwidthShaper&) = delete;
+	BandwidthShaper& operator=(const BandwidthShaper&) = delete;
+
+	// the limits may be changed at any time, they apply to the running transfers too
+	void setGlobalRate(std::uint64_t rate);
+	void setUserRate(const std::string& username, std::uint64_t rate);
+	void setDefaultSessionRate(std::uint64_t rate);
+	// the rate the client asks for, it may not exceed the default session rate
+	bool limitSessionRate(const std::shared_ptr<Flow>& flow, std::uint64_t rate);
+	Rates getRates(const std::shared_ptr<Flow>& flow);
+
+	std::shared_ptr<Flow> openFlow(const std::string& username);
+	void closeFlow(const std::shared_ptr<Flow>& flow);
+
+	// Returns the number of bytes (up to 'wanted') the flow may send right now.
+	// If it's 0, 'grant' is called later from a thread of io_context instead.
+	std::size_t acquire(const std::shared_ptr<Flow>& flow, std::size_t wanted, Grant grant);
+
+	void stop();
+
+private:
+	std::size_t available(Flow& flow, std::chrono::steady_clock::time_point now, std::size_t wanted);
+	void consume(Flow& flow, std::size_t amount);
+	std::shared_ptr<TokenBucket> userBucket(const std::string& username);
+	void wait();
+	void serve();
+
+private:
+	static const std::size_t QUANTUM = 256 * 1024;
+	static const std::size_t MIN_GRANT = 64 * 1024;
+	static constexpr std::chrono::milliseconds TICK{10};
+
+	std::mutex _mutex;
+	asio::steady_timer _timer;
+	bool _ticking = false;
+
+	TokenBucket _global;
+	std::uint64_t _defaultSessionRate = 0;
+	std::unordered_map<std::string, std::shared_ptr<TokenBucket>> _users;
+	std::deque<std::shared_ptr<Flow>> _waiting;
+};
+
+class BandwidthShaper::Flow final
+{
+	friend class BandwidthShaper;
+
+	TokenBucket _bucket;
+	std::shared_ptr<TokenBucket> _user;
+	std::size_t _deficit = 0;
+	std::size_t _wanted = 0;
+	Grant _grant;
+	bool _waiting = false;
+	bool _closed = false;
+};
@@ -0,0 +1,162 @@
+#include "compressed_file_cache.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <experimental/filesystem>
+#include <iostream>
+
+
+CompressedFileCache::CompressedFileCache(std::uint64_t capacity)
+	: _capacity(capacity)
+{
+
+}
+
+CompressedFileCache::~CompressedFileCache()
+{
+	close();
+}
+
+bool CompressedFileCache::open(const std::string& dir)
+{
+	namespace fs = std::experimental::filesystem;
+
+	close();
+
+	std::error_code ec;
+	fs::remove_all(dir, ec);
+	if (!fs::create_directories(dir, ec))
+	{
+		LOG_ERROR() << " - Error 'Could not create directory '" << dir << "': " << ec.message() << "'\n";
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	_dir = dir;
+	return true;
+}
+
+void CompressedFileCache::close()
+{
+	namespace fs = std::experimental::filesystem;
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_dir.empty())
+	{
+		std::error_code ec;
+		fs::remove_all(_dir, ec);
+		_dir.clear();
+	}
+	_copies.clear();
+	_order.clear();
+	_size = 0;
+}
+
+std::string CompressedFileCache::makeKey(const struct stat& st, char type, int level)
+{
+	char key[128];
+	std::snprintf(key, sizeof(key), "%llx-%llx-%llx-%llx.%09ld-%c%d.z",
+		static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino),
+		static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(st.st_mtim.tv_sec),
+		st.st_mtim.tv_nsec, type, level);
+	return key;
+}
+
+int CompressedFileCache::find(const std::string& key)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_copies.find(key) == _copies.end())
+	{
+		return -1;
+	}
+
+	// the copy may be evicted right after, the descriptor keeps it readable
+	return ::open((_dir + '/' + key).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+int CompressedFileCache::create(std::string& tempPath)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_dir.empty())
+	{
+		return -1;
+	}
+	tempPath = _dir + "/.tmp-XXXXXX";
+	lock.unlock();
+
+	const int fd = ::mkostemp(&tempPath[0], O_CLOEXEC);
+	if (fd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not create file '" << tempPath << "': " << std::strerror(errno) << "'\n";
+	}
+	return fd;
+}
+
+void CompressedFileCache::commit(const std::string& key, const std::string& tempPath)
+{
+	struct stat st;
+	if (::stat(tempPath.c_str(), &st) == -1 || static_cast<std::uint64_t>(st.st_size) > _capacity / 4)
+	{
+		// too large copies would push everything else out
+		::unlink(tempPath.c_str());
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_dir.empty() || _copies.find(key) != _copies.end())
+	{
+		// another session has published the same copy meanwhile
+		::unlink(tempPath.c_str());
+		return;
+	}
+
+	if (::rename(tempPath.c_str(), (_dir + '/' + key).c_str()) == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not rename file '" << tempPath << "': " << std::strerror(errno) << "'\n";
+		::unlink(tempPath.c_str());
+		return;
+	}
+
+	_copies[key] = st.st_size;
+	_order.push_back(key);
+	_size += st.st_size;
+
+	while (_size > _capacity && !_order.empty())
+	{
+		const std::string& oldest = _order.front();
+		::unlink((_dir + '/' + oldest).c_str());
+		_size -= _copies[oldest];
+		_copies.erase(oldest);
+		_order.pop_front();
+	}
+}
+
+void CompressedFileCache::discard(const std::string& tempPath)
+{
+	::unlink(tempPath.c_str());
+}
+
+bool CompressedFileCache::append(int fd, const char* data, std::size_t length)
+{
+	while (length != 0)
+	{
+		const ssize_t n = ::write(fd, data, length);
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		length -= n;
+	}
+	return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+/*
+ Compressed copies of the files sent in MODE Z, kept in a private directory.
+ The name of a copy is made of the file's device, inode, size and mtime,
+ the transfer type and the compression level, so a modified file never
+ matches the copy of its previous content.
+ The copy is written while the file is compressed for the first time and
+ is published by rename() once the transfer is complete. Next transfers of
+ the file send the copy by sendfile(). Total size of the copies is limited,
+ the oldest ones are removed first.
+ */
+class CompressedFileCache final
+{
+public:
+	explicit CompressedFileCache(std::uint64_t capacity = 1024ULL * 1024 * 1024);
+	~CompressedFileCache();
+
+	CompressedFileCache(const CompressedFileCache&) = delete;
+	CompressedFileCache& operator=(const CompressedFileCache&) = delete;
+
+	// the directory is created and is removed with all copies by close()
+	bool open(const std::string& dir);
+	void close();
+
+	static std::string makeKey(const struct stat& st, char type, int level);
+
+	// returns the descriptor of the copy or -1 if there isn't one
+	int find(const std::string& key);
+
+	// returns the descriptor of the new temporary file or -1
+	int create(std::string& tempPath);
+	void commit(const std::string& key, const std::string& tempPath);
+	void discard(const std::string& tempPath);
+
+	static bool append(int fd, const char* data, std::size_t length);
+
+private:
+	const std::uint64_t _capacity;
+
+	std::mutex _mutex;
+	std::string _dir;
+	std::uint64_t _size = 0;
+	std::unordered_map<std::string, std::uint64_t> _copies;
+	std::deque<std::string> _order;
+};
@@ -0,0 +1,183 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_X86
+#endif
+
+
+namespace
+{
+
+const std::uint32_t POLYNOMIAL = 0x82f63b78;	// reversed
+
+struct Table
+{
+	std::uint32_t _entries[256];
+
+	Table()
+	{
+		for (std::uint32_t i = 0; i < 256; i++)
+		{
+			std::uint32_t crc = i;
+			for (int k = 0; k < 8; k++)
+			{
+				crc = (crc & 1) != 0 ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+			}
+			_entries[i] = crc;
+		}
+	}
+};
+
+const Table table;
+
+std::uint32_t updateGeneric(std::uint32_t crc, const unsigned char* data, std::size_t size)
+{
+	for (std::size_t i = 0; i < size; i++)
+	{
+		crc = table._entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+#ifdef CRC32C_X86
+
+__attribute__((target("sse4.2")))
+std::uint32_t updateSse42(std::uint32_t crc, const unsigned char* data, std::size_t size)
+{
+	while (size != 0 && (reinterpret_cast<std::uintptr_t>(data) & 7) != 0)
+	{
+		crc = _mm_crc32_u8(crc, *data++);
+		size--;
+	}
+
+#ifdef __x86_64__
+	std::uint64_t crc64 = crc;
+	for (; size >= 8; size -= 8, data += 8)
+	{
+		std::uint64_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc64 = _mm_crc32_u64(crc64, word);
+	}
+	crc = static_cast<std::uint32_t>(crc64);
+#endif
+	for (; size >= 4; size -= 4, data += 4)
+	{
+		std::uint32_t word;
+		std::memcpy(&word, data, sizeof(word));
+		crc = _mm_crc32_u32(crc, word);
+	}
+
+	while (size-- != 0)
+	{
+		crc = _mm_crc32_u8(crc, *data++);
+	}
+	return crc;
+}
+
+#endif
+
+struct Kernels
+{
+	std::uint32_t (*_update)(std::uint32_t, const unsigned char*, std::size_t) = updateGeneric;
+
+	Kernels()
+	{
+#ifdef CRC32C_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2"))
+		{
+			_update = updateSse42;
+		}
+#endif
+	}
+};
+
+const Kernels kernels;
+
+// The combination is done as in zlib: appending 'size2' zero bytes to the
+// first block is a linear operator over GF(2), applied by repeated squaring.
+std::uint32_t gf2MatrixTimes(const std::uint32_t* matrix, std::uint32_t vector)
+{
+	std::uint32_t sum = 0;
+	while (vector != 0)
+	{
+		if ((vector & 1) != 0)
+		{
+			sum ^= *matrix;
+		}
+		vector >>= 1;
+		matrix++;
+	}
+	return sum;
+}
+
+void gf2MatrixSquare(std::uint32_t* square, const std::uint32_t* matrix)
+{
+	for (int n = 0; n < 32; n++)
+	{
+		square[n] = gf2MatrixTimes(matrix, matrix[n]);
+	}
+}
+
+}
+
+
+namespace crc32c
+{
+
+std::uint32_t update(std::uint32_t crc, const void* data, std::size_t size)
+{
+	return ~kernels._update(~crc, static_cast<const unsigned char*>(data), size);
+}
+
+std::uint32_t combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2)
+{
+	if (size2 == 0)
+	{
+		return crc1;
+	}
+
+	std::uint32_t even[32];	// operator for 2^n zero bits, n even
+	std::uint32_t odd[32];	// and n odd
+
+	// one zero bit
+	odd[0] = POLYNOMIAL;
+	std::uint32_t row = 1;
+	for (int n = 1; n < 32; n++)
+	{
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	gf2MatrixSquare(even, odd);	// two zero bits
+	gf2MatrixSquare(odd, even);	// four zero bits
+
+	// the first squaring gives the operator for one zero byte
+	do
+	{
+		gf2MatrixSquare(even, odd);
+		if ((size2 & 1) != 0)
+		{
+			crc1 = gf2MatrixTimes(even, crc1);
+		}
+		size2 >>= 1;
+		if (size2 == 0)
+		{
+			break;
+		}
+
+		gf2MatrixSquare(odd, even);
+		if ((size2 & 1) != 0)
+		{
+			crc1 = gf2MatrixTimes(odd, crc1);
+		}
+		size2 >>= 1;
+	} while (size2 != 0);
+
+	return crc1 ^ crc2;
+}
+
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+
+/*
+ CRC-32C (Castagnoli), the checksum of iSCSI and ext4. The x86 CRC32
+ instruction computes it 8 bytes at a time, the implementation is chosen
+ once by the features of the CPU, others get a table driven one.
+ The values are the same as of zlib's crc32(): start with 0 and pass the
+ result of the previous block to continue.
+ */
+namespace crc32c
+{
+
+std::uint32_t update(std::uint32_t crc, const void* data, std::size_t size);
+
+// CRC of two blocks joined, 'crc2' is of the second one of 'size2' bytes.
+std::uint32_t combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2);
+
+}
@@ -0,0 +1,189 @@
+#include "directory_listing_cache.h"
+#include "log.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+
+namespace
+{
+
+const std::uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB
+	| IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+}
+
+
+DirectoryListingCache::DirectoryListingCache(asio::io_context& ioContext, std::size_t maxEntries)
+	: _maxEntries(maxEntries)
+	, _inotify(ioContext)
+{
+
+}
+
+DirectoryListingCache::~DirectoryListingCache()
+{
+	stop();
+}
+
+void DirectoryListingCache::start()
+{
+	_inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotifyFd == -1)
+	{
+		// nothing is cached without notifications
+		LOG_ERROR() << " - Error 'inotify_init1() failed: " << std::strerror(errno) << "'\n";
+		return;
+	}
+
+	_inotify.assign(_inotifyFd);
+	readEvents();
+}
+
+void DirectoryListingCache::stop()
+{
+	std::error_code ec;
+	_inotify.close(ec);
+	_inotifyFd = -1;
+
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	_entries.clear();
+	_watches.clear();
+}
+
+DirectoryListingCache::Listing DirectoryListingCache::find(const std::string& dir, Format format) const
+{
+	std::shared_lock<std::shared_mutex> lock(_mutex);
+	std::unordered_map<std::string, Entry>::const_iterator it = _entries.find(dir);
+	if (it == _entries.cend() || !it->second._listings[format])
+	{
+		_misses++;
+		return Listing();
+	}
+
+	_hits++;
+	return it->second._listings[format];
+}
+
+bool DirectoryListingCache::watch(const std::string& dir, std::uint64_t& generation)
+{
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	if (_inotifyFd == -1)
+	{
+		return false;
+	}
+
+	std::unordered_map<std::string, Entry>::iterator it = _entries.find(dir);
+	if (it != _entries.end())
+	{
+		generation = it->second._generation;
+		return true;
+	}
+
+	const int wd = ::inotify_add_watch(_inotifyFd, dir.c_str(), WATCH_MASK);
+	if (wd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not watch directory '" << dir << "': " << std::strerror(errno) << "'\n";
+		return false;
+	}
+
+	if (_entries.size() >= _maxEntries)
+	{
+		evict();
+	}
+
+	Entry& entry = _entries[dir];
+	entry._wd = wd;
+	_watches[wd] = dir;
+	generation = entry._generation;
+	return true;
+}
+
+void DirectoryListingCache::insert(const std::string& dir, std::uint64_t generation, Format format, const Listing& listing)
+{
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	std::unordered_map<std::string, Entry>::iterator it = _entries.find(dir);
+	if (it != _entries.end() && it->second._generation == generation)
+	{
+		it->second._listings[format] = listing;
+	}
+}
+
+void DirectoryListingCache::readEvents()
+{
+	_inotify.async_read_some(asio::buffer(_events),
+		[this](std::error_code ec, std::size_t length)
+		{
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				}
+				return;
+			}
+
+			handleEvents(length);
+			readEvents();
+		});
+}
+
+void DirectoryListingCache::handleEvents(std::size_t length)
+{
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+
+	for (std::size_t offset = 0; offset + sizeof(inotify_event) <= length; )
+	{
+		const inotify_event* event = reinterpret_cast<const inotify_event*>(_events.data() + offset);
+		offset += sizeof(inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW)
+		{
+			// some events are lost, nothing cached may be trusted
+			for (std::pair<const std::string, Entry>& entry : _entries)
+			{
+				entry.second._generation++;
+				entry.second._listings.fill(Listing());
+			}
+			continue;
+		}
+
+		std::unordered_map<int, std::string>::iterator watchIt = _watches.find(event->wd);
+		if (watchIt == _watches.end())
+		{
+			continue;
+		}
+
+		std::unordered_map<std::string, Entry>::iterator it = _entries.find(watchIt->second);
+		if (event->mask & IN_IGNORED)
+		{
+			// the directory is removed or the watch is dropped by evict()
+			if (it != _entries.end() && it->second._wd == event->wd)
+			{
+				_entries.erase(it);
+			}
+			_watches.erase(watchIt);
+			continue;
+		}
+
+		if (it != _entries.end())
+		{
+			it->second._generation++;
+			it->second._listings.fill(Listing());
+		}
+	}
+}
+
+void DirectoryListingCache::evict()
+{
+	// any entry will do, the cache is expected to be much larger than the working set
+	std::unordered_map<std::string, Entry>::iterator it = _entries.begin();
+	::inotify_rm_watch(_inotifyFd, it->second._wd);
+	_watches.erase(it->second._wd);
+	_entries.erase(it);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+
+/*
+ Rendered directory listings shared by all sessions.
+ Every cached directory is watched with inotify, any change of the
+ directory or of an entry in it drops its listing, so the next LIST
+ renders it again. LIST and MLSD listings of a directory are kept side
+ by side. The listing is immutable, a session keeps it alive
+ by shared_ptr while it's being sent.
+
+ The directory has to be watched before it's read: watch() returns the
+ generation of the directory and insert() stores the listing only if
+ nothing has happened to the directory since then.
+ */
+class DirectoryListingCache final
+{
+public:
+	using Listing = std::shared_ptr<const std::string>;
+
+	enum Format
+	{
+		Format_List,
+		Format_Machine,
+		FORMATS_COUNT
+	};
+
+public:
+	explicit DirectoryListingCache(asio::io_context& ioContext, std::size_t maxEntries = 4096);
+	~DirectoryListingCache();
+
+	DirectoryListingCache(const DirectoryListingCache&) = delete;
+	DirectoryListingCache& operator=(const DirectoryListingCache&) = delete;
+
+	void start();
+	void stop();
+
+	Listing find(const std::string& dir, Format format) const;
+	bool watch(const std::string& dir, std::uint64_t& generation);
+	void insert(const std::string& dir, std::uint64_t generation, Format format, const Listing& listing);
+
+	std::uint64_t hits() const { return _hits; }
+	std::uint64_t misses() const { return _misses; }
+
+private:
+	struct Entry
+	{
+		int _wd = -1;
+		std::uint64_t _generation = 0;
+		std::array<Listing, FORMATS_COUNT> _listings;
+	};
+
+	void readEvents();
+	void handleEvents(std::size_t length);
+	void evict();
+
+private:
+	static const std::size_t EVENTS_BUFFER_SIZE = 64 * 1024;
+
+	const std::size_t _maxEntries;
+	int _inotifyFd = -1;
+	asio::posix::stream_descriptor _inotify;
+	std::array<char, EVENTS_BUFFER_SIZE> _events;
+
+	mutable std::shared_mutex _mutex;
+	std::unordered_map<std::string, Entry> _entries;
+	std::unordered_map<int, std::string> _watches;
+
+	mutable std::atomic<std::uint64_t> _hits{0};
+	mutable std::atomic<std::uint64_t> _misses{0};
+};
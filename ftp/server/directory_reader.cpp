@@ -0,0 +1,106 @@
+#include "directory_reader.h"
+#include "log.h"
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+
+namespace
+{
+
+// the layout the kernel fills in, glibc doesn't declare it
+struct linux_dirent64
+{
+	std::uint64_t d_ino;
+	std::int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+bool isDotOrDotDot(const char* name)
+{
+	return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+}
+
+
+DirectoryReader::~DirectoryReader()
+{
+	close();
+}
+
+bool DirectoryReader::open(const std::string& path, unsigned int mask)
+{
+	close();
+
+	_mask = mask;
+	_fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (_fd == -1)
+	{
+		return false;
+	}
+
+	if (_buffer.empty())
+	{
+		_buffer.resize(BUFFER_SIZE);
+	}
+	return true;
+}
+
+void DirectoryReader::close()
+{
+	if (_fd != -1)
+	{
+		::close(_fd);
+		_fd = -1;
+	}
+	_offset = 0;
+	_length = 0;
+}
+
+bool DirectoryReader::next(Entry& entry)
+{
+	while (_fd != -1)
+	{
+		if (_offset == _length)
+		{
+			const long n = ::syscall(SYS_getdents64, _fd, _buffer.data(), _buffer.size());
+			if (n <= 0)
+			{
+				if (n == -1)
+				{
+					LOG_ERROR() << " - Error 'getdents64() failed: " << std::strerror(errno) << "'\n";
+				}
+				close();
+				return false;
+			}
+			_offset = 0;
+			_length = static_cast<std::size_t>(n);
+		}
+
+		const linux_dirent64* dirent = reinterpret_cast<const linux_dirent64*>(_buffer.data() + _offset);
+		_offset += dirent->d_reclen;
+
+		if (isDotOrDotDot(dirent->d_name))
+		{
+			continue;
+		}
+
+		if (::statx(_fd, dirent->d_name, AT_STATX_SYNC_AS_STAT, _mask, &entry._stx) == -1)
+		{
+			continue;
+		}
+
+		entry._name = dirent->d_name;
+		return true;
+	}
+	return false;
+}
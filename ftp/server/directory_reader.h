@@ -0,0 +1,50 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+
+/*
+ Reads a directory by getdents64() in large batches and stats every entry
+ with statx() relative to the directory descriptor, so neither a path of
+ the entry is built nor the fields which aren't asked for are filled.
+ "." and ".." are skipped, the entries which disappear in between are too.
+ */
+class DirectoryReader final
+{
+public:
+	struct Entry
+	{
+		const char* _name = nullptr;
+		struct statx _stx;
+	};
+
+public:
+	DirectoryReader() = default;
+	~DirectoryReader();
+
+	DirectoryReader(const DirectoryReader&) = delete;
+	DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+	// mask tells statx() which fields of the entries are needed,
+	// returns false and keeps errno on failure
+	bool open(const std::string& path, unsigned int mask);
+	void close();
+	bool isOpen() const { return _fd != -1; }
+
+	// returns false at the end of the directory or on error, entry's name
+	// is valid until the next call
+	bool next(Entry& entry);
+
+private:
+	static const std::size_t BUFFER_SIZE = 64 * 1024;
+
+	unsigned int _mask = 0;
+	int _fd = -1;
+	std::vector<char> _buffer;
+	std::size_t _offset = 0;
+	std::size_t _length = 0;
+};
@@ -0,0 +1,514 @@
+#include "file_checksums.h"
+#include "crc32c.h"
+#include "log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/evp.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+
+struct FileChecksums::Job
+{
+	int _fd = -1;
+	Algorithm _algorithm = Algorithm_Crc32;
+	struct stat _stat;
+	std::string _key;
+	std::uint64_t _first = 0;
+	std::uint64_t _length = 0;
+	std::uint64_t _chunkSize = 0;
+	Handler _handler;
+
+	std::vector<std::uint32_t> _crcs;
+	std::atomic<std::size_t> _remaining{0};
+	std::atomic<int> _error{0};
+
+	~Job()
+	{
+		if (_fd != -1)
+		{
+			::close(_fd);
+		}
+	}
+};
+
+namespace
+{
+
+// Reads the range by READ_SIZE blocks and passes them to 'consume', returns errno.
+template <typename Consume>
+int readRange(int fd, std::uint64_t offset, std::uint64_t length, std::size_t blockSize, Consume consume)
+{
+	std::unique_ptr<char[]> buffer(new char[blockSize]);
+	while (length != 0)
+	{
+		const std::size_t amount = static_cast<std::size_t>(std::min<std::uint64_t>(length, blockSize));
+		const ssize_t n = ::pread(fd, buffer.get(), amount, static_cast<off_t>(offset));
+		if (n == -1)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return errno;
+		}
+		if (n == 0)
+		{
+			return EIO;	// truncated meanwhile
+		}
+
+		consume(buffer.get(), static_cast<std::size_t>(n));
+		offset += n;
+		length -= n;
+	}
+	return 0;
+}
+
+std::string toHex(const unsigned char* data, std::size_t size)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(size * 2, '0');
+	for (std::size_t i = 0; i < size; i++)
+	{
+		hex[i * 2] = digits[data[i] >> 4];
+		hex[i * 2 + 1] = digits[data[i] & 0x0f];
+	}
+	return hex;
+}
+
+std::string crcToHex(std::uint32_t crc)
+{
+	char hex[16];
+	std::snprintf(hex, sizeof(hex), "%08x", crc);
+	return hex;
+}
+
+bool sameFile(const struct stat& a, const struct stat& b)
+{
+	return a.st_dev == b.st_dev && a.st_ino == b.st_ino && a.st_size == b.st_size
+		&& a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+}
+
+}
+
+
+const std::size_t FileChecksums::READ_SIZE;
+const std::uint64_t FileChecksums::MIN_CHUNK_SIZE;
+
+FileChecksums::FileChecksums(std::size_t threadsCount, std::size_t capacity)
+	: _threadsCount(threadsCount != 0 ? threadsCount : 1)
+	, _capacity(capacity)
+{
+
+}
+
+FileChecksums::~FileChecksums()
+{
+	stop();
+}
+
+void FileChecksums::start(const std::string& path)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_path = path;
+		load();
+	}
+
+	std::lock_guard<std::mutex> lock(_tasksMutex);
+	_stopping = false;
+	for (std::size_t i = 0; i < _threadsCount; i++)
+	{
+		_workers.emplace_back(&FileChecksums::worker, this);
+	}
+}
+
+void FileChecksums::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(_tasksMutex);
+		_stopping = true;
+		_tasks.clear();
+	}
+	_wakeup.notify_all();
+
+	for (std::thread& worker : _workers)
+	{
+		worker.join();
+	}
+	_workers.clear();
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_fd != -1)
+	{
+		::close(_fd);
+		_fd = -1;
+	}
+}
+
+const char* FileChecksums::algorithmName(Algorithm algorithm)
+{
+	switch (algorithm)
+	{
+	case Algorithm_Crc32:
+		return "CRC32";
+	case Algorithm_Crc32c:
+		return "CRC32C";
+	case Algorithm_Sha256:
+		return "SHA-256";
+	}
+	return "";
+}
+
+bool FileChecksums::parseAlgorithm(const std::string& name, Algorithm& algorithm)
+{
+	for (Algorithm candidate : { Algorithm_Crc32, Algorithm_Crc32c, Algorithm_Sha256 })
+	{
+		if (name == algorithmName(candidate))
+		{
+			algorithm = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+void FileChecksums::compute(const std::string& path, Algorithm algorithm, std::uint64_t first, std::int64_t last, Handler handler)
+{
+	post([this, path, algorithm, first, last, handler]()
+		{
+			run(path, algorithm, first, last, handler);
+		});
+}
+
+void FileChecksums::post(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(_tasksMutex);
+		if (_stopping)
+		{
+			return;
+		}
+		_tasks.push_back(std::move(task));
+	}
+	_wakeup.notify_one();
+}
+
+void FileChecksums::worker()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(_tasksMutex);
+			_wakeup.wait(lock, [this]() { return _stopping || !_tasks.empty(); });
+			if (_stopping)
+			{
+				return;
+			}
+			task = std::move(_tasks.front());
+			_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void FileChecksums::run(const std::string& path, Algorithm algorithm, std::uint64_t first, std::int64_t last, Handler handler)
+{
+	Result result;
+	result._first = first;
+
+	auto job = std::make_shared<Job>();
+	job->_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (job->_fd == -1 || ::fstat(job->_fd, &job->_stat) == -1)
+	{
+		result._error = errno;
+		handler(result);
+		return;
+	}
+
+	const std::uint64_t size = static_cast<std::uint64_t>(job->_stat.st_size);
+	if (!S_ISREG(job->_stat.st_mode))
+	{
+		result._error = EISDIR;
+		handler(result);
+		return;
+	}
+	if (first > size || (last >= 0 && static_cast<std::uint64_t>(last) < first))
+	{
+		result._error = EINVAL;
+		handler(result);
+		return;
+	}
+
+	const std::uint64_t end = last >= 0 ? std::min(static_cast<std::uint64_t>(last) + 1, size) : size;
+	result._length = end - first;
+
+	job->_algorithm = algorithm;
+	job->_first = first;
+	job->_length = result._length;
+	job->_key = makeKey(job->_stat, algorithm, first, result._length);
+	job->_handler = std::move(handler);
+
+	if (lookup(job->_key, result._checksum))
+	{
+		_hits++;
+		result._cached = true;
+		job->_handler(result);
+		return;
+	}
+	_misses++;
+
+	::posix_fadvise(job->_fd, static_cast<off_t>(first), static_cast<off_t>(result._length), POSIX_FADV_SEQUENTIAL);
+
+	if (algorithm == Algorithm_Sha256)
+	{
+		EVP_MD_CTX* context = EVP_MD_CTX_new();
+		if (context == nullptr || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1)
+		{
+			EVP_MD_CTX_free(context);
+			result._error = ENOMEM;
+			job->_handler(result);
+			return;
+		}
+
+		result._error = readRange(job->_fd, first, result._length, READ_SIZE,
+			[context](const char* data, std::size_t size)
+			{
+				EVP_DigestUpdate(context, data, size);
+			});
+
+		unsigned char digest[EVP_MAX_MD_SIZE];
+		unsigned int digestSize = 0;
+		EVP_DigestFinal_ex(context, digest, &digestSize);
+		EVP_MD_CTX_free(context);
+
+		if (result._error == 0)
+		{
+			result._checksum = toHex(digest, digestSize);
+			storeUnchanged(*job, result._checksum);
+		}
+		job->_handler(result);
+		return;
+	}
+
+	// CRCs of the chunks are combined, so the threads may take one each
+	std::size_t chunksCount = 1;
+	if (_threadsCount > 1 && result._length >= 2 * MIN_CHUNK_SIZE)
+	{
+		chunksCount = static_cast<std::size_t>(std::min<std::uint64_t>(_threadsCount, result._length / MIN_CHUNK_SIZE));
+	}
+	job->_chunkSize = (result._length + chunksCount - 1) / chunksCount;
+	job->_crcs.resize(chunksCount);
+	job->_remaining = chunksCount;
+
+	for (std::size_t i = 1; i < chunksCount; i++)
+	{
+		post([this, job, i]() { computeChunk(job, i); });
+	}
+	computeChunk(job, 0);
+}
+
+void FileChecksums::computeChunk(const std::shared_ptr<Job>& job, std::size_t index)
+{
+	const std::uint64_t offset = index * job->_chunkSize;
+	const std::uint64_t length = std::min(job->_chunkSize, job->_length - offset);
+
+	std::uint32_t crc = 0;
+	int error = 0;
+	if (job->_algorithm == Algorithm_Crc32c)
+	{
+		error = readRange(job->_fd, job->_first + offset, length, READ_SIZE,
+			[&crc](const char* data, std::size_t size)
+			{
+				crc = crc32c::update(crc, data, size);
+			});
+	}
+	else
+	{
+		error = readRange(job->_fd, job->_first + offset, length, READ_SIZE,
+			[&crc](const char* data, std::size_t size)
+			{
+				crc = static_cast<std::uint32_t>(::crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size)));
+			});
+	}
+
+	job->_crcs[index] = crc;
+	if (error != 0)
+	{
+		job->_error = error;
+	}
+
+	if (--job->_remaining == 0)
+	{
+		finish(*job);
+	}
+}
+
+void FileChecksums::finish(Job& job)
+{
+	Result result;
+	result._first = job._first;
+	result._length = job._length;
+	result._error = job._error;
+
+	if (result._error == 0)
+	{
+		std::uint32_t crc = job._crcs[0];
+		for (std::size_t i = 1; i < job._crcs.size(); i++)
+		{
+			const std::uint64_t length = std::min(job._chunkSize, job._length - i * job._chunkSize);
+			crc = job._algorithm == Algorithm_Crc32c ? crc32c::combine(crc, job._crcs[i], length)
+				: static_cast<std::uint32_t>(::crc32_combine(crc, job._crcs[i], static_cast<z_off_t>(length)));
+		}
+		result._checksum = crcToHex(crc);
+		storeUnchanged(job, result._checksum);
+	}
+
+	job._handler(result);
+}
+
+// A file modified while it was read gets the checksum, but it isn't cached.
+void FileChecksums::storeUnchanged(const Job& job, const std::string& checksum)
+{
+	struct stat st;
+	if (::fstat(job._fd, &st) == 0 && sameFile(st, job._stat))
+	{
+		store(job._key, checksum);
+	}
+}
+
+std::string FileChecksums::makeKey(const struct stat& st, Algorithm algorithm, std::uint64_t first, std::uint64_t length)
+{
+	char key[160];
+	std::snprintf(key, sizeof(key), "%llx-%llx-%llx-%llx.%09ld-%s-%llx-%llx",
+		static_cast<unsigned long long>(st.st_dev), static_cast<unsigned long long>(st.st_ino),
+		static_cast<unsigned long long>(st.st_size), static_cast<unsigned long long>(st.st_mtim.tv_sec),
+		st.st_mtim.tv_nsec, algorithmName(algorithm),
+		static_cast<unsigned long long>(first), static_cast<unsigned long long>(length));
+	return key;
+}
+
+bool FileChecksums::lookup(const std::string& key, std::string& checksum)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	const auto it = _entries.find(key);
+	if (it == _entries.end())
+	{
+		return false;
+	}
+	checksum = it->second;
+	return true;
+}
+
+void FileChecksums::store(const std::string& key, const std::string& checksum)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (_entries.count(key) != 0)
+	{
+		return;
+	}
+	insert(key, checksum);
+
+	if (_fd == -1)
+	{
+		return;
+	}
+
+	// evicted entries stay in the file until it's rewritten
+	if (++_appended > _capacity)
+	{
+		rewrite();
+		return;
+	}
+
+	const std::string line(key + ' ' + checksum + '\n');
+	if (::write(_fd, line.data(), line.length()) != static_cast<ssize_t>(line.length()))
+	{
+		LOG_ERROR() << " - Error 'Could not write to '" << _path << "': " << std::strerror(errno) << "'\n";
+	}
+}
+
+void FileChecksums::insert(const std::string& key, const std::string& checksum)
+{
+	if (_entries.emplace(key, checksum).second)
+	{
+		_order.push_back(key);
+	}
+	while (_order.size() > _capacity)
+	{
+		_entries.erase(_order.front());
+		_order.pop_front();
+	}
+}
+
+void FileChecksums::load()
+{
+	if (_path.empty())
+	{
+		return;
+	}
+
+	std::ifstream file(_path);
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const std::size_t p = line.find(' ');
+		if (p != std::string::npos && p != 0 && p + 1 < line.length())
+		{
+			insert(line.substr(0, p), line.substr(p + 1));
+		}
+	}
+
+	LOG_INFO() << " - Checksums: " << _entries.size() << " loaded from '" << _path << "'\n";
+	rewrite();
+}
+
+// Writes the entries to a new file which replaces the log, the log goes on in it.
+void FileChecksums::rewrite()
+{
+	if (_fd != -1)
+	{
+		::close(_fd);
+		_fd = -1;
+	}
+	_appended = 0;
+
+	const std::string tempPath(_path + ".tmp");
+	const int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not create '" << tempPath << "': " << std::strerror(errno) << "'\n";
+		return;
+	}
+
+	std::string data;
+	for (const std::string& key : _order)
+	{
+		data.append(key).append(1, ' ').append(_entries[key]).append(1, '\n');
+	}
+
+	if (::write(fd, data.data(), data.length()) != static_cast<ssize_t>(data.length())
+		|| ::rename(tempPath.c_str(), _path.c_str()) == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not write '" << _path << "': " << std::strerror(errno) << "'\n";
+		::close(fd);
+		::unlink(tempPath.c_str());
+		return;
+	}
+	::close(fd);
+
+	_fd = ::open(_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	if (_fd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not open '" << _path << "': " << std::strerror(errno) << "'\n";
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+/*
+ Checksums of files for HASH, XCRC and XSHA256, computed by a pool of
+ threads. The results are cached by the file's device, inode, size and
+ mtime, so a modified file never matches the checksum of its previous
+ content. The cache is kept in a file as a log of lines, which is rewritten
+ when it's loaded or has grown too much, and so survives restarts.
+ CRCs of large ranges are split into chunks computed by all of the threads
+ at once and combined. CRC-32C uses the CRC32 instruction, SHA-256 is done
+ by OpenSSL, which picks SHA extensions or AVX2 by itself.
+ */
+class FileChecksums final
+{
+public:
+	enum Algorithm
+	{
+		Algorithm_Crc32,
+		Algorithm_Crc32c,
+		Algorithm_Sha256,
+	};
+
+	struct Result
+	{
+		int _error = 0;			// errno, the checksum is valid when it's 0
+		std::string _checksum;	// lowercase hex
+		std::uint64_t _first = 0;
+		std::uint64_t _length = 0;
+		bool _cached = false;
+	};
+
+	using Handler = std::function<void(const Result&)>;
+
+public:
+	explicit FileChecksums(std::size_t threadsCount = std::thread::hardware_concurrency(), std::size_t capacity = 65536);
+	~FileChecksums();
+
+	FileChecksums(const FileChecksums&) = delete;
+	FileChecksums& operator=(const FileChecksums&) = delete;
+
+	// loads the cache from the file and keeps it there, empty path - in memory only
+	void start(const std::string& path);
+	void stop();
+
+	static const char* algorithmName(Algorithm algorithm);
+	static bool parseAlgorithm(const std::string& name, Algorithm& algorithm);
+
+	// The end of the range is inclusive, -1 - the end of the file.
+	// The handler is called by a thread of the pool.
+	void compute(const std::string& path, Algorithm algorithm, std::uint64_t first, std::int64_t last, Handler handler);
+
+	std::uint64_t hits() const { return _hits; }
+	std::uint64_t misses() const { return _misses; }
+
+private:
+	struct Job;
+
+	void post(std::function<void()> task);
+	void worker();
+
+	void run(const std::string& path, Algorithm algorithm, std::uint64_t first, std::int64_t last, Handler handler);
+	void computeChunk(const std::shared_ptr<Job>& job, std::size_t index);
+	void finish(Job& job);
+
+	static std::string makeKey(const struct stat& st, Algorithm algorithm, std::uint64_t first, std::uint64_t length);
+	bool lookup(const std::string& key, std::string& checksum);
+	void storeUnchanged(const Job& job, const std::string& checksum);
+	void store(const std::string& key, const std::string& checksum);
+	void insert(const std::string& key, const std::string& checksum);
+	void load();
+	void rewrite();
+
+private:
+	static const std::size_t READ_SIZE = 1024 * 1024;
+	static const std::uint64_t MIN_CHUNK_SIZE = 16 * 1024 * 1024;
+
+	const std::size_t _threadsCount;
+	const std::size_t _capacity;
+
+	std::mutex _tasksMutex;
+	std::condition_variable _wakeup;
+	std::deque<std::function<void()>> _tasks;
+	std::vector<std::thread> _workers;
+	bool _stopping = false;
+
+	std::mutex _mutex;
+	std::unordered_map<std::string, std::string> _entries;
+	std::deque<std::string> _order;
+	std::string _path;
+	int _fd = -1;
+	std::size_t _appended = 0;
+
+	std::atomic<std::uint64_t> _hits{0};
+	std::atomic<std::uint64_t> _misses{0};
+};
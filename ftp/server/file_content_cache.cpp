@@ -0,0 +1,216 @@
+#include "file_content_cache.h"
+#include "log.h"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+
+
+namespace
+{
+
+const std::uint32_t WATCH_MASK = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+
+}
+
+
+FileContentCache::FileContentCache(asio::io_context& ioContext, std::uint64_t capacity, std::uint64_t maxFileSize)
+	: _capacity(capacity)
+	, _maxFileSize(maxFileSize)
+	, _inotify(ioContext)
+{
+
+}
+
+FileContentCache::~FileContentCache()
+{
+	stop();
+}
+
+void FileContentCache::start()
+{
+	_inotifyFd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotifyFd == -1)
+	{
+		// nothing is cached without notifications
+		LOG_ERROR() << " - Error 'inotify_init1() failed: " << std::strerror(errno) << "'\n";
+		return;
+	}
+
+	_inotify.assign(_inotifyFd);
+	readEvents();
+}
+
+void FileContentCache::stop()
+{
+	std::error_code ec;
+	_inotify.close(ec);
+	_inotifyFd = -1;
+
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	_entries.clear();
+	_watches.clear();
+	_clock.clear();
+	_size = 0;
+}
+
+bool FileContentCache::cacheable(const struct stat& st) const
+{
+	return _inotifyFd != -1 && S_ISREG(st.st_mode) && static_cast<std::uint64_t>(st.st_size) <= _maxFileSize;
+}
+
+FileContentCache::Content FileContentCache::find(const struct stat& st) const
+{
+	std::shared_lock<std::shared_mutex> lock(_mutex);
+	const auto it = _entries.find(Key{ st.st_dev, st.st_ino });
+	if (it == _entries.cend() || it->second._size != st.st_size
+		|| it->second._mtime.tv_sec != st.st_mtim.tv_sec || it->second._mtime.tv_nsec != st.st_mtim.tv_nsec)
+	{
+		_misses++;
+		return Content();
+	}
+
+	_hits++;
+	it->second._referenced.store(true, std::memory_order_relaxed);
+	return it->second._content;
+}
+
+void FileContentCache::insert(const std::string& path, const struct stat& st, const Content& content)
+{
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+	if (_inotifyFd == -1 || content->size() > _capacity)
+	{
+		return;
+	}
+
+	const Key key{ st.st_dev, st.st_ino };
+	auto it = _entries.find(key);
+	if (it != _entries.end())
+	{
+		// the previous content of the file, the event hasn't come yet
+		erase(it);
+	}
+
+	evict(content->size());
+
+	const int wd = ::inotify_add_watch(_inotifyFd, path.c_str(), WATCH_MASK);
+	if (wd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not watch file '" << path << "': " << std::strerror(errno) << "'\n";
+		return;
+	}
+
+	Entry& entry = _entries[key];
+	entry._wd = wd;
+	entry._size = st.st_size;
+	entry._mtime = st.st_mtim;
+	entry._content = content;
+	_watches[wd] = key;
+	_clock.push_back(key);
+	_size += content->size();
+}
+
+std::size_t FileContentCache::entriesCount() const
+{
+	std::shared_lock<std::shared_mutex> lock(_mutex);
+	return _entries.size();
+}
+
+void FileContentCache::readEvents()
+{
+	_inotify.async_read_some(asio::buffer(_events),
+		[this](std::error_code ec, std::size_t length)
+		{
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				}
+				return;
+			}
+
+			handleEvents(length);
+			readEvents();
+		});
+}
+
+void FileContentCache::handleEvents(std::size_t length)
+{
+	std::unique_lock<std::shared_mutex> lock(_mutex);
+
+	for (std::size_t offset = 0; offset + sizeof(inotify_event) <= length; )
+	{
+		const inotify_event* event = reinterpret_cast<const inotify_event*>(_events.data() + offset);
+		offset += sizeof(inotify_event) + event->len;
+
+		if (event->mask & IN_Q_OVERFLOW)
+		{
+			// some events are lost, the lookups still check size and mtime
+			continue;
+		}
+
+		const auto watchIt = _watches.find(event->wd);
+		if (watchIt == _watches.end())
+		{
+			continue;
+		}
+
+		const auto it = _entries.find(watchIt->second);
+		if (it != _entries.end() && it->second._wd == event->wd)
+		{
+			erase(it);
+		}
+		else if (event->mask & IN_IGNORED)
+		{
+			_watches.erase(watchIt);
+		}
+	}
+}
+
+void FileContentCache::erase(std::unordered_map<Key, Entry, KeyHash>::iterator it)
+{
+	// the key stays in the clock until the hand comes to it
+	::inotify_rm_watch(_inotifyFd, it->second._wd);
+	_watches.erase(it->second._wd);
+	_size -= it->second._content->size();
+	_entries.erase(it);
+}
+
+// Makes room for 'needed' bytes: the hand skips the entries hit since it has
+// passed them last time and evicts the first one which hasn't been.
+void FileContentCache::evict(std::uint64_t needed)
+{
+	if (_clock.size() > 2 * _entries.size() + 16)
+	{
+		// too many keys of the dropped entries
+		_clock.clear();
+		for (const auto& entry : _entries)
+		{
+			_clock.push_back(entry.first);
+		}
+	}
+
+	while (!_clock.empty() && _size + needed > _capacity)
+	{
+		const Key key(_clock.front());
+		_clock.pop_front();
+
+		const auto it = _entries.find(key);
+		if (it == _entries.end())
+		{
+			continue;
+		}
+
+		if (it->second._referenced.exchange(false, std::memory_order_relaxed))
+		{
+			_clock.push_back(key);
+			continue;
+		}
+		erase(it);
+	}
+}
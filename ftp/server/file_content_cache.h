@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/stat.h>
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+
+#include <asio.hpp>
+
+
+/*
+ Contents of small files shared by all sessions, so RETR of a hot file
+ is a single write from memory. Entries are keyed by device and inode and
+ a lookup matches the size and mtime of the file too, so a modified file
+ never gets its old content. Besides, every cached file is watched with
+ inotify and a change drops its entry at once.
+ The content is immutable, a session keeps it alive by shared_ptr while
+ it's being sent. Total size of the contents is limited, the entries are
+ evicted by the clock algorithm: a hit only marks the entry, so lookups
+ share the lock.
+ */
+class FileContentCache final
+{
+public:
+	using Content = std::shared_ptr<const std::string>;
+
+public:
+	explicit FileContentCache(asio::io_context& ioContext, std::uint64_t capacity = 64 * 1024 * 1024,
+		std::uint64_t maxFileSize = 256 * 1024);
+	~FileContentCache();
+
+	FileContentCache(const FileContentCache&) = delete;
+	FileContentCache& operator=(const FileContentCache&) = delete;
+
+	void start();
+	void stop();
+
+	bool cacheable(const struct stat& st) const;
+
+	Content find(const struct stat& st) const;
+	// 'st' is of the file before it was read, the path is watched
+	void insert(const std::string& path, const struct stat& st, const Content& content);
+
+	std::uint64_t hits() const { return _hits; }
+	std::uint64_t misses() const { return _misses; }
+	std::uint64_t size() const { return _size; }
+	std::size_t entriesCount() const;
+
+private:
+	struct Key
+	{
+		dev_t _dev = 0;
+		ino_t _ino = 0;
+
+		bool operator==(const Key& other) const { return _dev == other._dev && _ino == other._ino; }
+	};
+
+	struct KeyHash
+	{
+		std::size_t operator()(const Key& key) const { return std::hash<ino_t>()(key._ino) ^ (key._dev << 1); }
+	};
+
+	struct Entry
+	{
+		int _wd = -1;
+		off_t _size = 0;
+		struct timespec _mtime = {};
+		Content _content;
+		mutable std::atomic<bool> _referenced{false};
+	};
+
+	void readEvents();
+	void handleEvents(std::size_t length);
+	void erase(std::unordered_map<Key, Entry, KeyHash>::iterator it);
+	void evict(std::uint64_t needed);
+
+private:
+	static const std::size_t EVENTS_BUFFER_SIZE = 16 * 1024;
+
+	const std::uint64_t _capacity;
+	const std::uint64_t _maxFileSize;
+	int _inotifyFd = -1;
+	asio::posix::stream_descriptor _inotify;
+	std::array<char, EVENTS_BUFFER_SIZE> _events;
+
+	mutable std::shared_mutex _mutex;
+	std::unordered_map<Key, Entry, KeyHash> _entries;
+	std::unordered_map<int, Key> _watches;
+	std::deque<Key> _clock;
+	std::atomic<std::uint64_t> _size{0};
+
+	mutable std::atomic<std::uint64_t> _hits{0};
+	mutable std::atomic<std::uint64_t> _misses{0};
+};
@@ -0,0 +1,150 @@
+#include "file_read_ahead.h"
+
+#include <algorithm>
+
+
+FileReadAhead::FileReadAhead(AsyncFileIO& fileIO, const Strand& strand, std::size_t depth)
+	: _fileIO(fileIO)
+	, _strand(strand)
+	, _depth(depth)
+{
+
+}
+
+FileReadAhead::~FileReadAhead()
+{
+	stop();
+}
+
+void FileReadAhead::start(int fd, off_t offset, off_t end)
+{
+	stop();
+	_fd = fd;
+	_offset = offset;
+	_end = end;
+	_exhausted = false;
+	readAhead();
+}
+
+void FileReadAhead::stop()
+{
+	for (const std::shared_ptr<Chunk>& chunk : _chunks)
+	{
+		if (chunk->_completed)
+		{
+			_fileIO.releaseBuffer(chunk->_data);
+		}
+		else
+		{
+			// the buffer is released when the read is completed
+			chunk->_abandoned = true;
+		}
+	}
+	_chunks.clear();
+	_handler = nullptr;
+	_delivered = false;
+	_exhausted = true;
+	_fd = -1;
+}
+
+void FileReadAhead::next(Handler handler)
+{
+	if (_delivered)
+	{
+		_fileIO.releaseBuffer(_chunks.front()->_data);
+		_chunks.pop_front();
+		_delivered = false;
+	}
+
+	_handler = std::move(handler);
+	readAhead();
+	deliver();
+}
+
+void FileReadAhead::readAhead()
+{
+	while (!_exhausted && _chunks.size() < _depth)
+	{
+		std::size_t length = _fileIO.bufferSize();
+		if (_end >= 0)
+		{
+			length = std::min<off_t>(length, _end - _offset);
+			if (length == 0)
+			{
+				_exhausted = true;
+				break;
+			}
+		}
+
+		std::shared_ptr<Chunk> chunk(std::make_shared<Chunk>());
+		chunk->_data = _fileIO.allocateBuffer();
+		chunk->_length = length;
+		_chunks.push_back(chunk);
+
+		auto self(shared_from_this());
+		_fileIO.read(_fd, chunk->_data, length, _offset, [this, self, chunk](ssize_t result)
+			{
+				asio::post(_strand, [this, self, chunk, result]()
+					{
+						chunk->_completed = true;
+						chunk->_result = result;
+						if (chunk->_abandoned)
+						{
+							_fileIO.releaseBuffer(chunk->_data);
+							return;
+						}
+						deliver();
+					});
+			});
+		_offset += length;
+	}
+}
+
+void FileReadAhead::deliver()
+{
+	if (!_handler || _delivered)
+	{
+		return;
+	}
+
+	Handler handler;
+	if (_chunks.empty())
+	{
+		if (!_exhausted)
+		{
+			return;
+		}
+		handler.swap(_handler);
+		handler(nullptr, 0);
+		return;
+	}
+
+	const std::shared_ptr<Chunk> chunk(_chunks.front());
+	if (!chunk->_completed)
+	{
+		return;
+	}
+
+	// a short read is the end of the file, the chunks after it don't count
+	if (chunk->_result >= 0 && static_cast<std::size_t>(chunk->_result) < chunk->_length)
+	{
+		_exhausted = true;
+		while (_chunks.size() > 1)
+		{
+			std::shared_ptr<Chunk>& last = _chunks.back();
+			if (last->_completed)
+			{
+				_fileIO.releaseBuffer(last->_data);
+			}
+			else
+			{
+				last->_abandoned = true;
+			}
+			_chunks.pop_back();
+		}
+	}
+
+	_delivered = true;
+	handler.swap(_handler);
+	handler(chunk->_data, chunk->_result);
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <sys/types.h>
+
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include <asio.hpp>
+
+#include "async_file_io.h"
+
+
+/*
+ Sequential reader of a file range, which keeps several reads in flight
+ ahead of the consumer, so the disk works while the previous chunks are
+ sent. The reads may complete in any order, chunks are handed out in the
+ order of the file. All of it runs on the session's strand.
+ */
+class FileReadAhead final : public std::enable_shared_from_this<FileReadAhead>
+{
+public:
+	using Strand = asio::strand<asio::io_context::executor_type>;
+
+	// 'length' is 0 at the end of the range and -errno if the read failed,
+	// 'data' stays valid until the next chunk is requested or the reader is stopped
+	using Handler = std::function<void(const char* data, ssize_t length)>;
+
+public:
+	FileReadAhead(AsyncFileIO& fileIO, const Strand& strand, std::size_t depth = 4);
+	~FileReadAhead();
+
+	FileReadAhead(const FileReadAhead&) = delete;
+	FileReadAhead& operator=(const FileReadAhead&) = delete;
+
+	// 'end' is the end of the range (exclusive), -1 to read up to the end of the file
+	void start(int fd, off_t offset, off_t end);
+	void stop();
+
+	void next(Handler handler);
+
+private:
+	struct Chunk
+	{
+		char* _data = nullptr;
+		std::size_t _length = 0;
+		ssize_t _result = 0;
+		bool _completed = false;
+		bool _abandoned = false;
+	};
+
+	void readAhead();
+	void deliver();
+
+private:
+	AsyncFileIO& _fileIO;
+	Strand _strand;
+	const std::size_t _depth;
+
+	int _fd = -1;
+	off_t _offset = 0;
+	off_t _end = -1;
+	bool _exhausted = true;
+	bool _delivered = false;
+	std::deque<std::shared_ptr<Chunk>> _chunks;
+	Handler _handler;
+};
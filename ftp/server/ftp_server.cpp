@@ -1,5 +1,8 @@
+#include <unistd.h>
+
 #include <iostream>
 #include <exception>
+#include <experimental/filesystem>
 #include <memory>
 
 #include "log.h"
@@ -8,10 +11,34 @@
 #include "users_db.h"
 
 
-FTPServer::FTPServer()
-	: _ioContext(1)
+static const std::uint16_t FTP_PASSIVE_PORT_FIRST = 10020;
+static const std::uint16_t FTP_PASSIVE_PORT_LAST = 10519;
+static const int FTP_COMPRESSION_LEVEL = 6;
+static const std::uint64_t FTP_DROP_BEHIND_SIZE = 0;
+static const char* const FTP_CHECKSUMS_FILE = "checksums-db.txt";
+static const std::chrono::seconds FTP_CONTROL_IDLE_TIMEOUT(300);
+static const std::chrono::seconds FTP_DATA_IDLE_TIMEOUT(60);
+static const std::chrono::seconds SESSION_STATS_PERIOD(60);
+static const std::chrono::seconds USERS_RELOAD_PERIOD(10);
+
+// one second ticks, a turn of the wheel covers the default control timeout
+static const std::chrono::milliseconds TIMING_WHEEL_TICK(1000);
+static const std::size_t TIMING_WHEEL_SLOTS = 512;
+
+FTPServer::FTPServer(std::size_t threadsCount)
+	: _threadsCount(threadsCount != 0 ? threadsCount : 1)
+	, _ioContext(static_cast<int>(_threadsCount))
 	, _acceptor(_ioContext)
-	, _worker()
+	, _passivePorts(std::make_unique<PassivePortPool>(FTP_PASSIVE_PORT_FIRST, FTP_PASSIVE_PORT_LAST))
+	, _listingCache(_ioContext)
+	, _contentCache(_ioContext)
+	, _compressionLevel(FTP_COMPRESSION_LEVEL)
+	, _dropBehindSize(FTP_DROP_BEHIND_SIZE)
+	, _bandwidthShaper(_ioContext)
+	, _fileIO(_ioContext)
+	, _timingWheel(_ioContext, TIMING_WHEEL_TICK, TIMING_WHEEL_SLOTS)
+	, _controlIdleTimeout(FTP_CONTROL_IDLE_TIMEOUT)
+	, _dataIdleTimeout(FTP_DATA_IDLE_TIMEOUT)
 {
 	UsersDB::getInstance().loadFromFile("users-db.txt");
 }
@@ -21,6 +48,17 @@ FTPServer::~FTPServer()
 
 }
 
+void FTPServer::setPassivePorts(std::uint16_t first, std::uint16_t last)
+{
+	_passivePorts = std::make_unique<PassivePortPool>(first, last);
+}
+
+void FTPServer::setIdleTimeouts(std::chrono::seconds control, std::chrono::seconds data)
+{
+	_controlIdleTimeout = control;
+	_dataIdleTimeout = data;
+}
+
 void FTPServer::start(const std::string& address, std::uint16_t port)
 {
 	tcp::endpoint ep(asio::ip::make_address(address), port);
@@ -30,7 +68,25 @@ void FTPServer::start(const std::string& address, std::uint16_t port)
 	_acceptor.listen();
 
 	acceptConnections();
-	_worker = std::thread(&FTPServer::worker, this);
+	_listingCache.start();
+	_contentCache.start();
+	_fileIO.start();
+	_checksums.start(FTP_CHECKSUMS_FILE);
+	_timingWheel.start();
+	_timingWheel.schedule(SESSION_STATS_PERIOD, [this]() { reportSessionStats(); });
+	_timingWheel.schedule(USERS_RELOAD_PERIOD, [this]() { reloadUsers(); });
+	UsersDB::getInstance().start();
+
+	namespace fs = std::experimental::filesystem;
+	std::error_code ec;
+	const fs::path tempDir(fs::temp_directory_path(ec));
+	_compressedFiles.open((tempDir / ("ftp-server-zcache-" + std::to_string(::getpid()))).string());
+
+	_ioContext.restart();
+	for (std::size_t i = 0; i < _threadsCount; i++)
+	{
+		_workers.emplace_back(&FTPServer::worker, this);
+	}
 }
 
 void FTPServer::stop()
@@ -48,10 +104,31 @@ void FTPServer::stop()
 		LOG_ERROR() << " - Error " << ec.message() << '(' << ec.value() << ')' << "'\n";
 	}
 
+	{
+		std::lock_guard<std::mutex> lock(_sessionsMutex);
+		for (const std::shared_ptr<FTPSession>& session : _sessions)
+		{
+			session->stop();
+		}
+		_sessions.clear();
+	}
+	_timingWheel.stop();
+	UsersDB::getInstance().stop();
+	_bandwidthShaper.stop();
+	_fileIO.stop();
+	_checksums.stop();
+	_listingCache.stop();
+	_contentCache.stop();
+	_compressedFiles.close();
+
 	try 
 	{
 		_ioContext.stop();
-		_worker.join();		
+		for (std::thread& worker : _workers)
+		{
+			worker.join();
+		}
+		_workers.clear();
 	}
 	catch (const std::exception& ex)
 	{
@@ -59,8 +136,6 @@ void FTPServer::stop()
 	}
 }
 
-static const std::uint16_t FTP_DATA_CONNECTION_PORT = 10020;
-
 void FTPServer::acceptConnections()
 {
 	_acceptor.async_accept(
@@ -79,10 +154,12 @@ void FTPServer::acceptConnections()
 				{
 					try 
 					{
-						// std::make_shared<FTPSession>(std::move(socket), FTP_DATA_CONNECTION_PORT, homeDir)->start();
-						std::unique_ptr<FTPSession> session = std::make_unique<FTPSession>(std::move(socket), FTP_DATA_CONNECTION_PORT, homeDir);
-						_sessions.push_back(std::move(session));
-						_sessions.back()->start();
+						std::shared_ptr<FTPSession> session = std::make_shared<FTPSession>(*this, std::move(socket), homeDir);
+						{
+							std::lock_guard<std::mutex> lock(_sessionsMutex);
+							_sessions.insert(session);
+						}
+						session->start();
 					}
 					catch (const std::exception& ex)
 					{
@@ -99,11 +176,70 @@ void FTPServer::acceptConnections()
 		});
 }
 
+void FTPServer::sessionFinished(const std::shared_ptr<FTPSession>& session, std::size_t memoryUsage)
+{
+	std::lock_guard<std::mutex> lock(_sessionsMutex);
+	if (_sessions.erase(session) != 0)
+	{
+		_reapedSessions++;
+		_reapedBytes += memoryUsage;
+	}
+}
+
+FTPServer::SessionStats FTPServer::getSessionStats()
+{
+	std::lock_guard<std::mutex> lock(_sessionsMutex);
+	SessionStats stats;
+	stats._live = _sessions.size();
+	stats._reaped = _reapedSessions;
+	stats._reapedBytes = _reapedBytes;
+	return stats;
+}
+
+void FTPServer::reportSessionStats()
+{
+	const SessionStats stats(getSessionStats());
+	if (stats._live != _reportedStats._live || stats._reaped != _reportedStats._reaped)
+	{
+		LOG_INFO() << " - Sessions: " << stats._live << " live, " << stats._reaped << " reaped ("
+			<< stats._reapedBytes / 1024 << " KB released)\n";
+		_reportedStats = stats;
+	}
+
+	// logins verified during the period
+	const UsersDB::Stats auth(UsersDB::getInstance().getStats());
+	const std::uint64_t verified = auth._verified - _reportedAuth._verified;
+	if (verified != 0)
+	{
+		LOG_INFO() << " - Logins: " << verified << " verified (" << auth._rejected - _reportedAuth._rejected << " rejected), "
+			<< static_cast<double>(verified) / SESSION_STATS_PERIOD.count() << "/s, average "
+			<< (auth._totalMicros - _reportedAuth._totalMicros) / verified / 1000 << " ms, max since start "
+			<< auth._maxMicros / 1000 << " ms\n";
+		_reportedAuth = auth;
+	}
+
+	const std::uint64_t hits = _contentCache.hits();
+	const std::uint64_t lookups = hits + _contentCache.misses();
+	if (lookups != _reportedContentLookups)
+	{
+		LOG_INFO() << " - File cache: " << _contentCache.entriesCount() << " files, " << _contentCache.size() / 1024
+			<< " KB, " << hits << " hits of " << lookups << " lookups (" << hits * 100 / lookups << "%)\n";
+		_reportedContentLookups = lookups;
+	}
+	_timingWheel.schedule(SESSION_STATS_PERIOD, [this]() { reportSessionStats(); });
+}
+
+// the users file may be edited while the server runs
+void FTPServer::reloadUsers()
+{
+	UsersDB::getInstance().reloadIfModified();
+	_timingWheel.schedule(USERS_RELOAD_PERIOD, [this]() { reloadUsers(); });
+}
+
 void FTPServer::worker()
 {
 	try
 	{
-		_ioContext.restart();
 		_ioContext.run();
 	}
 	catch (const std::exception& ex)
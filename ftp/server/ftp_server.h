@@ -1,38 +1,118 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <cstdint>
-#include <list>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <asio.hpp>
 
+#include "async_file_io.h"
+#include "bandwidth_shaper.h"
+#include "compressed_file_cache.h"
+#include "directory_listing_cache.h"
+#include "file_checksums.h"
+#include "file_content_cache.h"
+#include "passive_port_pool.h"
+#include "timing_wheel.h"
+#include "users_db.h"
+
 using asio::ip::tcp;
 
 class FTPSession;
 
 class FTPServer final
 {
+public:
+	struct SessionStats
+	{
+		std::size_t _live = 0;
+		std::uint64_t _reaped = 0;
+		std::uint64_t _reapedBytes = 0;	// memory the reaped sessions held when they finished
+	};
+
 public:
 	FTPServer(const FTPServer&) = delete;
 	const FTPServer& operator=(const FTPServer&) = delete;
 
-	FTPServer();
+	explicit FTPServer(std::size_t threadsCount = std::thread::hardware_concurrency());
 	~FTPServer();
 
+	// has to be called before start()
+	void setPassivePorts(std::uint16_t first, std::uint16_t last);
+
+	// default level of MODE Z, sessions may change it by OPTS MODE Z LEVEL
+	void setCompressionLevel(int level) { _compressionLevel = level; }
+	int getCompressionLevel() const { return _compressionLevel; }
+
+	// RETR of a file of at least this size drops the pages already sent from the
+	// page cache, so a huge download doesn't evict the hot files; 0 - never
+	void setDropBehindSize(std::uint64_t size) { _dropBehindSize = size; }
+	std::uint64_t getDropBehindSize() const { return _dropBehindSize; }
+
+	// has to be called before start()
+	void setIdleTimeouts(std::chrono::seconds control, std::chrono::seconds data);
+	std::chrono::seconds getControlIdleTimeout() const { return _controlIdleTimeout; }
+	std::chrono::seconds getDataIdleTimeout() const { return _dataIdleTimeout; }
+
+	// bytes per second, 0 - unlimited, may be changed while the server runs
+	void setGlobalRate(std::uint64_t rate) { _bandwidthShaper.setGlobalRate(rate); }
+	void setUserRate(const std::string& username, std::uint64_t rate) { _bandwidthShaper.setUserRate(username, rate); }
+	void setSessionRate(std::uint64_t rate) { _bandwidthShaper.setDefaultSessionRate(rate); }
+
 	void start(const std::string& address, std::uint16_t port);
 	void stop();
 
+	PassivePortPool& getPassivePorts() { return *_passivePorts; }
+	DirectoryListingCache& getListingCache() { return _listingCache; }
+	FileContentCache& getContentCache() { return _contentCache; }
+	CompressedFileCache& getCompressedFiles() { return _compressedFiles; }
+	TimingWheel& getTimingWheel() { return _timingWheel; }
+	BandwidthShaper& getBandwidthShaper() { return _bandwidthShaper; }
+	AsyncFileIO& getFileIO() { return _fileIO; }
+	FileChecksums& getChecksums() { return _checksums; }
+
+	// called by the session when it's closed, the server drops its reference then
+	void sessionFinished(const std::shared_ptr<FTPSession>& session, std::size_t memoryUsage);
+	SessionStats getSessionStats();
+
 private:
 	void acceptConnections();
+	void reportSessionStats();
+	void reloadUsers();
 
 	void worker();
 
 private:
+	// all sessions are served by the fixed pool of threads running the same io_context
+	std::size_t _threadsCount;
 	asio::io_context _ioContext;
 	asio::ip::tcp::acceptor _acceptor;
-	std::thread _worker;
+	std::vector<std::thread> _workers;
+
+	std::unique_ptr<PassivePortPool> _passivePorts;
+	DirectoryListingCache _listingCache;
+	FileContentCache _contentCache;
+	CompressedFileCache _compressedFiles;
+	int _compressionLevel;
+	std::uint64_t _dropBehindSize;
+	BandwidthShaper _bandwidthShaper;
+	AsyncFileIO _fileIO;
+	FileChecksums _checksums;
 
-	std::list<std::unique_ptr<FTPSession>> _sessions;
+	TimingWheel _timingWheel;
+	std::chrono::seconds _controlIdleTimeout;
+	std::chrono::seconds _dataIdleTimeout;
+	std::mutex _sessionsMutex;
+	std::unordered_set<std::shared_ptr<FTPSession>> _sessions;
+	std::uint64_t _reapedSessions = 0;
+	std::uint64_t _reapedBytes = 0;
+	SessionStats _reportedStats;
+	UsersDB::Stats _reportedAuth;
+	std::uint64_t _reportedContentLookups = 0;
 };
@@ -1,96 +1,242 @@
 #include "ftp_session.h"
+#include "ftp_server.h"
+#include "line_endings.h"
 #include "log.h"
 #include "string_utils.h"
 #include "users_db.h"
 
 
 #include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
 #include <ctime>
 
+#include <fcntl.h>
 #include <stdlib.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <regex>
 
 
-FTPSession::FTPSession(tcp::socket ctrlSocket, std::uint16_t dataPort, const std::string& rootDir)
-	: _ctrlSocket(std::move(ctrlSocket))
-	, _dataPort(dataPort)
-	, _ioContext(1)
-	, _dataSocket(_ioContext)
-	, _acceptor(_ioContext)
+constexpr std::chrono::seconds FTPSession::PASSIVE_ACCEPT_TIMEOUT;
+
+FTPSession::FTPSession(FTPServer& server, tcp::socket ctrlSocket, const std::string& rootDir)
+	: _server(server)
+	, _ctrlSocket(std::move(ctrlSocket))
+	, _strand(_ctrlSocket.get_executor())
+	, _dataSocket(_ctrlSocket.get_executor().context())
+	, _acceptor(_ctrlSocket.get_executor().context())
+	, _acceptTimer(_ctrlSocket.get_executor().context())
 	, _rootDir(rootDir)
 	, _currDir(rootDir)
-	, _worker()
+	, _ctrlFramer(CTRL_BUFFER_SIZE)
+	, _compressionLevel(server.getCompressionLevel())
 {
 
 }
 
 FTPSession::~FTPSession()
 {
-	try
+	if (_fileFd != -1)
+	{
+		::close(_fileFd);
+	}
+
+	if (_pipe[0] != -1)
 	{
-		_quitCmdLoop = true;
-		_worker.join();
+		::close(_pipe[0]);
+		::close(_pipe[1]);
 	}
-	catch (const std::exception& ex)
+
+	if (_zcopyFd != -1)
 	{
-		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+		::close(_zcopyFd);
+		::unlink(_zcopyPath.c_str());
 	}
+	std::cout << "session finished.\n";
 }
 
 void FTPSession::start()
 {
-	_worker = std::thread(&FTPSession::worker, this);
+	std::cout << "session started.\n";
+
+	// replies are small and often follow each other (125 then 226),
+	// Nagle would hold the second one until the delayed ACK of the first
+	std::error_code ec;
+	_ctrlSocket.set_option(tcp::no_delay(true), ec);
+
+	auto self(shared_from_this());
+	asio::post(_strand, [this, self]()
+		{
+			touch();
+			scheduleIdleCheck(_server.getControlIdleTimeout());
+			sendMessageToClient("220 myhost.mydomain FTP-server (version 1.0) ready");
+			readCommand();
+		});
+}
+
+void FTPSession::stop()
+{
+	auto self(shared_from_this());
+	asio::post(_strand, [this, self]()
+		{
+			close();
+		});
 }
 
-void FTPSession::worker()
+void FTPSession::readCommand()
 {
-	std::cout << "session worker started.\n";
-	try
+	// while the read is outstanding the buffer has no complete command and
+	// belongs to the read, the loop is continued by its handler
+	if (_quitCmdLoop || _closed || _reading)
+	{
+		return;
+	}
+
+	// the commands pipelined by the client are already in the buffer
+	std::string_view cmd;
+	LineFramer::Status status;
+	while ((status = _ctrlFramer.next(cmd)) != LineFramer::Status_NeedMore)
 	{
-		sendMessageToClient("220 myhost.mydomain FTP-server (version 1.0) ready");
-		asio::streambuf sb;
-		while (!_quitCmdLoop)
+		if (status == LineFramer::Status_Oversize)
 		{
-			asio::streambuf sb;
-			std::error_code ec;
-			asio::read_until(_ctrlSocket, sb, "\r\n", ec);
+			sendMessageToClient("500 Command line too long");
+			continue;
+		}
+
+		_commandPending = false;
+		try
+		{
+			executeCommand(cmd);
+		}
+		catch (const std::exception& ex)
+		{
+			LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+			close();
+			return;
+		}
+
+		// the command may have been completed at once and have read on by itself
+		if (_commandPending || _quitCmdLoop || _closed || _reading)
+		{
+			return;
+		}
+	}
+
+	_reading = true;
+	auto self(shared_from_this());
+	_ctrlSocket.async_read_some(_ctrlFramer.prepare(),
+		asio::bind_executor(_strand, [this, self](std::error_code ec, std::size_t sz)
+		{
+			_reading = false;
 			if (ec)
 			{
-				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				if (ec != asio::error::eof && ec != asio::error::operation_aborted)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				}
+				close();
+				return;
 			}
-			else
-			{			
-				std::ostringstream oss;
-				oss << &sb;
-				std::string cmd(oss.str());
-				std::size_t pos = cmd.find("\r\n");
-				if (pos != std::string::npos)
+
+			_ctrlFramer.commit(sz);
+			touch();
+			readCommand();
+		}));
+}
+
+// A handler which completes the command asynchronously suspends
+// reading of the next command and resumes it when it's done.
+void FTPSession::suspendCommands()
+{
+	_commandPending = true;
+	scheduleIdleCheck(_server.getDataIdleTimeout());
+}
+
+// The command may be completed before its handler returns (a transfer of
+// an empty file, a failed start), so the command loop is never entered
+// from here. It's resumed by a handler of its own and the command stays
+// pending until then, which stops the loop that has executed it.
+void FTPSession::resumeCommands()
+{
+	auto self(shared_from_this());
+	asio::post(_strand, [this, self]()
+		{
+			_commandPending = false;
+			readCommand();
+		});
+}
+
+void FTPSession::sendMessageToClient(const std::string& msg)
+{
+	if (_closed)
+	{
+		return;
+	}
+
+	_messages.push_back(msg);
+	_messages.back().append("\r\n");
+	if (_messages.size() == 1)
+	{
+		writeMessages();
+	}
+}
+
+void FTPSession::writeMessages()
+{
+	auto self(shared_from_this());
+	asio::async_write(_ctrlSocket, asio::buffer(_messages.front()),
+		asio::bind_executor(_strand, [this, self](std::error_code ec, std::size_t sz)
+		{
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
 				{
-					cmd = cmd.substr(0, pos);
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
 				}
-				executeCommand(cmd);
+				close();
+				return;
 			}
 
-			if (ec.value() == 2)	// end of file, opposite side closed connection
+			_messages.pop_front();
+			if (!_messages.empty())
 			{
-				break;
+				writeMessages();
 			}
-		}
+			else if (_quitCmdLoop)
+			{
+				close();
+			}
+		}));
+}
+
+void FTPSession::close()
+{
+	if (_closed)
+	{
+		return;
 	}
-	catch (const std::exception& ex)
+	_closed = true;
+
+	_messages.clear();
+	_deferredCommand = nullptr;
+	closeDataConnection();
+
+	if (_flow)
 	{
-		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
-	}	
+		_server.getBandwidthShaper().closeFlow(_flow);
+	}
 
 	std::error_code ec;
 
 	_ctrlSocket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
-	if (ec)
+	if (ec && ec != asio::error::not_connected)
 	{
 		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
 	}
@@ -99,162 +245,205 @@ void FTPSession::worker()
 	if (ec)
 	{
 		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-	}	
+	}
 
-	std::cout << "session worker finished.\n";
+	// the session is destroyed once the last pending handler is done with it
+	_server.sessionFinished(shared_from_this(), memoryUsage());
 }
 
-void FTPSession::sendMessageToClient(const std::string& msg)
+void FTPSession::touch()
 {
-	std::string message(msg);
-	message += "\r\n";
-
-	std::error_code ec;
-	asio::write(_ctrlSocket, asio::buffer(message.c_str(), message.length()), ec);
-	if (ec)
-	{
-		LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-	}
+	_lastActivity = _server.getTimingWheel().now();
 }
 
-void FTPSession::sendAsciiDataToClient(const std::string& data)
+// Only the latest scheduled check is effective, the earlier ones are ignored.
+void FTPSession::scheduleIdleCheck(std::chrono::milliseconds delay)
 {
-	std::string s(data);
-	s.append("\r\n");
-
-	std::error_code ec;
-	asio::write(_dataSocket, asio::buffer(s.c_str(), s.length()), ec);
-	if (ec)
-	{
-		LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-	}
+	std::weak_ptr<FTPSession> weak(shared_from_this());
+	const std::uint64_t generation = ++_idleCheckGeneration;
+	_server.getTimingWheel().schedule(delay, [weak, generation]()
+		{
+			std::shared_ptr<FTPSession> self(weak.lock());
+			if (self)
+			{
+				asio::post(self->_strand, [self, generation]()
+					{
+						if (generation == self->_idleCheckGeneration)
+						{
+							self->checkIdle();
+						}
+					});
+			}
+		});
 }
 
-bool FTPSession::sendDataToClient(const char* data, std::size_t amount)
+// The data idle timeout applies while a transfer is running, the control
+// idle timeout while the session waits for the next command. When the
+// session hasn't been idle long enough the check is just scheduled again.
+void FTPSession::checkIdle()
 {
-	std::error_code ec;
-	asio::write(_dataSocket, asio::buffer(data, amount), ec);
-	if (ec)
+	if (_closed || _quitCmdLoop)
 	{
-		LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
+		return;
 	}
-	return true;
-}
-
-void FTPSession::executeCommand(const std::string& cmd)
-{
-	std::size_t p = cmd.find_first_of(' ');
 
-	std::string command;
-	std::string args;
+	const TimingWheel& wheel = _server.getTimingWheel();
+	const std::chrono::milliseconds idle((wheel.now() - _lastActivity) * wheel.tick());
 
-	if (p != std::string::npos)
+	if (_commandPending && (!_dataSocket.is_open() || _waitingBandwidth))
 	{
-		command = cmd.substr(0, p);
-		args = cmd.substr(p + 1);
-	}
-	else
-	{
-		command = cmd;
+		// waiting for the passive data connection, which has its own timeout,
+		// or for the bandwidth shaper, which isn't the client's fault
+		scheduleIdleCheck(_server.getDataIdleTimeout());
+		return;
 	}
 
-	std::transform(command.begin(), command.end(), command.begin(),
-		[](char x){ return static_cast<char>(std::toupper(x)); });
-
-	if (command == "CWD")
-	{
-		handleCwd(args);
-	}
-	else if (command == "DELE")
-	{
-		handleDele(args);
-	}
-	else if (command == "EPRT")
-	{
-		const std::string extendedArgs(parseExtendedArguments(args));
-		handlePort(extendedArgs);
-	}
-	else if (command == "EPSV")
-	{
-		handleEpsv();
-	}
-	else if (command == "FEAT")
-	{
-		handleFeat();
-	}
-	else if (command == "LIST")
-	{
-		handleNlst(args);
-	}
-	else if (command == "NLST")
+	const std::chrono::milliseconds timeout(_commandPending ? _server.getDataIdleTimeout() : _server.getControlIdleTimeout());
+	if (idle < timeout)
 	{
-		handleNlst(args);
+		scheduleIdleCheck(timeout - idle);
+		return;
 	}
-	else if (command == "MKD")
+
+	if (_commandPending)
 	{
-		handleMkd(args);
+		// the pending operation fails and the transfer is finished with 426
+		LOG_INFO() << " - Data connection is idle for " << idle.count() / 1000 << " s, transfer aborted\n";
+		_dataTimedOut = true;
+		closeDataConnection();
+		touch();
+		scheduleIdleCheck(_server.getControlIdleTimeout());
+		return;
 	}
-	else if (command == "PASS")
+
+	LOG_INFO() << " - Control connection is idle for " << idle.count() / 1000 << " s, session closed\n";
+	sendMessageToClient("421 Idle timeout, closing control connection");
+	_quitCmdLoop = true;
+}
+
+std::size_t FTPSession::memoryUsage() const
+{
+	std::size_t size = sizeof(*this) + _ctrlFramer.capacity() + _args.capacity() + _recvBuffer.capacity() + _zbuffer.capacity()
+		+ _listingBuffer.capacity() + _textBuffer.capacity() + _rootDir.native().capacity() + _currDir.native().capacity();
+	for (const std::string& message : _messages)
 	{
-		handlePass(args);
+		size += message.capacity();
 	}
-	else if (command == "PASV")
+	return size;
+}
+
+// Packs the command word (up to 8 characters) into an integer, case insensitive.
+constexpr std::uint64_t FTPSession::commandCode(const char* name, std::size_t length)
+{
+	if (length == 0 || length > 8)
 	{
-		handlePasv(args);
+		return 0;
 	}
-	else if (command == "PORT")
+
+	std::uint64_t code = 0;
+	for (std::size_t i = 0; i < length; i++)
 	{
-		std::size_t pos = args.find_first_of('(');
-		if (pos != std::string::npos)
+		char c = name[i];
+		if (c >= 'a' && c <= 'z')
 		{
-			args = args.substr(pos + 1);
+			c = static_cast<char>(c - 'a' + 'A');
 		}
+		code = (code << 8) | static_cast<unsigned char>(c);
+	}
+	return code;
+}
+
+constexpr std::size_t FTPSession::commandSlot(std::uint64_t code)
+{
+	return static_cast<std::size_t>((code * 0x9e3779b97f4a7c15ull) >> (64 - COMMAND_TABLE_BITS));
+}
 
-		pos = args.find_first_of(')');
-		if (pos != std::string::npos)
+// Open addressing hash table of the commands, built by the compiler.
+constexpr FTPSession::CommandTable FTPSession::makeCommandTable()
+{
+	struct
+	{
+		const char* _name;
+		CommandHandler _handler;
+		bool _beforeLogin = false;
+	} const commands[] =
+	{
+		{ "CWD", &FTPSession::handleCwd },
+		{ "DELE", &FTPSession::handleDele },
+		{ "EPRT", &FTPSession::handleEprt },
+		{ "EPSV", &FTPSession::handleEpsv },
+		{ "FEAT", &FTPSession::handleFeat, true },
+		{ "HASH", &FTPSession::handleHash },
+		{ "LIST", &FTPSession::handleNlst },
+		{ "MDTM", &FTPSession::handleMdtm },
+		{ "MKD", &FTPSession::handleMkd },
+		{ "MLSD", &FTPSession::handleMlsd },
+		{ "MLST", &FTPSession::handleMlst },
+		{ "MODE", &FTPSession::handleMode },
+		{ "NLST", &FTPSession::handleNlst },
+		{ "OPTS", &FTPSession::handleOpts },
+		{ "PASS", &FTPSession::handlePass, true },
+		{ "PASV", &FTPSession::handlePasv },
+		{ "PORT", &FTPSession::handlePort },
+		{ "PWD", &FTPSession::handlePwd },
+		{ "QUIT", &FTPSession::handleQuit, true },
+		{ "RANG", &FTPSession::handleRang },
+		{ "REST", &FTPSession::handleRest },
+		{ "RETR", &FTPSession::handleRetr },
+		{ "RMD", &FTPSession::handleRmd },
+		{ "SITE", &FTPSession::handleSite },
+		{ "SIZE", &FTPSession::handleSize },
+		{ "STOR", &FTPSession::handleStor },
+		{ "SYST", &FTPSession::handleSyst, true },
+		{ "TYPE", &FTPSession::handleType },
+		{ "USER", &FTPSession::handleUser, true },
+		{ "XCRC", &FTPSession::handleXcrc },
+		{ "XSHA256", &FTPSession::handleXsha256 },
+	};
+
+	CommandTable table{};
+	for (const auto& command : commands)
+	{
+		const std::uint64_t code = commandCode(command._name, std::char_traits<char>::length(command._name));
+		std::size_t slot = commandSlot(code);
+		while (table[slot]._code != 0)
 		{
-			args = args.substr(0, pos);
+			slot = (slot + 1) % table.size();
 		}
-
-		handlePort(args);
-	}
-	else if (command == "PWD")
-	{
-		handlePwd();
-	}
-	else if (command == "QUIT")
-	{
-		handleQuit();
-	}
-	else if (command == "RETR")
-	{
-		handleRetr(args);
+		table[slot]._code = code;
+		table[slot]._handler = command._handler;
+		table[slot]._beforeLogin = command._beforeLogin;
 	}
-	else if (command == "RMD")
-	{
-		handleRmd(args);
-	}
-	else if (command == "SYST")
-	{
-		handleSyst();
-	}
-	else if (command == "STOR")
-	{
-		handleStor(args);
-	}
-	else if (command == "TYPE")
-	{
-		handleType(args);
-	}
-	else if (command == "USER")
-	{
-		handleUser(args);
-	}
-	else 
+	return table;
+}
+
+void FTPSession::executeCommand(std::string_view cmd)
+{
+	static constexpr CommandTable commands = makeCommandTable();
+
+	const std::size_t p = cmd.find(' ');
+	const std::uint64_t code = commandCode(cmd.data(), std::min(p, cmd.length()));
+	const std::string_view args(p != std::string_view::npos ? cmd.substr(p + 1) : std::string_view());
+	_args.assign(args.data(), args.length());
+
+	if (code != 0)
 	{
-		sendMessageToClient("500 Unknown command");
+		for (std::size_t slot = commandSlot(code); commands[slot]._code != 0; slot = (slot + 1) % commands.size())
+		{
+			if (commands[slot]._code == code)
+			{
+				if (!_loggedIn && !commands[slot]._beforeLogin)
+				{
+					sendMessageToClient("530 Please login with USER and PASS");
+					return;
+				}
+				(this->*commands[slot]._handler)(_args);
+				return;
+			}
+		}
 	}
+
+	sendMessageToClient("500 Unknown command");
 }
 
 
@@ -289,8 +478,7 @@ void FTPSession::handleDele(const std::string& args)
 {
 	namespace fs = std::experimental::filesystem;
 
-	std::regex fname("(.+?)(\\.[^.]*$|$)");
-	if (!args.empty() && std::regex_match(args, fname))
+	if (!args.empty())
 	{
 		fs::path filePath = _currDir / args;
 		std::error_code ec;
@@ -319,28 +507,100 @@ void FTPSession::handleDele(const std::string& args)
 	}
 }
 
-void FTPSession::handleEpsv()
+void FTPSession::handleEprt(const std::string& args)
+{
+	handlePort(parseExtendedArguments(args));
+}
+
+void FTPSession::handleEpsv(const std::string& args)
 {
-	sendMessageToClient("229 Entering Extended Passive Mode (|||" + std::to_string(_dataPort) + "|)");
-	if (!openDataConnectionPassive(_dataPort))
+	// the acceptor has to listen before the client gets the reply
+	const std::uint16_t port = openDataConnectionPassive();
+	if (port == 0)
 	{
 		LOG_ERROR() << " - Error 'Could not open data connection (passive mode)'\n";
+		sendMessageToClient("425 Could not open passive data connection");
+		return;
 	}
+	sendMessageToClient("229 Entering Extended Passive Mode (|||" + std::to_string(port) + "|)");
 }
 
-void FTPSession::handleFeat()
+void FTPSession::handleFeat(const std::string& args)
 {
+	// the algorithm selected by OPTS HASH is marked
+	std::string algorithms;
+	for (FileChecksums::Algorithm algorithm : { FileChecksums::Algorithm_Crc32, FileChecksums::Algorithm_Crc32c,
+		FileChecksums::Algorithm_Sha256 })
+	{
+		algorithms.append(algorithms.empty() ? "" : ";").append(FileChecksums::algorithmName(algorithm));
+		if (algorithm == _hashAlgorithm)
+		{
+			algorithms.append("*");
+		}
+	}
+
 	sendMessageToClient("211-Features supported:");
-	sendMessageToClient(" nothing essential now ");
+	sendMessageToClient(" HASH " + algorithms);
+	sendMessageToClient(" MDTM");
+	sendMessageToClient(" MLST type*;size*;modify*;unique*;");
+	sendMessageToClient(" MODE Z");
+	sendMessageToClient(" RANG STREAM");
+	sendMessageToClient(" REST STREAM");
+	sendMessageToClient(" SIZE");
+	sendMessageToClient(" XCRC \"filename\" SP EP");
+	sendMessageToClient(" XSHA256 \"filename\"");
 	sendMessageToClient("211 End");
 }
 
+// HASH path, of the range set by RANG or REST if any. The range of the reply
+// is inclusive as that of RANG; an empty one (an empty file or REST at its end)
+// has no last byte and is shown as <first>-<first>.
+void FTPSession::handleHash(const std::string& args)
+{
+	const std::uint64_t first = static_cast<std::uint64_t>(_restartOffset);
+	const std::int64_t last = _rangeEnd;
+	_restartOffset = 0;
+	_rangeEnd = -1;
+
+	if (args.empty())
+	{
+		sendMessageToClient("501 No file name given");
+		return;
+	}
+
+	const FileChecksums::Algorithm algorithm = _hashAlgorithm;
+	computeChecksum((_currDir / args).string(), algorithm, first, last,
+		[algorithm, args](const FileChecksums::Result& result)
+		{
+			const std::uint64_t last = result._length != 0 ? result._first + result._length - 1 : result._first;
+			return "213 " + std::string(FileChecksums::algorithmName(algorithm)) + ' ' + std::to_string(result._first)
+				+ '-' + std::to_string(last) + ' ' + result._checksum + ' ' + args;
+		});
+}
+
+void FTPSession::handleMdtm(const std::string& args)
+{
+	namespace fs = std::experimental::filesystem;
+
+	fs::path path = _currDir / args;
+	struct statx stx;
+	if (args.empty() || ::statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, STATX_TYPE | STATX_MTIME, &stx) == -1
+		|| !S_ISREG(stx.stx_mode))
+	{
+		sendMessageToClient("550 Could not get file modification time");
+		return;
+	}
+
+	char modify[16];
+	formatTime(stx.stx_mtime.tv_sec, modify, sizeof(modify));
+	sendMessageToClient(std::string("213 ") + modify);
+}
+
 void FTPSession::handleMkd(const std::string& args)
 {
 	namespace fs = std::experimental::filesystem;
 
-	std::regex fname("^[a-zA-Z0-9]+$");
-	if (!args.empty() && std::regex_match(args, fname))
+	if (isAlnumName(args))
 	{
 		fs::path dir = _currDir / args;
 		std::error_code ec;
@@ -362,180 +622,360 @@ void FTPSession::handleMkd(const std::string& args)
 
 void FTPSession::handleNlst(const std::string& args)
 {
-	if (!_dataSocket.is_open())
+	if (!dataConnectionReady(&FTPSession::handleNlst, args))
 	{
-		sendMessageToClient("425 No data connection");
 		return;
 	}
-
-	try
-	{
-		std::list<std::string> dirContent(readDirectory(args));
-
-		if (dirContent.empty())
-		{
-			sendMessageToClient("550 The directory does not exist");
-			closeDataConnection();
-			return;
-		}
-
-		sendMessageToClient("125 Data connection is ready to transfer files list");
-		for (const std::string& s : dirContent)
-		{
-			sendAsciiDataToClient(s);
-		}
-
-		sendMessageToClient("226 Transfer complete");
-	}
-	catch (const std::exception& ex)
-	{
-		LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
-	}
-
-	closeDataConnection();
+	listDirectory(args, DirectoryListingCache::Format_List);
 }
 
-void FTPSession::handlePass(const std::string& args)
+void FTPSession::handleMlsd(const std::string& args)
 {
-	std::string password(args);
-	if (!_username.empty())
+	if (!dataConnectionReady(&FTPSession::handleMlsd, args))
 	{
-		if (UsersDB::getInstance().passwordIsValid(_username, password))
-		{
-			sendMessageToClient("230 User " + _username + " logged in");
-			return;
-		}
-		else
-		{
-			sendMessageToClient("530 login authentication failed");
-			return;	
-		}
+		return;
 	}
+	listDirectory(args, DirectoryListingCache::Format_Machine);
 }
 
-void FTPSession::handlePasv(const std::string& args)
+void FTPSession::handleMlst(const std::string& args)
 {
-	const std::string addr("127.0.0.1");	// TO DO: obtain IP address of any physical interface
-	std::vector<std::string> h = string_utils::split(addr, '.');
-
-	std::uint16_t p1 = _dataPort / 256;
-	std::uint16_t p2 = _dataPort % 256;
-
-	std::ostringstream oss;
-	oss << "227 Entering Passive Mode (" 
-		<< h[0] << ',' << h[1] << ',' << h[2] << ',' << h[3] << ',' << p1 << ',' << p2 << ").";
-
-	sendMessageToClient(oss.str());
+	namespace fs = std::experimental::filesystem;
 
-	if (!openDataConnectionPassive(_dataPort))
+	fs::path path = args.empty() ? _currDir : _currDir / args;
+	struct statx stx;
+	if (::statx(AT_FDCWD, path.c_str(), AT_STATX_SYNC_AS_STAT, MACHINE_LISTING_MASK, &stx) == -1)
 	{
-		LOG_ERROR() << " - Error 'Could not open data connection (passive mode)'\n";
+		sendMessageToClient("550 The file does not exist");
+		return;
 	}
+
+	char facts[MAX_LISTING_ENTRY_LENGTH];
+	renderFacts(stx, facts, sizeof(facts));
+	sendMessageToClient("250-Listing " + (args.empty() ? std::string(".") : args));
+	sendMessageToClient(std::string(" ") + facts + ' ' + (args.empty() ? std::string(".") : args));
+	sendMessageToClient("250 End");
 }
 
-void FTPSession::handlePort(const std::string& args)
+void FTPSession::handleMode(const std::string& args)
 {
-	std::vector<std::string> elements = string_utils::split(args, ',');
-	std::string host = elements[0] + "." + elements[1] + "." + elements[2] + "." + elements[3];
-	std::uint16_t port = std::stoi(elements[4]) * 256 + std::stoi(elements[5]);
-
-	if (openDataConnectionActive(host, port))
+	if (args.length() == 1 && std::toupper(args[0]) == 'S')
+	{
+		_transferMode = TransferMode_Stream;
+		sendMessageToClient("200 Mode set to S");
+	}
+	else if (args.length() == 1 && std::toupper(args[0]) == 'Z')
 	{
-		sendMessageToClient("200 PORT command successful");
+		_transferMode = TransferMode_Deflate;
+		sendMessageToClient("200 Mode set to Z");
 	}
 	else
 	{
-		LOG_ERROR() << " - Error 'Could not open data connection (active mode)'\n";
+		sendMessageToClient("504 Unsupported transfer mode");
 	}
 }
 
-void FTPSession::handlePwd()
-{
-	std::string msg("257 \"");
-	msg.append(_currDir);
-	msg.append("\"");
-	sendMessageToClient(msg);
-}
-
-void FTPSession::handleQuit()
+// "OPTS HASH [<algorithm>]" shows or selects the algorithm of HASH,
+// "OPTS MODE Z LEVEL <0-9>" sets the compression level of MODE Z.
+void FTPSession::handleOpts(const std::string& args)
 {
-	sendMessageToClient("221 Goodbye.");
-	_quitCmdLoop = true;
-}
+	std::string options(args);
+	std::transform(options.begin(), options.end(), options.begin(),
+		[](char x){ return static_cast<char>(std::toupper(x)); });
 
+	const std::string hash("HASH");
+	if (options.compare(0, hash.length(), hash) == 0 && (options.length() == hash.length() || options[hash.length()] == ' '))
+	{
+		if (options.length() > hash.length()
+			&& !FileChecksums::parseAlgorithm(options.substr(hash.length() + 1), _hashAlgorithm))
+		{
+			sendMessageToClient("501 Unknown algorithm");
+			return;
+		}
+		sendMessageToClient("200 " + std::string(FileChecksums::algorithmName(_hashAlgorithm)));
+		return;
+	}
 
-void FTPSession::handleRetr(const std::string& args)
-{
-	if (!_dataSocket.is_open())
+	const std::string prefix("MODE Z LEVEL ");
+	if (options.compare(0, prefix.length(), prefix) != 0)
 	{
-		sendMessageToClient("425 No data connection");
+		sendMessageToClient("501 Option not understood");
 		return;
 	}
 
-	namespace fs = std::experimental::filesystem;
-
-	fs::path path = _currDir / args;
-	if (!fs::exists(path))
+	const std::string level(options.substr(prefix.length()));
+	if (level.length() != 1 || level[0] < '0' || level[0] > '9')
 	{
-		sendMessageToClient("550 File does not exist");
+		sendMessageToClient("501 Invalid compression level");
 		return;
 	}
 
-	bool transferSuccess = true;	
+	_compressionLevel = level[0] - '0';
+	sendMessageToClient("200 MODE Z LEVEL set to " + level);
+}
 
-	if (_transferType == TransferType_Binary)
+void FTPSession::handlePass(const std::string& args)
+{
+	if (_username.empty())
 	{
-		sendMessageToClient("150 Data connection (binary mode) is ready to transfer file");
+		sendMessageToClient("503 Login with USER first");
+		return;
+	}
 
-		static const std::size_t BUFFER_SIZE = 1024;
-		char buffer[BUFFER_SIZE];
+	// the hash takes a while, it's checked by the pool of the users database
+	suspendCommands();
 
-		std::ifstream inFile(path.string(), std::fstream::binary);
-		std::int32_t n = inFile.readsome(buffer, BUFFER_SIZE);
-		while (n > 0)
+	auto self(shared_from_this());
+	const std::string username(_username);
+	UsersDB::getInstance().verifyPassword(username, args,
+		[this, self, username](bool valid)
 		{
-			if (!sendDataToClient(buffer, n))
-			{
-				// send error message (with reason explanation)
-				transferSuccess = false;
-				break;
-			}
-			n = inFile.readsome(buffer, BUFFER_SIZE);
-		}
+			asio::post(_strand,
+				[this, self, username, valid]()
+				{
+					if (_closed)
+					{
+						return;
+					}
+
+					if (valid)
+					{
+						_loggedIn = true;
+						sendMessageToClient("230 User " + username + " logged in");
+					}
+					else
+					{
+						LOG_INFO() << " - Login of '" << username << "' failed\n";
+						sendMessageToClient("530 login authentication failed");
+					}
+					touch();
+					resumeCommands();
+				});
+		});
+}
+
+void FTPSession::handlePasv(const std::string& args)
+{
+	// the data connection is expected at the address the client has connected to
+	std::error_code ec;
+	const asio::ip::address localAddr(_ctrlSocket.local_endpoint(ec).address());
+	if (ec || !localAddr.is_v4())
+	{
+		sendMessageToClient("425 Could not open passive data connection");
+		return;
 	}
-	else
+
+	const std::uint16_t port = openDataConnectionPassive();
+	if (port == 0)
 	{
-		sendMessageToClient("150 Data connection (ASCII mode) is ready to transfer file.");
+		LOG_ERROR() << " - Error 'Could not open data connection (passive mode)'\n";
+		sendMessageToClient("425 Could not open passive data connection");
+		return;
+	}
+
+	const asio::ip::address_v4::bytes_type h(localAddr.to_v4().to_bytes());
+	std::uint16_t p1 = port / 256;
+	std::uint16_t p2 = port % 256;
+
+	std::ostringstream oss;
+	oss << "227 Entering Passive Mode (" 
+		<< +h[0] << ',' << +h[1] << ',' << +h[2] << ',' << +h[3] << ',' << p1 << ',' << p2 << ").";
 
-		std::ifstream inFile(path.string());
-		std::string line;
+	sendMessageToClient(oss.str());
+}
 
-		while (std::getline(inFile, line))
+void FTPSession::handlePort(const std::string& args)
+{
+	// h1,h2,h3,h4,p1,p2 optionally enclosed in parentheses
+	std::size_t begin = args.find('(');
+	begin = (begin != std::string::npos) ? begin + 1 : 0;
+	std::size_t end = args.find(')', begin);
+	end = (end != std::string::npos) ? end : args.length();
+
+	unsigned int numbers[6] = { 0 };
+	std::size_t count = 0;
+	bool valid = true;
+	std::size_t digits = 0;
+	for (std::size_t i = begin; i < end && valid; i++)
+	{
+		const char c = args[i];
+		if (c >= '0' && c <= '9')
 		{
-			line.append("\r\n");
-			if (!sendDataToClient(line.c_str(), line.length()))
-			{
-				// send error message (with reason explanation)
-				transferSuccess = false;
-				break;
-			}
+			numbers[count] = numbers[count] * 10 + (c - '0');
+			valid = ++digits <= 3 && numbers[count] <= 255;
+		}
+		else if (c == ',')
+		{
+			valid = digits != 0 && ++count < 6;
+			digits = 0;
+		}
+		else
+		{
+			valid = false;
 		}
 	}
 
-	if (transferSuccess)
+	if (!valid || count != 5 || digits == 0)
 	{
-		sendMessageToClient("226 The file transferred successfully, closing data connection");
+		sendMessageToClient("501 Syntax error in parameters or arguments");
+		return;
 	}
 
-	closeDataConnection();
+	const std::string host(std::to_string(numbers[0]) + '.' + std::to_string(numbers[1]) + '.'
+		+ std::to_string(numbers[2]) + '.' + std::to_string(numbers[3]));
+	const std::uint16_t port = static_cast<std::uint16_t>(numbers[4] * 256 + numbers[5]);
+
+	openDataConnectionActive(host, port);
+}
+
+void FTPSession::handlePwd(const std::string& args)
+{
+	std::string msg("257 \"");
+	msg.append(_currDir);
+	msg.append("\"");
+	sendMessageToClient(msg);
+}
+
+void FTPSession::handleQuit(const std::string& args)
+{
+	sendMessageToClient("221 Goodbye.");
+	_quitCmdLoop = true;
+}
+
+
+// RANG (draft-bryan-ftp-range) limits the next RETR to the inclusive byte
+// range, so a client may download parts of one file over several connections.
+void FTPSession::handleRang(const std::string& args)
+{
+	const std::vector<std::string> elements(string_utils::split(args, ' '));
+	std::uint64_t first = 0;
+	std::uint64_t last = 0;
+	if (elements.size() != 2 || !parseOffset(elements[0], first) || !parseOffset(elements[1], last))
+	{
+		sendMessageToClient("501 Syntax error in parameters or arguments");
+		return;
+	}
+
+	if (first == 1 && last == 0)
+	{
+		_restartOffset = 0;
+		_rangeEnd = -1;
+		sendMessageToClient("350 Restarting at 0. Byte range reset");
+		return;
+	}
+
+	if (last < first)
+	{
+		sendMessageToClient("501 Invalid byte range");
+		return;
+	}
+
+	_restartOffset = first;
+	_rangeEnd = last;
+	sendMessageToClient("350 Restarting at " + std::to_string(first) + ". End byte range at " + std::to_string(last));
+}
+
+void FTPSession::handleRest(const std::string& args)
+{
+	std::uint64_t offset = 0;
+	if (!parseOffset(args, offset))
+	{
+		sendMessageToClient("501 Syntax error in parameters or arguments");
+		return;
+	}
+
+	_restartOffset = offset;
+	_rangeEnd = -1;
+	sendMessageToClient("350 Restarting at " + std::to_string(offset) + ". Send STORE or RETRIEVE to initiate transfer");
+}
+
+void FTPSession::handleRetr(const std::string& args)
+{
+	if (!dataConnectionReady(&FTPSession::handleRetr, args))
+	{
+		return;
+	}
+
+	namespace fs = std::experimental::filesystem;
+
+	fs::path path = _currDir / args;
+	if (!fs::exists(path))
+	{
+		sendMessageToClient("550 File does not exist");
+		return;
+	}
+
+	// the restart marker and the range are applied to this transfer only
+	const off_t offset = _restartOffset;
+	const off_t rangeEnd = _rangeEnd;
+	_restartOffset = 0;
+	_rangeEnd = -1;
+
+	if (_transferMode == TransferMode_Deflate)
+	{
+		retrieveDeflated(path, offset, rangeEnd);
+	}
+	else if (_transferType != TransferType_Binary || !retrieveCached(path, offset, rangeEnd))
+	{
+		_fileFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (_fileFd == -1)
+		{
+			LOG_ERROR() << " - Error 'Could not open file '" << path << "': " << std::strerror(errno) << "'\n";
+			sendMessageToClient("550 Could not open file");
+			closeDataConnection();
+			return;
+		}
+
+		// a directory opens too, but can't be sent
+		struct stat st;
+		if (::fstat(_fileFd, &st) == -1 || !S_ISREG(st.st_mode))
+		{
+			::close(_fileFd);
+			_fileFd = -1;
+			sendMessageToClient("550 Not a regular file");
+			closeDataConnection();
+			return;
+		}
+
+		if (offset > st.st_size)
+		{
+			::close(_fileFd);
+			_fileFd = -1;
+			sendMessageToClient("554 Requested action not taken: invalid REST parameter");
+			closeDataConnection();
+			return;
+		}
+
+		_fileOffset = offset;
+		_fileEnd = (rangeEnd >= 0) ? std::min<off_t>(rangeEnd + 1, st.st_size) : -1;
+		::posix_fadvise(_fileFd, offset, 0, POSIX_FADV_SEQUENTIAL);
+		suspendCommands();
+
+		if (_transferType == TransferType_Binary)
+		{
+			std::error_code ec;
+			_dataSocket.non_blocking(true, ec);
+
+			sendMessageToClient("150 Data connection (binary mode) is ready to transfer file");
+			startTransferStats("RETR", "sendfile");
+			startReadAdvice(_fileEnd >= 0 ? _fileEnd : st.st_size);
+			sendFile();
+		}
+		else
+		{
+			sendMessageToClient("150 Data connection (ASCII mode) is ready to transfer file.");
+			startTransferStats("RETR", "text");
+			startReadAhead();
+			sendFileText();
+		}
+	}
 }
 
 void FTPSession::handleRmd(const std::string& args)
 {
 	namespace fs = std::experimental::filesystem;
 
-	std::regex fname("^[a-zA-Z0-9]+$");
-	if (!args.empty() && std::regex_match(args, fname))
+	if (isAlnumName(args))
 	{
 		fs::path dir = _currDir / args;
 		std::error_code ec;
@@ -572,88 +1012,108 @@ void FTPSession::handleRmd(const std::string& args)
 	}
 }
 
-void FTPSession::handleSyst()
+// SITE RATE shows the bandwidth limits of the session, SITE RATE <bytes/s>
+// changes its own limit (0 - unlimited) even while a transfer is running,
+// but never above the session limit configured for the server.
+void FTPSession::handleSite(const std::string& args)
 {
-	sendMessageToClient("215 UNIX Type: L8");
-}
+	std::string command(args.substr(0, args.find(' ')));
+	std::transform(command.begin(), command.end(), command.begin(),
+		[](char x){ return static_cast<char>(std::toupper(x)); });
 
-void FTPSession::handleStor(const std::string& args)
-{
-	if (!_dataSocket.is_open())
+	if (command != "RATE")
 	{
-		sendMessageToClient("425 No data connection");
+		sendMessageToClient("504 Unsupported SITE command");
 		return;
 	}
 
+	BandwidthShaper& shaper = _server.getBandwidthShaper();
+	if (!_flow)
+	{
+		_flow = shaper.openFlow(_username);
+	}
+
+	if (args.length() > command.length())
+	{
+		std::uint64_t rate = 0;
+		if (!parseOffset(args.substr(command.length() + 1), rate))
+		{
+			sendMessageToClient("501 Invalid rate");
+			return;
+		}
+		if (!shaper.limitSessionRate(_flow, rate))
+		{
+			sendMessageToClient("550 Rate exceeds the session limit of the server");
+			return;
+		}
+	}
+
+	const BandwidthShaper::Rates rates(shaper.getRates(_flow));
+	sendMessageToClient("200 Rate limits (bytes/s, 0 - unlimited): session " + std::to_string(rates._session)
+		+ ", user " + std::to_string(rates._user) + ", global " + std::to_string(rates._global));
+}
+
+void FTPSession::handleSize(const std::string& args)
+{
 	namespace fs = std::experimental::filesystem;
 
 	fs::path path = _currDir / args;
-	bool transferSuccess = true;
-
-	if (_transferType == TransferType_Binary)
+	struct stat st;
+	if (args.empty() || ::stat(path.c_str(), &st) == -1 || !S_ISREG(st.st_mode))
 	{
-		sendMessageToClient("150 Data connection (binary mode) is ready to transfer file");
+		sendMessageToClient("550 Could not get file size");
+		return;
+	}
 
-		std::ofstream outFile(path.string(), std::fstream::binary);
-		// TO DO: check that file is opened
+	sendMessageToClient("213 " + std::to_string(st.st_size));
+}
 
-		std::error_code ec;
-		std::size_t n = 0;
-		do
-		{
-			std::array<char, 512> buffer;
-			n = _dataSocket.read_some(asio::buffer(buffer, 512), ec);
-			if (ec)
-			{
-				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-				transferSuccess = false;
-				break;
-			}
+void FTPSession::handleSyst(const std::string& args)
+{
+	sendMessageToClient("215 UNIX Type: L8");
+}
 
-			outFile.write(buffer.data(), n);
-		} while (n == 512);
-	}
-	else		
+void FTPSession::handleStor(const std::string& args)
+{
+	if (!dataConnectionReady(&FTPSession::handleStor, args))
 	{
-		sendMessageToClient("150 Data connection (ASCII mode) is ready to transfer file");
+		return;
+	}
 
-		std::ofstream outFile(path.string());
-		// TO DO: check that file is opened
+	namespace fs = std::experimental::filesystem;
 
-		std::error_code ec;
-		std::size_t n = 0;
-		do
-		{
-			std::array<char, 512> buffer;
-			n = _dataSocket.read_some(asio::buffer(buffer, 512), ec);
-			if (ec)
-			{
-				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-				transferSuccess = false;
-				break;
-			}
+	fs::path path = _currDir / args;
 
-			for (std::size_t i = 0; i < n; i++)
-			{
-				if (buffer[i] == '\r')
-				{
-					continue;
-				}
-				outFile.put(buffer[i]);
-			}
-		} while (n == 512);
+	// A restarted upload keeps the file and writes from the restart marker on,
+	// several connections may upload different parts of the same file at once.
+	const off_t offset = _restartOffset;
+	_restartOffset = 0;
+	_rangeEnd = -1;
+
+	_fileFd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (offset == 0 ? O_TRUNC : 0), 0644);
+	if (_fileFd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not open file '" << path << "': " << std::strerror(errno) << "'\n";
+		sendMessageToClient("550 Could not create file");
+		closeDataConnection();
+		return;
 	}
+	_fileOffset = offset;
 
-	if (transferSuccess)
+	if (_transferType == TransferType_Binary)
 	{
-		sendMessageToClient("226 The file transferred successfully, closing data connection");
+		sendMessageToClient("150 Data connection (binary mode) is ready to transfer file");
 	}
-	else
+	else		
 	{
-		sendMessageToClient("446 Transfer failed");
+		sendMessageToClient("150 Data connection (ASCII mode) is ready to transfer file");
 	}
 
-	closeDataConnection();
+	std::error_code ec;
+	_dataSocket.non_blocking(true, ec);
+
+	suspendCommands();
+	receiveFile();
 }
 
 void FTPSession::handleType(const std::string& args)
@@ -674,171 +1134,1492 @@ void FTPSession::handleType(const std::string& args)
 	}
 }
 
+// Any name is asked for the password, so unknown names can't be told from
+// the known ones. They are rejected by PASS.
+// USER starts a new login, the session's share of bandwidth belongs to the previous user.
 void FTPSession::handleUser(const std::string& args)
 {
-	std::string username(args);
-	if (UsersDB::getInstance().usernameIsKnown(username))
-	{
-		sendMessageToClient("331 Password required for " + username);
-		_username = username;
-		return;
-	}
-	else
+	_loggedIn = false;
+	if (_flow)
 	{
-		std::cout << "Unknown username: " << username << std::endl;
+		_server.getBandwidthShaper().closeFlow(_flow);
+		_flow.reset();
 	}
+	_username = args;
+	sendMessageToClient("331 Password required for " + _username);
 }
 
-bool FTPSession::openDataConnectionActive(const std::string& addr, std::uint16_t port)
+// XCRC "path" [start [end]], the end isn't included
+void FTPSession::handleXcrc(const std::string& args)
 {
-	tcp::endpoint ep(asio::ip::make_address(addr), port);
-	std::error_code ec;
-	_dataSocket.connect(ep, ec);
-
-	if (ec)
+	std::string rest;
+	const std::string path(parseQuotedPath(args, rest));
+	if (path.empty())
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
+		sendMessageToClient("501 No file name given");
+		return;
 	}
 
-	return true;
-}
-
-
-bool FTPSession::openDataConnectionPassive(std::uint16_t port)
-{
-	if (_dataSocket.is_open())
+	std::uint64_t first = 0;
+	std::uint64_t end = 0;
+	std::int64_t last = -1;
+	const std::size_t p = rest.find(' ');
+	if (!rest.empty())
 	{
-		LOG_ERROR() << " Error - Could not open passive data connection, because data socket still opened.\n";
-		return false;
+		if (!parseOffset(rest.substr(0, p), first)
+			|| (p != std::string::npos && (!parseOffset(rest.substr(p + 1), end) || end < first)))
+		{
+			sendMessageToClient("501 Invalid range");
+			return;
+		}
+		if (p != std::string::npos)
+		{
+			last = static_cast<std::int64_t>(end) - 1;
+		}
 	}
 
-	std::error_code ec;
-	_acceptor.open(tcp::v4(), ec);
-	if (ec)
+	// an empty range has the CRC of nothing
+	if (last != -1 && static_cast<std::uint64_t>(last + 1) == first)
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
+		sendMessageToClient("250 00000000");
+		return;
 	}
 
-	_acceptor.set_option(tcp::socket::reuse_address(true), ec);
-	if (ec)
-	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
-	}		
+	computeChecksum((_currDir / path).string(), FileChecksums::Algorithm_Crc32, first, last,
+		[](const FileChecksums::Result& result)
+		{
+			std::string crc(result._checksum);
+			std::transform(crc.begin(), crc.end(), crc.begin(),
+				[](char x){ return static_cast<char>(std::toupper(x)); });
+			return "250 " + crc;
+		});
+}
 
-	_acceptor.bind(tcp::endpoint(tcp::v4(), port), ec);
-	if (ec)
+// XSHA256 "path"
+void FTPSession::handleXsha256(const std::string& args)
+{
+	std::string rest;
+	const std::string path(parseQuotedPath(args, rest));
+	if (path.empty())
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
+		sendMessageToClient("501 No file name given");
+		return;
 	}
 
-	_acceptor.listen(asio::socket_base::max_listen_connections, ec);
-	if (ec)
+	computeChecksum((_currDir / path).string(), FileChecksums::Algorithm_Sha256, 0, -1,
+		[](const FileChecksums::Result& result)
+		{
+			return "250 " + result._checksum;
+		});
+}
+
+// Returns true if some bytes (_granted) may be sent right now. Otherwise
+// the shaper has queued the session and 'resume' is called on the strand
+// once the bytes are granted.
+bool FTPSession::acquireBandwidth(std::function<void()> resume)
+{
+	if (_granted != 0)
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
-		return false;
+		return true;
 	}
 
-	_acceptor.accept(_dataSocket, ec);
-	if (ec)
+	BandwidthShaper& shaper = _server.getBandwidthShaper();
+	if (!_flow)
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";		
-		return false;
+		_flow = shaper.openFlow(_username);
 	}
 
-	return true;
+	auto self(shared_from_this());
+	_granted = shaper.acquire(_flow, TRANSFER_CHUNK_SIZE, [this, self, resume](std::size_t granted)
+		{
+			asio::post(_strand, [this, self, resume, granted]()
+				{
+					_waitingBandwidth = false;
+					if (!_closed)
+					{
+						_granted = granted;
+						resume();
+					}
+				});
+		});
+	_waitingBandwidth = (_granted == 0);
+	return _granted != 0;
 }
 
-void FTPSession::closeDataConnection()
+void FTPSession::startReadAdvice(off_t end)
 {
-	std::error_code ec;
+	_adviseEnd = end;
+	_advisedOffset = _fileOffset;
+	_droppedOffset = _fileOffset;
+	const std::uint64_t dropBehindSize = _server.getDropBehindSize();
+	_dropBehind = dropBehindSize != 0 && static_cast<std::uint64_t>(end) >= dropBehindSize;
+	adviseReadAhead();
+}
 
-	_dataSocket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
-	if (ec)
+// sendfile() reads the pages it doesn't find in the page cache synchronously,
+// so READAHEAD_WINDOW of the file ahead of the send cursor is being loaded
+// all the time: the next part loads while the current one is sent. The hints
+// go through the server's file I/O, WILLNEED may block while it starts reads.
+void FTPSession::adviseReadAhead()
+{
+	AsyncFileIO& fileIO = _server.getFileIO();
+	if (_advisedOffset < _adviseEnd && _fileOffset + static_cast<off_t>(READAHEAD_WINDOW - READAHEAD_STEP) >= _advisedOffset)
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+		const off_t end = std::min<off_t>(_fileOffset + static_cast<off_t>(READAHEAD_WINDOW), _adviseEnd);
+		fileIO.advise(_fileFd, _advisedOffset, end - _advisedOffset, POSIX_FADV_WILLNEED, nullptr);
+		_advisedOffset = end;
 	}
 
-	_dataSocket.close(ec);
-	if (ec)
+	// the pages still referenced by the socket buffers can't be dropped yet
+	const off_t dropEnd = _fileOffset - static_cast<off_t>(DROP_BEHIND_LAG);
+	if (_dropBehind && dropEnd - _droppedOffset >= static_cast<off_t>(READAHEAD_STEP))
 	{
-		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+		fileIO.advise(_fileFd, _droppedOffset, dropEnd - _droppedOffset, POSIX_FADV_DONTNEED, nullptr);
+		_droppedOffset = dropEnd;
 	}
+}
 
-	if (_acceptor.is_open())
+// The file is sent in chunks until the socket buffer is full, then the
+// transfer waits for the socket to become writable. After a chunk limit
+// the handler is re-posted, so one fast client doesn't hold the thread.
+void FTPSession::sendFile()
+{
+	touch();
+	std::size_t sent = 0;
+	while (sent < TRANSFER_CHUNK_SIZE)
 	{
-		_acceptor.close(ec);
-		if (ec)
+		std::size_t count = TRANSFER_CHUNK_SIZE;
+		if (_fileEnd >= 0)
+		{
+			count = std::min<off_t>(count, _fileEnd - _fileOffset);
+			if (count == 0)
+			{
+				finishTransfer("226 The file transferred successfully, closing data connection");
+				return;
+			}
+		}
+
+		if (!acquireBandwidth([this]() { sendFile(); }))
+		{
+			return;
+		}
+		count = std::min(count, _granted);
+
+		const ssize_t n = ::sendfile(_dataSocket.native_handle(), _fileFd, &_fileOffset, count);
+		_transferStats._syscalls++;
+		if (n > 0)
+		{
+			sent += n;
+			_granted -= n;
+			_transferStats._bytes += n;
+			adviseReadAhead();
+			continue;
+		}
+
+		if (n == 0)
+		{
+			finishTransfer("226 The file transferred successfully, closing data connection");
+			return;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
 		{
-			LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+			// send error message (with reason explanation)
+			LOG_ERROR() << " - Error '" << std::strerror(errno) << '(' << errno << ')' << "'\n";
+			finishTransfer("426 Connection closed; transfer aborted");
+			return;
 		}
+
+		auto self(shared_from_this());
+		_dataSocket.async_wait(tcp::socket::wait_write,
+			asio::bind_executor(_strand, [this, self](std::error_code ec)
+			{
+				if (ec)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+					finishTransfer("426 Connection closed; transfer aborted");
+					return;
+				}
+				sendFile();
+			}));
+		return;
 	}
+
+	auto self(shared_from_this());
+	asio::post(_strand, [this, self]()
+		{
+			sendFile();
+		});
 }
 
-std::string FTPSession::parseExtendedArguments(const std::string& args)
+// ASCII RETR: the file is read ahead in large blocks, line endings of a
+// block are converted in one pass and the result is sent by large writes.
+void FTPSession::sendFileText()
 {
-	return args;
+	touch();
+	if (_textBuffer.empty())
+	{
+		_textBuffer.resize(2 * _server.getFileIO().bufferSize());
+	}
+
+	auto self(shared_from_this());
+	_reader->next([this, self](const char* data, ssize_t n)
+		{
+			if (n < 0)
+			{
+				LOG_ERROR() << " - Error 'Could not read file: " << std::strerror(-n) << "'\n";
+				finishTransfer("451 Could not read file");
+				return;
+			}
+
+			if (n == 0)
+			{
+				finishTransfer("226 The file transferred successfully, closing data connection");
+				return;
+			}
+
+			_transferStats._syscalls++;
+			_textOffset = 0;
+			_textLength = line_endings::toCrlf(data, n, _textBuffer.data());
+			sendText();
+		});
 }
 
-std::list<std::string> FTPSession::readDirectory(const std::string& dirName)
+void FTPSession::sendText()
 {
-	std::list<std::string> result;
+	touch();
+	if (_textOffset == _textLength)
+	{
+		sendFileText();
+		return;
+	}
 
-	namespace fs = std::experimental::filesystem;
+	if (!acquireBandwidth([this]() { sendText(); }))
+	{
+		return;
+	}
+
+	const std::size_t length = std::min(_textLength - _textOffset, _granted);
+	_granted -= length;
+	_transferStats._bytes += length;
+
+	auto self(shared_from_this());
+	asio::async_write(_dataSocket, asio::buffer(_textBuffer.data() + _textOffset, length),
+		asio::bind_executor(_strand, [this, self, length](std::error_code ec, std::size_t sz)
+		{
+			_transferStats._syscalls++;
+			if (ec)
+			{
+				// send error message (with reason explanation)
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("426 Connection closed; transfer aborted");
+				return;
+			}
+			_textOffset += length;
+			sendText();
+		}));
+}
+
+
+// MODE Z: the file is read in chunks and deflated. The copy compressed from
+// the beginning to the end is kept in the cache of compressed files, next
+// transfers of the unchanged file send the copy as is.
+void FTPSession::retrieveDeflated(const std::string& path, off_t offset, off_t rangeEnd)
+{
+	_fileFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (_fileFd == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not open file '" << path << "': " << std::strerror(errno) << "'\n";
+		sendMessageToClient("550 Could not open file");
+		closeDataConnection();
+		return;
+	}
+
+	struct stat st;
+	if (::fstat(_fileFd, &st) == -1 || !S_ISREG(st.st_mode))
+	{
+		::close(_fileFd);
+		_fileFd = -1;
+		sendMessageToClient("550 Not a regular file");
+		closeDataConnection();
+		return;
+	}
 
-	fs::path path = _currDir / dirName;
+	if (offset > st.st_size)
+	{
+		::close(_fileFd);
+		_fileFd = -1;
+		sendMessageToClient("554 Requested action not taken: invalid REST parameter");
+		closeDataConnection();
+		return;
+	}
 
 	std::error_code ec;
+	_dataSocket.non_blocking(true, ec);
 
-	if (!fs::exists(path, ec) || !fs::is_directory(path, ec))
+	CompressedFileCache& compressedFiles = _server.getCompressedFiles();
+	if (offset == 0 && rangeEnd < 0)
 	{
-		if (ec)
+		_zcopyKey = CompressedFileCache::makeKey(st, _transferType == TransferType_Binary ? 'I' : 'A', _compressionLevel);
+		const int fd = compressedFiles.find(_zcopyKey);
+		if (fd != -1)
 		{
-			LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+			::close(_fileFd);
+			_fileFd = fd;
+			_fileOffset = 0;
+			_fileEnd = -1;
+
+			sendMessageToClient("150 Data connection (deflate mode) is ready to transfer file");
+			suspendCommands();
+			startTransferStats("RETR", "sendfile, compressed copy");
+			sendFile();
+			return;
 		}
-		return result;
 	}
 
-	for (const fs::directory_entry& entry : fs::directory_iterator(path))
+	if (!_zstream.start(ZlibStream::Direction_Deflate, _compressionLevel))
 	{
-		std::ostringstream oss;
+		LOG_ERROR() << " - Error 'Could not initialize deflate stream'\n";
+		::close(_fileFd);
+		_fileFd = -1;
+		sendMessageToClient("451 Could not start compression");
+		closeDataConnection();
+		return;
+	}
 
-		try
+	if (offset == 0 && rangeEnd < 0)
+	{
+		_zcopyFd = compressedFiles.create(_zcopyPath);
+	}
+
+	_fileOffset = offset;
+	_fileEnd = (rangeEnd >= 0) ? std::min<off_t>(rangeEnd + 1, st.st_size) : st.st_size;
+	::posix_fadvise(_fileFd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+	sendMessageToClient("150 Data connection (deflate mode) is ready to transfer file");
+	suspendCommands();
+	startTransferStats("RETR", "deflate");
+	startReadAhead();
+	sendFileDeflated();
+}
+
+// Small files are sent from memory by a single write. On a miss the file is
+// read whole into a new buffer, which is cached for the next transfers.
+// Returns false if the file isn't small enough, RETR sends it from the file then.
+bool FTPSession::retrieveCached(const std::string& path, off_t offset, off_t rangeEnd)
+{
+	FileContentCache& cache = _server.getContentCache();
+	struct stat st;
+	if (::stat(path.c_str(), &st) == -1 || !cache.cacheable(st) || offset > st.st_size)
+	{
+		return false;
+	}
+
+	_content = cache.find(st);
+	if (!_content)
+	{
+		_fileFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (_fileFd == -1 || ::fstat(_fileFd, &st) == -1 || !cache.cacheable(st) || offset > st.st_size)
+		{
+			if (_fileFd != -1)
+			{
+				::close(_fileFd);
+				_fileFd = -1;
+			}
+			return false;
+		}
+	}
+
+	_contentOffset = offset;
+	_contentEnd = (rangeEnd >= 0) ? std::min<off_t>(rangeEnd + 1, st.st_size) : st.st_size;
+	suspendCommands();
+	sendMessageToClient("150 Data connection (binary mode) is ready to transfer file");
+
+	if (_content)
+	{
+		startTransferStats("RETR", "cache");
+		sendContent();
+		return true;
+	}
+
+	startTransferStats("RETR", "read");
+	auto content = std::make_shared<std::string>(st.st_size, '\0');
+	auto self(shared_from_this());
+	_server.getFileIO().read(_fileFd, &(*content)[0], content->size(), 0, [this, self, content, path, st](ssize_t n)
+		{
+			asio::post(_strand, [this, self, content, path, st, n]()
+				{
+					if (_closed)
+					{
+						return;
+					}
+
+					_transferStats._syscalls++;
+					if (n != static_cast<ssize_t>(content->size()))
+					{
+						LOG_ERROR() << " - Error 'Could not read file '" << path << "': " << std::strerror(n < 0 ? -n : EIO) << "'\n";
+						finishTransfer("451 Could not read file");
+						return;
+					}
+
+					// a file modified while it was read is sent, but it isn't cached
+					struct stat after;
+					if (::fstat(_fileFd, &after) == 0 && after.st_size == st.st_size
+						&& after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec)
+					{
+						_server.getContentCache().insert(path, st, content);
+					}
+					::close(_fileFd);
+					_fileFd = -1;
+
+					_content = content;
+					sendContent();
+				});
+		});
+	return true;
+}
+
+void FTPSession::sendContent()
+{
+	touch();
+	if (_contentOffset == _contentEnd)
+	{
+		finishTransfer("226 The file transferred successfully, closing data connection");
+		return;
+	}
+
+	if (!acquireBandwidth([this]() { sendContent(); }))
+	{
+		return;
+	}
+
+	const std::size_t length = std::min(static_cast<std::size_t>(_contentEnd - _contentOffset), _granted);
+	_granted -= length;
+	_transferStats._bytes += length;
+
+	auto self(shared_from_this());
+	asio::async_write(_dataSocket, asio::buffer(_content->data() + _contentOffset, length),
+		asio::bind_executor(_strand, [this, self, length](std::error_code ec, std::size_t sz)
 		{
-			const std::string name(entry.path().filename());
-			fs::file_time_type ftime = fs::last_write_time(entry);
+			_transferStats._syscalls++;
+			if (ec)
+			{
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("426 Connection closed; transfer aborted");
+				return;
+			}
+			_contentOffset += length;
+			sendContent();
+		}));
+}
 
-			std::time_t ft = fs::file_time_type::clock::to_time_t(ftime);
+void FTPSession::startReadAhead()
+{
+	if (!_reader)
+	{
+		_reader = std::make_shared<FileReadAhead>(_server.getFileIO(), _strand);
+	}
+	_reader->start(_fileFd, _fileOffset, _fileEnd);
+}
 
-			if (fs::is_regular_file(entry.path()))
+void FTPSession::sendFileDeflated()
+{
+	auto self(shared_from_this());
+	_reader->next([this, self](const char* data, ssize_t n)
+		{
+			if (n < 0)
 			{
-				std::uintmax_t size = fs::file_size(entry);
-				oss << std::setw(16) << std::setfill('0') << size
-					<< '\t' << std::put_time(std::gmtime(&ft), "%c %Z")
-					<< '\t' << name;
+				LOG_ERROR() << " - Error 'Could not read file: " << std::strerror(-n) << "'\n";
+				finishTransfer("451 Could not read file");
+				return;
 			}
-			else if (fs::is_directory(entry.path()))
+			_transferStats._syscalls++;
+			_fileOffset += n;
+
+			// the chunk is kept by the reader until the next one is requested
+			if (_transferType == TransferType_ASCII)
 			{
-				oss << " -- directory    "
-					<< '\t' << std::put_time(std::gmtime(&ft), "%c %Z")
-					<< '\t' << name;
+				if (_textBuffer.empty())
+				{
+					_textBuffer.resize(2 * _server.getFileIO().bufferSize());
+				}
+				_zstream.setInput(_textBuffer.data(), line_endings::toCrlf(data, n, _textBuffer.data()));
 			}
 			else
 			{
-				oss << "                "
-					<< '\t' << std::put_time(std::gmtime(&ft), "%c %Z")
-					<< '\t' << name;
+				_zstream.setInput(data, n);
 			}
-			result.emplace_back(oss.str());
+
+			const bool finish = (n == 0 || _fileOffset >= _fileEnd);
+			sendDeflated(finish, [this]()
+				{
+					if (_zstream.ended())
+					{
+						commitCompressedCopy();
+						finishTransfer("226 The file transferred successfully, closing data connection");
+						return;
+					}
+					sendFileDeflated();
+				});
+		});
+}
+
+// Deflates the input of _zstream and sends it in chunks of DEFLATE_BUFFER_SIZE,
+// 'next' is called when all of the input is sent (and the stream is completed
+// if 'finish' is set).
+void FTPSession::sendDeflated(bool finish, std::function<void()> next)
+{
+	touch();
+	if (_zbuffer.empty())
+	{
+		_zbuffer.resize(DEFLATE_BUFFER_SIZE);
+	}
+
+	if (!acquireBandwidth([this, finish, next]() { sendDeflated(finish, next); }))
+	{
+		return;
+	}
+
+	// the compressed chunk is no larger than the granted amount
+	const std::size_t size = std::min(_zbuffer.size(), _granted);
+	std::size_t length = 0;
+	while (length < size)
+	{
+		const long n = _zstream.process(_zbuffer.data() + length, size - length, finish);
+		if (n == -1)
+		{
+			LOG_ERROR() << " - Error 'Compression failed'\n";
+			finishTransfer("451 Compression failed");
+			return;
 		}
-		catch (const std::exception& ex)
+		length += n;
+
+		if (finish ? _zstream.ended() : _zstream.needsInput())
+		{
+			break;
+		}
+	}
+
+	if (length == 0)
+	{
+		next();
+		return;
+	}
+
+	if (_zcopyFd != -1 && !CompressedFileCache::append(_zcopyFd, _zbuffer.data(), length))
+	{
+		LOG_ERROR() << " - Error 'Could not write compressed copy: " << std::strerror(errno) << "'\n";
+		::close(_zcopyFd);
+		_zcopyFd = -1;
+		_server.getCompressedFiles().discard(_zcopyPath);
+	}
+
+	_transferStats._bytes += length;
+	_granted -= length;
+
+	auto self(shared_from_this());
+	asio::async_write(_dataSocket, asio::buffer(_zbuffer.data(), length),
+		asio::bind_executor(_strand, [this, self, finish, next](std::error_code ec, std::size_t sz)
+		{
+			_transferStats._syscalls++;
+			if (ec)
+			{
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("426 Connection closed; transfer aborted");
+				return;
+			}
+			sendDeflated(finish, next);
+		}));
+}
+
+// Inflates the received data and writes it to the file chunk by chunk. The
+// output is drained completely, even when the input has been consumed already,
+// before the next data is received.
+void FTPSession::writeInflated()
+{
+	if (_zbuffer.empty())
+	{
+		_zbuffer.resize(DEFLATE_BUFFER_SIZE);
+	}
+
+	const long n = _zstream.process(_zbuffer.data(), _zbuffer.size(), false);
+	if (n == -1)
+	{
+		LOG_ERROR() << " - Error 'Invalid compressed data'\n";
+		finishTransfer("446 Transfer failed");
+		return;
+	}
+
+	std::size_t amount = n;
+	if (_transferType == TransferType_ASCII)
+	{
+		amount = line_endings::stripCr(_zbuffer.data(), n);
+	}
+
+	const bool drained = (static_cast<std::size_t>(n) != _zbuffer.size() && _zstream.needsInput());
+	writeFile(_zbuffer.data(), amount, [this, drained]()
+		{
+			if (drained)
+			{
+				readFile();
+			}
+			else
+			{
+				writeInflated();
+			}
+		});
+}
+
+void FTPSession::commitCompressedCopy()
+{
+	if (_zcopyFd != -1)
+	{
+		::close(_zcopyFd);
+		_zcopyFd = -1;
+		_server.getCompressedFiles().commit(_zcopyKey, _zcopyPath);
+	}
+}
+
+// The cached listing goes in one write, it may be shared with other sessions.
+void FTPSession::sendListing()
+{
+	if (_transferMode == TransferMode_Deflate)
+	{
+		_zstream.setInput(_listing->data(), _listing->length());
+		sendDeflated(true, [this]()
+			{
+				finishTransfer("226 Transfer complete");
+			});
+		return;
+	}
+
+	auto self(shared_from_this());
+	asio::async_write(_dataSocket, asio::buffer(*_listing),
+		asio::bind_executor(_strand, [this, self](std::error_code ec, std::size_t sz)
+		{
+			if (ec)
+			{
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("426 Connection closed; transfer aborted");
+				return;
+			}
+			finishTransfer("226 Transfer complete");
+		}));
+}
+
+// Sends the listing from the cache or starts reading the directory.
+void FTPSession::listDirectory(const std::string& args, DirectoryListingCache::Format format)
+{
+	namespace fs = std::experimental::filesystem;
+
+	std::error_code ec;
+	const std::string path(fs::canonical(_currDir / args, ec));
+	if (ec || !fs::is_directory(path, ec))
+	{
+		sendMessageToClient("550 The directory does not exist");
+		closeDataConnection();
+		return;
+	}
+
+	if (_transferMode == TransferMode_Deflate && !_zstream.start(ZlibStream::Direction_Deflate, _compressionLevel))
+	{
+		LOG_ERROR() << " - Error 'Could not initialize deflate stream'\n";
+		sendMessageToClient("451 Could not start compression");
+		closeDataConnection();
+		return;
+	}
+
+	DirectoryListingCache& cache = _server.getListingCache();
+	_listing = cache.find(path, format);
+	if (_listing)
+	{
+		sendMessageToClient("125 Data connection is ready to transfer files list");
+		suspendCommands();
+		sendListing();
+		return;
+	}
+
+	_listingPath = path;
+	_listingFormat = format;
+	_listingWatched = cache.watch(path, _listingGeneration);
+	_listingFlushed = false;
+	const unsigned int mask = format == DirectoryListingCache::Format_Machine
+		? MACHINE_LISTING_MASK : STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+	if (!_listingReader.open(path, mask))
+	{
+		LOG_ERROR() << " - Error 'Could not open directory '" << path << "': " << std::strerror(errno) << "'\n";
+		sendMessageToClient("550 Could not read the directory");
+		closeDataConnection();
+		return;
+	}
+
+	sendMessageToClient("125 Data connection is ready to transfer files list");
+	suspendCommands();
+	sendDirectory();
+}
+
+// Renders the next part of the listing into the blocks of _listingBuffer and
+// sends them by one gathering write. An entry never straddles two blocks,
+// so the unused tails of the blocks don't need to be compacted. A listing
+// which fits into the buffer at once is also put into the listing cache.
+void FTPSession::sendDirectory()
+{
+	touch();
+	if (_listingBuffer.empty())
+	{
+		_listingBuffer.resize(LISTING_BLOCKS_COUNT * LISTING_BLOCK_SIZE);
+	}
+
+	std::array<asio::const_buffer, LISTING_BLOCKS_COUNT> buffers;
+	std::size_t block = 0;
+	std::size_t length = 0;
+	DirectoryReader::Entry entry;
+	while (block < LISTING_BLOCKS_COUNT)
+	{
+		char* data = _listingBuffer.data() + block * LISTING_BLOCK_SIZE;
+		if (LISTING_BLOCK_SIZE - length < MAX_LISTING_ENTRY_LENGTH)
 		{
-			LOG_ERROR() << "Exception - '" << ex.what() << "'\n";
+			buffers[block++] = asio::buffer(data, length);
+			length = 0;
 			continue;
 		}
+
+		if (!_listingReader.next(entry))
+		{
+			buffers[block] = asio::buffer(data, length);
+			break;
+		}
+
+		length += renderEntry(entry, _listingFormat, data + length, LISTING_BLOCK_SIZE - length);
+	}
+
+	const bool finished = !_listingReader.isOpen();
+	if (finished && !_listingFlushed && _listingWatched)
+	{
+		std::shared_ptr<std::string> listing = std::make_shared<std::string>();
+		listing->reserve(asio::buffer_size(buffers));
+		for (const asio::const_buffer& buffer : buffers)
+		{
+			listing->append(static_cast<const char*>(buffer.data()), buffer.size());
+		}
+		_server.getListingCache().insert(_listingPath, _listingGeneration, _listingFormat, listing);
 	}
-	return result;
+	_listingFlushed = true;
+
+	if (_transferMode == TransferMode_Deflate)
+	{
+		// the blocks are moved together to be the single input of deflate
+		std::size_t length = 0;
+		for (const asio::const_buffer& buffer : buffers)
+		{
+			std::memmove(_listingBuffer.data() + length, buffer.data(), buffer.size());
+			length += buffer.size();
+		}
+		_zstream.setInput(_listingBuffer.data(), length);
+		sendDeflated(finished, [this, finished]()
+			{
+				if (finished)
+				{
+					finishTransfer("226 Transfer complete");
+					return;
+				}
+				sendDirectory();
+			});
+		return;
+	}
+
+	auto self(shared_from_this());
+	asio::async_write(_dataSocket, buffers,
+		asio::bind_executor(_strand, [this, self, finished](std::error_code ec, std::size_t sz)
+		{
+			if (ec)
+			{
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("426 Connection closed; transfer aborted");
+				return;
+			}
+
+			if (finished)
+			{
+				finishTransfer("226 Transfer complete");
+				return;
+			}
+			sendDirectory();
+		}));
+}
+
+// The upload lasts until the client closes the data connection.
+void FTPSession::receiveFile()
+{
+	if (_transferMode == TransferMode_Deflate)
+	{
+		if (!_zstream.start(ZlibStream::Direction_Inflate, 0))
+		{
+			LOG_ERROR() << " - Error 'Could not initialize inflate stream'\n";
+			finishTransfer("451 Could not start decompression");
+			return;
+		}
+		startTransferStats("STOR", "inflate");
+		readFile();
+		return;
+	}
+
+	if (_transferType == TransferType_Binary && _spliceSupported && _pipe[0] == -1)
+	{
+		if (::pipe2(_pipe, O_NONBLOCK | O_CLOEXEC) == 0)
+		{
+			::fcntl(_pipe[1], F_SETPIPE_SZ, static_cast<int>(TRANSFER_CHUNK_SIZE));
+		}
+		else
+		{
+			LOG_ERROR() << " - Error 'Could not create pipe: " << std::strerror(errno) << "'\n";
+			_spliceSupported = false;
+		}
+	}
+
+	if (_transferType == TransferType_Binary && _spliceSupported)
+	{
+		startTransferStats("STOR", "splice");
+		spliceFile();
+	}
+	else
+	{
+		startTransferStats("STOR", "read/write");
+		readFile();
+	}
+}
+
+void FTPSession::spliceFile()
+{
+	touch();
+
+	// the pipe is filled from the socket as long as there's data, then it's
+	// drained to the file asynchronously and the thread is free meanwhile
+	std::size_t received = 0;
+	while (received < TRANSFER_CHUNK_SIZE)
+	{
+		const ssize_t n = ::splice(_dataSocket.native_handle(), nullptr, _pipe[1], nullptr,
+			TRANSFER_CHUNK_SIZE - received, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		_transferStats._syscalls++;
+		if (n > 0)
+		{
+			received += n;
+			_transferStats._bytes += n;
+			continue;
+		}
+
+		if (n == 0)
+		{
+			drainPipe(received, [this]()
+				{
+					finishTransfer("226 The file transferred successfully, closing data connection");
+				});
+			return;
+		}
+
+		if (errno == EINTR)
+		{
+			continue;
+		}
+
+		if (errno == EINVAL || errno == ENOSYS)
+		{
+			// the rest of the file may be received by read() once the pipe is empty
+			LOG_ERROR() << " - Error 'splice() is not supported, fall back to read/write'\n";
+			_spliceSupported = false;
+			_transferStats._method = "read/write";
+			drainPipe(received, [this]() { readFile(); });
+			return;
+		}
+
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+		{
+			LOG_ERROR() << " - Error '" << std::strerror(errno) << '(' << errno << ')' << "'\n";
+			finishTransfer("446 Transfer failed");
+			return;
+		}
+
+		if (received != 0)
+		{
+			break;
+		}
+
+		auto self(shared_from_this());
+		_dataSocket.async_wait(tcp::socket::wait_read,
+			asio::bind_executor(_strand, [this, self](std::error_code ec)
+			{
+				if (ec)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+					finishTransfer("446 Transfer failed");
+					return;
+				}
+				spliceFile();
+			}));
+		return;
+	}
+
+	drainPipe(received, [this]() { spliceFile(); });
+}
+
+// Moves 'amount' bytes from the pipe to the file at _fileOffset by the
+// server's file I/O, 'next' is called when all of them are written.
+void FTPSession::drainPipe(std::size_t amount, std::function<void()> next)
+{
+	if (amount == 0)
+	{
+		next();
+		return;
+	}
+
+	auto self(shared_from_this());
+	_server.getFileIO().splice(_pipe[0], _fileFd, amount, _fileOffset, [this, self, amount, next](ssize_t n)
+		{
+			asio::post(_strand, [this, self, amount, next, n]()
+				{
+					_transferStats._syscalls++;
+					if (n <= 0)
+					{
+						LOG_ERROR() << " - Error 'Could not write file: " << std::strerror(n < 0 ? -n : EIO) << "'\n";
+						finishTransfer("446 Transfer failed");
+						return;
+					}
+					_fileOffset += n;
+					drainPipe(amount - n, next);
+				});
+		});
+}
+
+void FTPSession::readFile()
+{
+	touch();
+	if (_recvBuffer.empty())
+	{
+		_recvBuffer.resize(RECV_BUFFER_SIZE);
+	}
+
+	auto self(shared_from_this());
+	_dataSocket.async_read_some(asio::buffer(_recvBuffer),
+		asio::bind_executor(_strand, [this, self](std::error_code ec, std::size_t n)
+		{
+			_transferStats._syscalls++;
+			if (ec == asio::error::eof)
+			{
+				if (_transferMode == TransferMode_Deflate && !_zstream.ended())
+				{
+					LOG_ERROR() << " - Error 'Compressed stream is truncated'\n";
+					finishTransfer("446 Transfer failed");
+					return;
+				}
+				finishTransfer("226 The file transferred successfully, closing data connection");
+				return;
+			}
+
+			if (ec)
+			{
+				LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				finishTransfer("446 Transfer failed");
+				return;
+			}
+
+			_transferStats._bytes += n;
+			if (_transferMode == TransferMode_Deflate)
+			{
+				_zstream.setInput(_recvBuffer.data(), n);
+				writeInflated();
+				return;
+			}
+
+			std::size_t length = n;
+			if (_transferType == TransferType_ASCII)
+			{
+				length = line_endings::stripCr(_recvBuffer.data(), n);
+			}
+			writeFile(_recvBuffer.data(), length, [this]() { readFile(); });
+		}));
+}
+
+// Writes to the file at _fileOffset by the server's file I/O, 'next' is
+// called when all of it is written. A failure finishes the transfer.
+void FTPSession::writeFile(const char* data, std::size_t amount, std::function<void()> next)
+{
+	if (amount == 0)
+	{
+		next();
+		return;
+	}
+
+	auto self(shared_from_this());
+	_server.getFileIO().write(_fileFd, data, amount, _fileOffset, [this, self, data, amount, next](ssize_t n)
+		{
+			asio::post(_strand, [this, self, data, amount, next, n]()
+				{
+					_transferStats._syscalls++;
+					if (n <= 0)
+					{
+						LOG_ERROR() << " - Error 'Could not write file: " << std::strerror(n < 0 ? -n : EIO) << "'\n";
+						finishTransfer("446 Transfer failed");
+						return;
+					}
+					_fileOffset += n;
+					writeFile(data + n, amount - n, next);
+				});
+		});
+}
+
+// The checksum is computed by the server's pool, the commands wait for it.
+void FTPSession::computeChecksum(const std::string& path, FileChecksums::Algorithm algorithm, std::uint64_t first,
+	std::int64_t last, std::function<std::string(const FileChecksums::Result&)> reply)
+{
+	suspendCommands();
+
+	auto self(shared_from_this());
+	const auto started = std::chrono::steady_clock::now();
+	_server.getChecksums().compute(path, algorithm, first, last,
+		[this, self, path, algorithm, started, reply](const FileChecksums::Result& result)
+		{
+			asio::post(_strand,
+				[this, self, path, algorithm, started, reply, result]()
+				{
+					if (_closed)
+					{
+						return;
+					}
+
+					if (result._error != 0)
+					{
+						LOG_ERROR() << " - Error 'Could not compute checksum of '" << path << "': "
+							<< std::strerror(result._error) << "'\n";
+						sendMessageToClient(result._error == EINVAL ? "501 Invalid range" : "550 Could not compute checksum");
+					}
+					else
+					{
+						const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+							std::chrono::steady_clock::now() - started);
+						LOG_INFO() << " - " << FileChecksums::algorithmName(algorithm) << " of '" << path << "' ("
+							<< result._length << " bytes) " << (result._cached ? "cached" : "computed")
+							<< " in " << elapsed.count() << " ms\n";
+						sendMessageToClient(reply(result));
+					}
+					touch();
+					resumeCommands();
+				});
+		});
+}
+
+void FTPSession::startTransferStats(const char* command, const char* method)
+{
+	_transferStats._command = command;
+	_transferStats._method = method;
+	_transferStats._bytes = 0;
+	_transferStats._syscalls = 0;
+	_transferStats._started = std::chrono::steady_clock::now();
+}
+
+void FTPSession::finishTransfer(const std::string& msg)
+{
+	if (_reader)
+	{
+		_reader->stop();
+	}
+	_adviseEnd = 0;
+	_dropBehind = false;
+
+	if (_fileFd != -1)
+	{
+		::close(_fileFd);
+		_fileFd = -1;
+	}
+
+	if (_zcopyFd != -1)
+	{
+		// the transfer isn't complete, so isn't the copy
+		::close(_zcopyFd);
+		_zcopyFd = -1;
+		_server.getCompressedFiles().discard(_zcopyPath);
+	}
+
+	_listingReader.close();
+	_listing.reset();
+	_content.reset();
+
+	if (_transferStats._command != nullptr)
+	{
+		const auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - _transferStats._started);
+		const std::uint64_t rate = _transferStats._bytes * 1000 / std::max<std::int64_t>(duration.count(), 1) / 1024;
+		LOG_INFO() << " - " << _transferStats._command << ": " << _transferStats._bytes << " bytes in "
+			<< duration.count() << " ms (" << rate << " KB/s), " << _transferStats._syscalls << " syscalls ("
+			<< _transferStats._method << ")\n";
+		_transferStats._command = nullptr;
+	}
+
+	// what is left of the grant doesn't pass to the next transfer
+	_granted = 0;
+
+	if (_dataTimedOut)
+	{
+		_dataTimedOut = false;
+		sendMessageToClient("426 Data connection is idle, transfer aborted");
+	}
+	else if (!msg.empty())
+	{
+		sendMessageToClient(msg);
+	}
+
+	touch();
+	closeDataConnection();
+	resumeCommands();
+}
+
+// Checks whether a transfer command may be executed right now. If the passive
+// data connection isn't accepted yet, the command is deferred until it is.
+bool FTPSession::dataConnectionReady(void (FTPSession::*handler)(const std::string&), const std::string& args)
+{
+	if (_dataSocket.is_open())
+	{
+		return true;
+	}
+
+	if (_acceptor.is_open())
+	{
+		_deferredCommand = std::bind(handler, this, args);
+		suspendCommands();
+		return false;
+	}
+
+	sendMessageToClient("425 No data connection");
+	return false;
+}
+
+void FTPSession::openDataConnectionActive(const std::string& addr, std::uint16_t port)
+{
+	tcp::endpoint ep(asio::ip::make_address(addr), port);
+
+	suspendCommands();
+	auto self(shared_from_this());
+	_dataSocket.async_connect(ep,
+		asio::bind_executor(_strand, [this, self](std::error_code ec)
+		{
+			if (ec)
+			{
+				LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				LOG_ERROR() << " - Error 'Could not open data connection (active mode)'\n";
+				std::error_code ignored;
+				_dataSocket.close(ignored);
+			}
+			else
+			{
+				sendMessageToClient("200 PORT command successful");
+			}
+			resumeCommands();
+		}));
+}
+
+// Takes a free port of the server's pool, returns 0 on failure.
+// Ports which appear to be busy by somebody else are skipped.
+std::uint16_t FTPSession::openDataConnectionPassive()
+{
+	if (_dataSocket.is_open())
+	{
+		LOG_ERROR() << " Error - Could not open passive data connection, because data socket still opened.\n";
+		return 0;
+	}
+
+	// repeated PASV replaces the previous listening port
+	closePassiveAcceptor();
+
+	PassivePortPool& ports = _server.getPassivePorts();
+	for (unsigned attempt = 0; attempt < PASSIVE_BIND_ATTEMPTS; attempt++)
+	{
+		const std::uint16_t port = ports.acquire();
+		if (port == 0)
+		{
+			LOG_ERROR() << " Error - All passive ports are busy.\n";
+			return 0;
+		}
+
+		std::error_code ec;
+		_acceptor.open(tcp::v4(), ec);
+		if (!ec)
+		{
+			_acceptor.set_option(tcp::socket::reuse_address(true), ec);
+		}
+		if (!ec)
+		{
+			_acceptor.bind(tcp::endpoint(tcp::v4(), port), ec);
+		}
+		if (!ec)
+		{
+			_acceptor.listen(asio::socket_base::max_listen_connections, ec);
+		}
+
+		if (!ec)
+		{
+			_passivePort = port;
+			acceptDataConnection();
+
+			auto self(shared_from_this());
+			_acceptTimer.expires_after(PASSIVE_ACCEPT_TIMEOUT);
+			_acceptTimer.async_wait(asio::bind_executor(_strand, [this, self](std::error_code ec)
+				{
+					if (!ec && _acceptor.is_open())
+					{
+						LOG_ERROR() << " Error - Passive data connection isn't established in time.\n";
+						closePassiveAcceptor();
+					}
+				}));
+			return port;
+		}
+
+		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+		_acceptor.close(ec);
+		ports.release(port);
+	}
+
+	return 0;
+}
+
+void FTPSession::acceptDataConnection()
+{
+	auto self(shared_from_this());
+	const std::uint16_t port = _passivePort;
+	_acceptor.async_accept(_dataSocket, _dataPeer,
+		asio::bind_executor(_strand, [this, self, port](std::error_code ec)
+		{
+			if (!ec)
+			{
+				// don't let anybody else to steal the data connection
+				std::error_code ignored;
+				const tcp::endpoint ctrlPeer(_ctrlSocket.remote_endpoint(ignored));
+				if (_dataPeer.address() != ctrlPeer.address())
+				{
+					LOG_ERROR() << " Error - Data connection from " << _dataPeer.address()
+						<< " while the client is " << ctrlPeer.address() << ", rejected.\n";
+					_dataSocket.close(ignored);
+					acceptDataConnection();
+					return;
+				}
+			}
+
+			if (port == _passivePort)
+			{
+				closePassiveAcceptor();
+			}
+
+			if (ec && ec != asio::error::operation_aborted)
+			{
+				LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+			}
+
+			if (_deferredCommand)
+			{
+				std::function<void ()> command(std::move(_deferredCommand));
+				_deferredCommand = nullptr;
+				if (ec)
+				{
+					sendMessageToClient("425 No data connection");
+					resumeCommands();
+					return;
+				}
+
+				_commandPending = false;
+				try
+				{
+					command();
+				}
+				catch (const std::exception& ex)
+				{
+					LOG_ERROR() << " - Exception '" << ex.what() << "'\n";
+					close();
+					return;
+				}
+
+				if (!_commandPending)
+				{
+					readCommand();
+				}
+			}
+		}));
+}
+
+void FTPSession::closeDataConnection()
+{
+	closePassiveAcceptor();
+	if (!_dataSocket.is_open())
+	{
+		return;
+	}
+
+	std::error_code ec;
+
+	_dataSocket.shutdown(asio::ip::tcp::socket::shutdown_both, ec);
+	if (ec)
+	{
+		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+	}
+
+	_dataSocket.close(ec);
+	if (ec)
+	{
+		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+	}
+}
+
+void FTPSession::closePassiveAcceptor()
+{
+	if (!_acceptor.is_open())
+	{
+		return;
+	}
+
+	std::error_code ec;
+	_acceptor.close(ec);
+	if (ec)
+	{
+		LOG_ERROR() << " Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+	}
+
+	_acceptTimer.cancel(ec);
+	_server.getPassivePorts().release(_passivePort);
+	_passivePort = 0;
+}
+
+std::string FTPSession::parseExtendedArguments(const std::string& args)
+{
+	return args;
+}
+
+bool FTPSession::parseOffset(const std::string& arg, std::uint64_t& offset)
+{
+	if (arg.empty() || arg.length() > 18)
+	{
+		return false;
+	}
+
+	offset = 0;
+	for (const char c : arg)
+	{
+		if (c < '0' || c > '9')
+		{
+			return false;
+		}
+		offset = offset * 10 + (c - '0');
+	}
+	return true;
+}
+
+// The path may be enclosed in quotes to be followed by other arguments, which
+// are returned in 'rest'. Without quotes all of the arguments are the path.
+std::string FTPSession::parseQuotedPath(const std::string& args, std::string& rest)
+{
+	rest.clear();
+	if (args.empty() || args[0] != '"')
+	{
+		return args;
+	}
+
+	const std::size_t quote = args.find('"', 1);
+	if (quote == std::string::npos)
+	{
+		return std::string();
+	}
+
+	const std::size_t p = args.find_first_not_of(' ', quote + 1);
+	if (p != std::string::npos)
+	{
+		rest = args.substr(p);
+	}
+	return args.substr(1, quote - 1);
+}
+
+bool FTPSession::isAlnumName(const std::string& name)
+{
+	if (name.empty())
+	{
+		return false;
+	}
+
+	for (const char c : name)
+	{
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// Renders one line of the listing, returns its length or 0 if it doesn't fit.
+std::size_t FTPSession::renderEntry(const DirectoryReader::Entry& entry, DirectoryListingCache::Format format,
+	char* out, std::size_t size)
+{
+	const struct statx& stx = entry._stx;
+	int n = 0;
+	if (format == DirectoryListingCache::Format_Machine)
+	{
+		char facts[MAX_LISTING_ENTRY_LENGTH];
+		renderFacts(stx, facts, sizeof(facts));
+		n = std::snprintf(out, size, "%s %s\r\n", facts, entry._name);
+	}
+	else
+	{
+		const std::time_t mtime = stx.stx_mtime.tv_sec;
+		std::tm tm;
+		gmtime_r(&mtime, &tm);
+		char modify[64];
+		std::strftime(modify, sizeof(modify), "%c %Z", &tm);
+
+		if (S_ISREG(stx.stx_mode))
+		{
+			n = std::snprintf(out, size, "%016llu\t%s\t%s\r\n",
+				static_cast<unsigned long long>(stx.stx_size), modify, entry._name);
+		}
+		else if (S_ISDIR(stx.stx_mode))
+		{
+			n = std::snprintf(out, size, " -- directory    \t%s\t%s\r\n", modify, entry._name);
+		}
+		else
+		{
+			n = std::snprintf(out, size, "                \t%s\t%s\r\n", modify, entry._name);
+		}
+	}
+
+	return n > 0 && static_cast<std::size_t>(n) < size ? n : 0;
+}
+
+// RFC 3659 facts of MLSD and MLST, each one is terminated by ';'.
+void FTPSession::renderFacts(const struct statx& stx, char* out, std::size_t size)
+{
+	const char* type = "OS.unix=other";
+	if (S_ISREG(stx.stx_mode))
+	{
+		type = "file";
+	}
+	else if (S_ISDIR(stx.stx_mode))
+	{
+		type = "dir";
+	}
+
+	char modify[16];
+	formatTime(stx.stx_mtime.tv_sec, modify, sizeof(modify));
+
+	std::snprintf(out, size, "type=%s;size=%llu;modify=%s;unique=%llxg%llx;", type,
+		static_cast<unsigned long long>(stx.stx_size), modify,
+		static_cast<unsigned long long>(makedev(stx.stx_dev_major, stx.stx_dev_minor)),
+		static_cast<unsigned long long>(stx.stx_ino));
+}
+
+// YYYYMMDDHHMMSS in UTC, as MDTM and the modify fact want it
+void FTPSession::formatTime(std::int64_t seconds, char* out, std::size_t size)
+{
+	const std::time_t t = seconds;
+	std::tm tm;
+	gmtime_r(&t, &tm);
+	std::strftime(out, size, "%Y%m%d%H%M%S", &tm);
 }
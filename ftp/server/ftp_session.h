@@ -2,16 +2,43 @@
 
 #include <cstdint>
 
+#include <sys/types.h>
+
+#include <array>
+#include <chrono>
+#include <deque>
 #include <experimental/filesystem>
-#include <list>
-#include <thread>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
 
 #include <asio.hpp>
 
+#include "bandwidth_shaper.h"
+#include "directory_listing_cache.h"
+#include "directory_reader.h"
+#include "file_checksums.h"
+#include "file_content_cache.h"
+#include "file_read_ahead.h"
+#include "line_framer.h"
+#include "zlib_stream.h"
+
 
 using asio::ip::tcp;
 
-class FTPSession final
+class FTPServer;
+
+/*
+ The session is a state machine driven by completion handlers. All of them
+ are dispatched through the session's strand, so the session may be served
+ by any thread of the server's pool and never needs a lock.
+ Commands are processed one by one: the next command is read when the
+ current one is completed. A command which waits for the data connection
+ or transfers data holds the command loop until it's done.
+ */
+class FTPSession final : public std::enable_shared_from_this<FTPSession>
 {
 	enum TransferType
 	{
@@ -19,65 +46,246 @@ class FTPSession final
 		TransferType_Binary,
 	};
 
+	enum TransferMode
+	{
+		TransferMode_Stream,
+		TransferMode_Deflate,	// MODE Z
+	};
+
+	using Strand = asio::strand<asio::io_context::executor_type>;
+
+	struct TransferStats
+	{
+		const char* _command = nullptr;
+		const char* _method = nullptr;
+		std::uint64_t _bytes = 0;
+		std::uint64_t _syscalls = 0;
+		std::chrono::steady_clock::time_point _started;
+	};
 
 public:
-	FTPSession(tcp::socket ctrlSocket, std::uint16_t dataPort, const std::string& rootDir);
+	FTPSession(FTPServer& server, tcp::socket ctrlSocket, const std::string& rootDir);
 	~FTPSession();
 
 	FTPSession(const FTPSession&) = delete;
 	FTPSession& operator=(const FTPSession&) = delete;
 
 	void start();
+	void stop();
 
 private:
-	void worker();
+	using CommandHandler = void (FTPSession::*)(const std::string&);
+
+	struct Command
+	{
+		std::uint64_t _code = 0;
+		CommandHandler _handler = nullptr;
+		bool _beforeLogin = false;
+	};
+
+	static const unsigned COMMAND_TABLE_BITS = 6;
+	using CommandTable = std::array<Command, 1 << COMMAND_TABLE_BITS>;
+
+	static constexpr std::uint64_t commandCode(const char* name, std::size_t length);
+	static constexpr std::size_t commandSlot(std::uint64_t code);
+	static constexpr CommandTable makeCommandTable();
+
+	void readCommand();
+	void executeCommand(std::string_view cmd);
+	void suspendCommands();
+	void resumeCommands();
+
+	void touch();
+	void scheduleIdleCheck(std::chrono::milliseconds delay);
+	void checkIdle();
+	std::size_t memoryUsage() const;
 
 	void sendMessageToClient(const std::string& msg);
-	void sendAsciiDataToClient(const std::string& data);
-	bool sendDataToClient(const char* data, std::size_t amount);
-	void executeCommand(const std::string& cmd);
+	void writeMessages();
+	void close();
 
 	void handleCwd(const std::string& args);
 	void handleDele(const std::string& args);
-	void handleEpsv();
-	void handleFeat();
+	void handleEprt(const std::string& args);
+	void handleEpsv(const std::string& args);
+	void handleFeat(const std::string& args);
+	void handleHash(const std::string& args);
+	void handleMdtm(const std::string& args);
 	void handleMkd(const std::string& args);
+	void handleMlsd(const std::string& args);
+	void handleMlst(const std::string& args);
+	void handleMode(const std::string& args);
+	void handleOpts(const std::string& args);
 	void handleNlst(const std::string& args);
 	void handlePass(const std::string& args);
 	void handlePasv(const std::string& args);
 	void handlePort(const std::string& args);
-	void handlePwd();
-	void handleQuit();
+	void handlePwd(const std::string& args);
+	void handleQuit(const std::string& args);
+	void handleRang(const std::string& args);
+	void handleRest(const std::string& args);
 	void handleRetr(const std::string& args);
 	void handleRmd(const std::string& args);
-	void handleSyst();
+	void handleSite(const std::string& args);
+	void handleSize(const std::string& args);
+	void handleSyst(const std::string& args);
 	void handleStor(const std::string& args);
 	void handleType(const std::string& args);
 	void handleUser(const std::string& args);
+	void handleXcrc(const std::string& args);
+	void handleXsha256(const std::string& args);
 
-	bool openDataConnectionActive(const std::string& addr, std::uint16_t port);
-	bool openDataConnectionPassive(std::uint16_t port);
+	bool acquireBandwidth(std::function<void()> resume);
+	void startReadAdvice(off_t end);
+	void adviseReadAhead();
+	void sendFile();
+	bool retrieveCached(const std::string& path, off_t offset, off_t rangeEnd);
+	void sendContent();
+	void startReadAhead();
+	void sendFileText();
+	void sendText();
+	void retrieveDeflated(const std::string& path, off_t offset, off_t rangeEnd);
+	void sendFileDeflated();
+	void sendDeflated(bool finish, std::function<void()> next);
+	void writeInflated();
+	void commitCompressedCopy();
+	void sendListing();
+	void listDirectory(const std::string& args, DirectoryListingCache::Format format);
+	void sendDirectory();
+	void receiveFile();
+	void spliceFile();
+	void readFile();
+	void drainPipe(std::size_t amount, std::function<void()> next);
+	void writeFile(const char* data, std::size_t amount, std::function<void()> next);
+	void computeChecksum(const std::string& path, FileChecksums::Algorithm algorithm, std::uint64_t first, std::int64_t last,
+		std::function<std::string(const FileChecksums::Result&)> reply);
+	void startTransferStats(const char* command, const char* method);
+	void finishTransfer(const std::string& msg);
+
+	bool dataConnectionReady(void (FTPSession::*handler)(const std::string&), const std::string& args);
+	void openDataConnectionActive(const std::string& addr, std::uint16_t port);
+	std::uint16_t openDataConnectionPassive();
+	void acceptDataConnection();
 	void closeDataConnection();
+	void closePassiveAcceptor();
 	std::string parseExtendedArguments(const std::string& args);
+	static bool parseOffset(const std::string& arg, std::uint64_t& offset);
+	static std::string parseQuotedPath(const std::string& args, std::string& rest);
+	static bool isAlnumName(const std::string& name);
 
-	std::list<std::string> readDirectory(const std::string& dirName);
+	static std::size_t renderEntry(const DirectoryReader::Entry& entry, DirectoryListingCache::Format format,
+		char* out, std::size_t size);
+	static void renderFacts(const struct statx& stx, char* out, std::size_t size);
+	static void formatTime(std::int64_t seconds, char* out, std::size_t size);
 
 
 private:
+	static const std::size_t CTRL_BUFFER_SIZE = 8192;
+	static const std::size_t TRANSFER_CHUNK_SIZE = 1024 * 1024;
+	static const std::size_t RECV_BUFFER_SIZE = 256 * 1024;
+	static const std::size_t READAHEAD_WINDOW = 16 * 1024 * 1024;
+	static const std::size_t READAHEAD_STEP = 4 * 1024 * 1024;
+	static const std::size_t DROP_BEHIND_LAG = 8 * 1024 * 1024;
+	static const std::size_t DEFLATE_BUFFER_SIZE = 256 * 1024;
+	static const unsigned PASSIVE_BIND_ATTEMPTS = 8;
+	static const std::size_t LISTING_BLOCK_SIZE = 64 * 1024;
+	static const std::size_t LISTING_BLOCKS_COUNT = 4;
+	static const std::size_t MAX_LISTING_ENTRY_LENGTH = 512;
+	static const unsigned int MACHINE_LISTING_MASK = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO;
+	static constexpr std::chrono::seconds PASSIVE_ACCEPT_TIMEOUT{30};
+
+	FTPServer& _server;
 	tcp::socket _ctrlSocket;
-	std::uint16_t _dataPort;
 
-	asio::io_context _ioContext;
+	Strand _strand;
 	tcp::socket _dataSocket;
 	tcp::acceptor _acceptor;
+	tcp::endpoint _dataPeer;
+	asio::steady_timer _acceptTimer;
+	std::uint16_t _passivePort = 0;
 
 	std::experimental::filesystem::path _rootDir;
 	std::experimental::filesystem::path _currDir;
 
 	std::string _username;
+	bool _loggedIn = false;
 
+	// commands are parsed in place, the arguments of the current one are kept in _args;
+	// there's one read into the framer at most, _reading is set while it's outstanding
+	LineFramer _ctrlFramer;
+	std::string _args;
+	bool _reading = false;
+	std::deque<std::string> _messages;
+	bool _commandPending = false;
 	bool _quitCmdLoop = false;
+	bool _closed = false;
 	TransferType _transferType = TransferType_Binary;
+	TransferMode _transferMode = TransferMode_Stream;
+	int _compressionLevel;
+	FileChecksums::Algorithm _hashAlgorithm = FileChecksums::Algorithm_Sha256;
+
+	// command waiting for passive data connection to be accepted
+	std::function<void ()> _deferredCommand;
+
+	// ticks of the server's timing wheel
+	std::uint64_t _lastActivity = 0;
+	std::uint64_t _idleCheckGeneration = 0;
+	bool _dataTimedOut = false;
+
+	// binary RETR is served by sendfile() straight from the file descriptor,
+	// STOR moves data socket -> pipe -> file with splice() or, when splice
+	// isn't supported, goes through the receive buffer; the file side of STOR
+	// is done by the server's file I/O
+	int _fileFd = -1;
+	off_t _fileOffset = 0;
+	off_t _fileEnd = -1;
+
+	// the part of the file RETR has asked the kernel to load or to drop
+	off_t _adviseEnd = 0;
+	off_t _advisedOffset = 0;
+	off_t _droppedOffset = 0;
+	bool _dropBehind = false;
+
+	// set by REST or RANG for the next transfer, the end of range is inclusive
+	off_t _restartOffset = 0;
+	off_t _rangeEnd = -1;
+	int _pipe[2] = { -1, -1 };
+	bool _spliceSupported = true;
+	std::vector<char> _recvBuffer;
+	TransferStats _transferStats;
+
+	// the session's share of the server's bandwidth, opened by the first transfer;
+	// _granted bytes may be sent before the shaper has to be asked again
+	std::shared_ptr<BandwidthShaper::Flow> _flow;
+	std::size_t _granted = 0;
+	bool _waitingBandwidth = false;
+
+	// MODE Z stream and its output, the compressed copy being written for the cache
+	ZlibStream _zstream;
+	std::vector<char> _zbuffer;
+	int _zcopyFd = -1;
+	std::string _zcopyKey;
+	std::string _zcopyPath;
+
+	// binary RETR of a small file is sent from the server's cache of contents
+	FileContentCache::Content _content;
+	off_t _contentOffset = 0;
+	off_t _contentEnd = 0;
+
+	// ASCII and MODE Z RETR read the file ahead by the server's file I/O,
+	// the text of ASCII transfers is converted to CRLF into _textBuffer
+	std::shared_ptr<FileReadAhead> _reader;
+	std::vector<char> _textBuffer;
+	std::size_t _textOffset = 0;
+	std::size_t _textLength = 0;
 
-	std::thread _worker;
+	// cached listing being sent or the state of the directory being listed
+	std::shared_ptr<const std::string> _listing;
+	DirectoryReader _listingReader;
+	std::string _listingPath;
+	DirectoryListingCache::Format _listingFormat = DirectoryListingCache::Format_List;
+	std::uint64_t _listingGeneration = 0;
+	bool _listingWatched = false;
+	bool _listingFlushed = false;
+	std::vector<char> _listingBuffer;
 };
@@ -0,0 +1,223 @@
+#include "line_endings.h"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LINE_ENDINGS_X86
+#endif
+
+
+namespace
+{
+
+// Copies the bytes of a block between the line endings marked in 'mask'.
+inline char* expandBlock(const char* in, unsigned width, unsigned mask, char* out)
+{
+	unsigned start = 0;
+	while (mask != 0)
+	{
+		const unsigned lf = __builtin_ctz(mask);
+		std::memcpy(out, in + start, lf - start);
+		out += lf - start;
+		*out++ = '\r';
+		*out++ = '\n';
+		start = lf + 1;
+		mask &= mask - 1;
+	}
+	std::memcpy(out, in + start, width - start);
+	return out + width - start;
+}
+
+inline char* compactBlock(const char* in, unsigned width, unsigned mask, char* out)
+{
+	unsigned start = 0;
+	while (mask != 0)
+	{
+		const unsigned cr = __builtin_ctz(mask);
+		std::memmove(out, in + start, cr - start);
+		out += cr - start;
+		start = cr + 1;
+		mask &= mask - 1;
+	}
+	std::memmove(out, in + start, width - start);
+	return out + width - start;
+}
+
+char* toCrlfScalar(const char* in, const char* end, char* out)
+{
+	while (in != end)
+	{
+		const char* lf = static_cast<const char*>(std::memchr(in, '\n', end - in));
+		if (lf == nullptr)
+		{
+			std::memcpy(out, in, end - in);
+			return out + (end - in);
+		}
+
+		std::memcpy(out, in, lf - in);
+		out += lf - in;
+		*out++ = '\r';
+		*out++ = '\n';
+		in = lf + 1;
+	}
+	return out;
+}
+
+char* stripCrScalar(const char* in, const char* end, char* out)
+{
+	for (; in != end; in++)
+	{
+		if (*in != '\r')
+		{
+			*out++ = *in;
+		}
+	}
+	return out;
+}
+
+std::size_t toCrlfGeneric(const char* in, std::size_t size, char* out)
+{
+	return toCrlfScalar(in, in + size, out) - out;
+}
+
+std::size_t stripCrGeneric(char* data, std::size_t size)
+{
+	return stripCrScalar(data, data + size, data) - data;
+}
+
+#ifdef LINE_ENDINGS_X86
+
+// SSE2 is there on every x86-64 CPU
+
+__attribute__((target("sse2")))
+std::size_t toCrlfSse2(const char* in, std::size_t size, char* out)
+{
+	const __m128i lf = _mm_set1_epi8('\n');
+	const char* const end = in + size;
+	char* const begin = out;
+	for (; end - in >= 16; in += 16)
+	{
+		const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+		const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, lf));
+		if (mask == 0)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), block);
+			out += 16;
+			continue;
+		}
+		out = expandBlock(in, 16, mask, out);
+	}
+	return toCrlfScalar(in, end, out) - begin;
+}
+
+__attribute__((target("sse2")))
+std::size_t stripCrSse2(char* data, std::size_t size)
+{
+	const __m128i cr = _mm_set1_epi8('\r');
+	const char* in = data;
+	const char* const end = data + size;
+	char* out = data;
+	for (; end - in >= 16; in += 16)
+	{
+		// the store never runs ahead of the loaded block, so it may overlap it
+		const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+		const unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, cr));
+		if (mask == 0)
+		{
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out), block);
+			out += 16;
+			continue;
+		}
+		out = compactBlock(in, 16, mask, out);
+	}
+	return stripCrScalar(in, end, out) - data;
+}
+
+__attribute__((target("avx2")))
+std::size_t toCrlfAvx2(const char* in, std::size_t size, char* out)
+{
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const char* const end = in + size;
+	char* const begin = out;
+	for (; end - in >= 32; in += 32)
+	{
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, lf));
+		if (mask == 0)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), block);
+			out += 32;
+			continue;
+		}
+		out = expandBlock(in, 32, mask, out);
+	}
+	return toCrlfScalar(in, end, out) - begin;
+}
+
+__attribute__((target("avx2")))
+std::size_t stripCrAvx2(char* data, std::size_t size)
+{
+	const __m256i cr = _mm256_set1_epi8('\r');
+	const char* in = data;
+	const char* const end = data + size;
+	char* out = data;
+	for (; end - in >= 32; in += 32)
+	{
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+		const unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, cr));
+		if (mask == 0)
+		{
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(out), block);
+			out += 32;
+			continue;
+		}
+		out = compactBlock(in, 32, mask, out);
+	}
+	return stripCrScalar(in, end, out) - data;
+}
+
+#endif
+
+struct Kernels
+{
+	std::size_t (*_toCrlf)(const char*, std::size_t, char*) = toCrlfGeneric;
+	std::size_t (*_stripCr)(char*, std::size_t) = stripCrGeneric;
+
+	Kernels()
+	{
+#ifdef LINE_ENDINGS_X86
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx2"))
+		{
+			_toCrlf = toCrlfAvx2;
+			_stripCr = stripCrAvx2;
+		}
+		else if (__builtin_cpu_supports("sse2"))
+		{
+			_toCrlf = toCrlfSse2;
+			_stripCr = stripCrSse2;
+		}
+#endif
+	}
+};
+
+const Kernels kernels;
+
+}
+
+
+namespace line_endings
+{
+
+std::size_t toCrlf(const char* in, std::size_t size, char* out)
+{
+	return kernels._toCrlf(in, size, out);
+}
+
+std::size_t stripCr(char* data, std::size_t size)
+{
+	return kernels._stripCr(data, size);
+}
+
+}
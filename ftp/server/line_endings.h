@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+
+/*
+ Line ending conversion of ASCII mode transfers, done over whole blocks.
+ The kernels look for the line endings 32 (AVX2) or 16 (SSE2) bytes at a
+ time and copy the text between them in one go, the implementation is
+ chosen once by the features of the CPU. Other platforms get a scalar one.
+ */
+namespace line_endings
+{
+
+// Copies 'size' bytes from 'in' to 'out' with every LF replaced by CRLF,
+// 'out' has to hold 2 * size bytes. Returns the number of bytes written.
+std::size_t toCrlf(const char* in, std::size_t size, char* out);
+
+// Removes every CR in place, returns the new size.
+std::size_t stripCr(char* data, std::size_t size);
+
+}
@@ -0,0 +1,73 @@
+#include "line_framer.h"
+
+#include <cstring>
+
+
+LineFramer::LineFramer(std::size_t capacity)
+	: _capacity(capacity)
+	, _data(new char[capacity])
+{
+
+}
+
+asio::mutable_buffer LineFramer::prepare()
+{
+	if (_begin == _end)
+	{
+		_begin = _scanned = _end = 0;
+	}
+	else if (_end == _capacity)
+	{
+		if (_begin != 0)
+		{
+			std::memmove(_data.get(), _data.get() + _begin, _end - _begin);
+			_scanned -= _begin;
+			_end -= _begin;
+			_begin = 0;
+		}
+		else
+		{
+			// the whole buffer is a single line
+			_discarding = true;
+			_begin = _scanned = _end = 0;
+		}
+	}
+	return asio::buffer(_data.get() + _end, _capacity - _end);
+}
+
+void LineFramer::commit(std::size_t size)
+{
+	_end += size;
+}
+
+LineFramer::Status LineFramer::next(std::string_view& line)
+{
+	const char* lf = static_cast<const char*>(std::memchr(_data.get() + _scanned, '\n', _end - _scanned));
+	if (lf == nullptr)
+	{
+		_scanned = _end;
+		if (_discarding)
+		{
+			_begin = _scanned = _end = 0;
+		}
+		return Status_NeedMore;
+	}
+
+	const std::size_t lfOffset = lf - _data.get();
+	const std::size_t begin = _begin;
+	_begin = _scanned = lfOffset + 1;
+
+	if (_discarding)
+	{
+		_discarding = false;
+		return Status_Oversize;
+	}
+
+	std::size_t length = lfOffset - begin;
+	if (length != 0 && _data[lfOffset - 1] == '\r')
+	{
+		length--;
+	}
+	line = std::string_view(_data.get() + begin, length);
+	return Status_Line;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+
+#include <asio.hpp>
+
+
+/*
+ Splits the bytes of the control connection into command lines in a fixed
+ buffer. Lines are handed out as views into the buffer, several of them if
+ the client has pipelined the commands, and a view stays valid until the
+ next prepare(). Only the unfinished line at the end of the buffer is ever
+ moved, to the front, when the buffer runs out of space at its end.
+ A line which doesn't fit in the buffer is dropped up to its end and is
+ reported as too long.
+ */
+class LineFramer final
+{
+public:
+	enum Status
+	{
+		Status_Line,
+		Status_NeedMore,
+		Status_Oversize,
+	};
+
+public:
+	explicit LineFramer(std::size_t capacity);
+
+	LineFramer(const LineFramer&) = delete;
+	LineFramer& operator=(const LineFramer&) = delete;
+
+	// space to read the next bytes into and the number of bytes read
+	asio::mutable_buffer prepare();
+	void commit(std::size_t size);
+
+	// the next line without its CRLF (or bare LF)
+	Status next(std::string_view& line);
+
+	std::size_t capacity() const { return _capacity; }
+
+private:
+	const std::size_t _capacity;
+	std::unique_ptr<char[]> _data;
+	std::size_t _begin = 0;		// of the first line not handed out yet
+	std::size_t _scanned = 0;	// the bytes before have no LF
+	std::size_t _end = 0;
+	bool _discarding = false;
+};
@@ -2,9 +2,11 @@
 
 #include <iostream>
 #include <exception>
+#include <string>
 
 #include "log.h"
 #include "ftp_server.h"
+#include "users_db.h"
 
 
 static const std::uint16_t FTP_CONTROL_CONNECTION_PORT = 10021;
@@ -14,6 +16,13 @@ static const std::uint16_t FTP_CONTROL_CONNECTION_PORT = 10021;
 
 int main(int argc, char* argv[])
 {
+	// prints the line of the user for users-db.txt
+	if (argc == 4 && std::string(argv[1]) == "--hash-password")
+	{
+		std::cout << UsersDB::hashPassword(argv[2], argv[3]) << '\n';
+		return 0;
+	}
+
 	try
 	{
 		FTPServer ftpServer;
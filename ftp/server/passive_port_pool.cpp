@@ -0,0 +1,74 @@
+#include "passive_port_pool.h"
+
+#include <stdexcept>
+
+
+// the range is checked before the bitmap is sized and allocated from it
+static std::size_t wordsCount(std::uint16_t first, std::uint16_t last)
+{
+	if (first == 0 || last < first)
+	{
+		throw std::invalid_argument("PassivePortPool - invalid range of ports.");
+	}
+	return (static_cast<std::size_t>(last) - first + 64) / 64;
+}
+
+PassivePortPool::PassivePortPool(std::uint16_t first, std::uint16_t last)
+	: _first(first)
+	, _last(last)
+	, _wordsCount(wordsCount(first, last))
+	, _bitmap(new std::atomic<std::uint64_t>[_wordsCount])
+{
+	const std::size_t count = static_cast<std::size_t>(last) - first + 1;
+	for (std::size_t i = 0; i < _wordsCount; i++)
+	{
+		_bitmap[i].store(0, std::memory_order_relaxed);
+	}
+
+	// bits beyond the range are marked busy forever
+	if (count % 64 != 0)
+	{
+		_bitmap[_wordsCount - 1].store(~0ULL << (count % 64), std::memory_order_relaxed);
+	}
+}
+
+std::uint16_t PassivePortPool::acquire()
+{
+	const std::size_t start = _nextWord.fetch_add(1, std::memory_order_relaxed);
+	for (std::size_t i = 0; i < _wordsCount; i++)
+	{
+		const std::size_t w = (start + i) % _wordsCount;
+		std::uint64_t bits = _bitmap[w].load(std::memory_order_relaxed);
+		while (bits != ~0ULL)
+		{
+			const unsigned bit = __builtin_ctzll(~bits);
+			if (_bitmap[w].compare_exchange_weak(bits, bits | (1ULL << bit), std::memory_order_acquire, std::memory_order_relaxed))
+			{
+				return static_cast<std::uint16_t>(_first + w * 64 + bit);
+			}
+		}
+	}
+	return 0;
+}
+
+void PassivePortPool::release(std::uint16_t port)
+{
+	if (port < _first || port > _last)
+	{
+		return;
+	}
+
+	const std::size_t n = port - _first;
+	_bitmap[n / 64].fetch_and(~(1ULL << (n % 64)), std::memory_order_release);
+}
+
+std::size_t PassivePortPool::busyCount() const
+{
+	const std::size_t count = static_cast<std::size_t>(_last) - _first + 1;
+	std::size_t busy = 0;
+	for (std::size_t i = 0; i < _wordsCount; i++)
+	{
+		busy += __builtin_popcountll(_bitmap[i].load(std::memory_order_relaxed));
+	}
+	return busy - (_wordsCount * 64 - count);
+}
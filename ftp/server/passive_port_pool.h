@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+
+/*
+ Range of ports for passive data connections shared by all sessions.
+ A busy port is marked by a bit in the bitmap, ports are taken and
+ returned with atomic operations, so sessions on different threads
+ never wait for each other. Every search starts from the next word of
+ the bitmap, so concurrent sessions rarely contend for the same word.
+ */
+class PassivePortPool final
+{
+public:
+	PassivePortPool(std::uint16_t first, std::uint16_t last);
+	~PassivePortPool() = default;
+
+	PassivePortPool(const PassivePortPool&) = delete;
+	PassivePortPool& operator=(const PassivePortPool&) = delete;
+
+	// returns 0 if all ports are busy
+	std::uint16_t acquire();
+	void release(std::uint16_t port);
+
+	std::uint16_t first() const { return _first; }
+	std::uint16_t last() const { return _last; }
+	std::size_t busyCount() const;
+
+private:
+	const std::uint16_t _first;
+	const std::uint16_t _last;
+	const std::size_t _wordsCount;
+	std::unique_ptr<std::atomic<std::uint64_t>[]> _bitmap;
+	std::atomic<std::size_t> _nextWord{0};
+};
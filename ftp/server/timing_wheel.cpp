@@ -0,0 +1,112 @@
+#include "timing_wheel.h"
+#include "log.h"
+
+#include <algorithm>
+#include <iostream>
+
+
+TimingWheel::TimingWheel(asio::io_context& ioContext, std::chrono::milliseconds tick, std::size_t slotsCount)
+	: _tick(tick)
+	, _timer(ioContext)
+	, _slots(slotsCount)
+{
+
+}
+
+void TimingWheel::start()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_running = true;
+	}
+	_nextTick = std::chrono::steady_clock::now() + _tick;
+	wait();
+}
+
+void TimingWheel::stop()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_running = false;
+
+	std::error_code ec;
+	_timer.cancel(ec);
+	for (std::vector<Timer>& slot : _slots)
+	{
+		slot.clear();
+	}
+}
+
+void TimingWheel::schedule(std::chrono::milliseconds delay, Callback callback)
+{
+	// rounded up, the timer never fires early
+	const std::uint64_t ticks = std::max<std::uint64_t>(1, (delay.count() + _tick.count() - 1) / _tick.count());
+
+	std::lock_guard<std::mutex> lock(_mutex);
+	if (!_running)
+	{
+		return;
+	}
+
+	const std::size_t slot = (_cursor + ticks) % _slots.size();
+	_slots[slot].push_back(Timer{ (ticks - 1) / _slots.size(), std::move(callback) });
+}
+
+void TimingWheel::wait()
+{
+	_timer.expires_at(_nextTick);
+	_timer.async_wait([this](std::error_code ec)
+		{
+			if (ec)
+			{
+				if (ec != asio::error::operation_aborted)
+				{
+					LOG_ERROR() << " - Error '" << ec.message() << '(' << ec.value() << ')' << "'\n";
+				}
+				return;
+			}
+
+			advance();
+			_nextTick += _tick;
+			wait();
+		});
+}
+
+void TimingWheel::advance()
+{
+	std::vector<Callback> expired;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_running)
+		{
+			return;
+		}
+
+		_cursor = (_cursor + 1) % _slots.size();
+		_ticks.fetch_add(1, std::memory_order_relaxed);
+
+		std::vector<Timer>& slot = _slots[_cursor];
+		std::size_t kept = 0;
+		for (std::size_t i = 0; i < slot.size(); i++)
+		{
+			if (slot[i]._rounds == 0)
+			{
+				expired.push_back(std::move(slot[i]._callback));
+				continue;
+			}
+
+			slot[i]._rounds--;
+			if (kept != i)
+			{
+				slot[kept] = std::move(slot[i]);
+			}
+			kept++;
+		}
+		slot.erase(slot.begin() + kept, slot.end());
+	}
+
+	// the callbacks may schedule new timers
+	for (Callback& callback : expired)
+	{
+		callback();
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <asio.hpp>
+
+
+/*
+ Hashed timing wheel: a timer goes into the slot its expiration falls on,
+ timers further than one turn of the wheel wait there for several turns.
+ Scheduling is O(1) and a single steady_timer ticks for all of them, so
+ thousands of idle timeouts cost nothing while they aren't due.
+ Timers can't be cancelled. The users keep the time of their last activity
+ and decide in the callback whether the timeout has really expired, that
+ way frequent activity doesn't have to touch the wheel at all.
+ */
+class TimingWheel final
+{
+public:
+	using Callback = std::function<void()>;
+
+public:
+	TimingWheel(asio::io_context& ioContext, std::chrono::milliseconds tick, std::size_t slotsCount);
+
+	TimingWheel(const TimingWheel&) = delete;
+	TimingWheel& operator=(const TimingWheel&) = delete;
+
+	void start();
+	void stop();
+
+	// the callback is called on a thread of io_context, not before the delay expires
+	void schedule(std::chrono::milliseconds delay, Callback callback);
+
+	// the number of ticks since start()
+	std::uint64_t now() const { return _ticks.load(std::memory_order_relaxed); }
+	std::chrono::milliseconds tick() const { return _tick; }
+
+private:
+	struct Timer
+	{
+		std::uint64_t _rounds;
+		Callback _callback;
+	};
+
+	void wait();
+	void advance();
+
+private:
+	const std::chrono::milliseconds _tick;
+	asio::steady_timer _timer;
+	std::chrono::steady_clock::time_point _nextTick;
+	std::atomic<std::uint64_t> _ticks{0};
+
+	std::mutex _mutex;
+	std::vector<std::vector<Timer>> _slots;
+	std::size_t _cursor = 0;
+	bool _running = false;
+};
@@ -1,7 +1,90 @@
 #include "users_db.h"
+#include "log.h"
 
-#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+
+namespace
+{
+
+std::string toHex(const std::vector<unsigned char>& data)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(data.size() * 2, '0');
+	for (std::size_t i = 0; i < data.size(); i++)
+	{
+		hex[i * 2] = digits[data[i] >> 4];
+		hex[i * 2 + 1] = digits[data[i] & 0x0f];
+	}
+	return hex;
+}
+
+bool fromHex(const std::string& hex, std::vector<unsigned char>& data)
+{
+	if (hex.empty() || hex.length() % 2 != 0)
+	{
+		return false;
+	}
+
+	data.resize(hex.length() / 2);
+	for (std::size_t i = 0; i < hex.length(); i++)
+	{
+		const char c = hex[i];
+		int digit = 0;
+		if (c >= '0' && c <= '9')
+		{
+			digit = c - '0';
+		}
+		else if (c >= 'a' && c <= 'f')
+		{
+			digit = c - 'a' + 10;
+		}
+		else if (c >= 'A' && c <= 'F')
+		{
+			digit = c - 'A' + 10;
+		}
+		else
+		{
+			return false;
+		}
+		data[i / 2] = static_cast<unsigned char>((data[i / 2] << 4) | digit);
+	}
+	return true;
+}
+
+bool derive(const std::string& password, const std::vector<unsigned char>& salt, unsigned iterations,
+	std::vector<unsigned char>& hash)
+{
+	return PKCS5_PBKDF2_HMAC(password.data(), static_cast<int>(password.length()), salt.data(), static_cast<int>(salt.size()),
+		static_cast<int>(iterations), EVP_sha256(), static_cast<int>(hash.size()), hash.data()) == 1;
+}
+
+}
+
+
+const unsigned UsersDB::DEFAULT_ITERATIONS;
+const std::size_t UsersDB::SALT_SIZE;
+const std::size_t UsersDB::HASH_SIZE;
+
+UsersDB::UsersDB()
+{
+	auto table = std::make_shared<Table>();
+	makeDummy(*table);
+	_table = std::move(table);
+}
+
+UsersDB::~UsersDB()
+{
+	stop();
+}
 
 UsersDB& UsersDB::getInstance()
 {
@@ -11,21 +94,232 @@ UsersDB& UsersDB::getInstance()
 
 bool UsersDB::usernameIsKnown(const std::string& username) const
 {
-	return _usersWithPasswords.count(username) != 0;
+	const std::shared_ptr<const Table> table(std::atomic_load(&_table));
+	return table->_users.count(username) != 0;
+}
+
+void UsersDB::verifyPassword(const std::string& username, const std::string& password, Handler handler)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (!_stopping)
+		{
+			_requests.push_back(Request{ username, password, std::move(handler), std::chrono::steady_clock::now() });
+			_wakeup.notify_one();
+			return;
+		}
+	}
+
+	// nobody is going to verify it, the session must not wait forever
+	handler(false);
+}
+
+bool UsersDB::loadFromFile(const std::string& filename)
+{
+	std::lock_guard<std::mutex> lock(_fileMutex);
+	_filename = filename;
+
+	struct stat st;
+	std::ifstream file(filename);
+	if (!file || ::stat(filename.c_str(), &st) == -1)
+	{
+		LOG_ERROR() << " - Error 'Could not read users from '" << filename << "': " << std::strerror(errno) << "'\n";
+		return false;
+	}
+
+	auto table = std::make_shared<Table>();
+	std::string line;
+	std::size_t lineNumber = 0;
+	while (std::getline(file, line))
+	{
+		lineNumber++;
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		std::string username;
+		User user;
+		if (!parseRecord(line, username, user))
+		{
+			LOG_ERROR() << " - Error 'Invalid user record at " << filename << ':' << lineNumber << "'\n";
+			continue;
+		}
+		table->_users[username] = std::move(user);
+	}
+	makeDummy(*table);
+
+	_fileMtime = st.st_mtim;
+	LOG_INFO() << " - Users: " << table->_users.size() << " loaded from '" << filename << "'\n";
+	std::atomic_store(&_table, std::shared_ptr<const Table>(std::move(table)));
+	return true;
+}
+
+bool UsersDB::reloadIfModified()
+{
+	std::string filename;
+	{
+		std::lock_guard<std::mutex> lock(_fileMutex);
+		struct stat st;
+		if (_filename.empty() || ::stat(_filename.c_str(), &st) == -1
+			|| (st.st_mtim.tv_sec == _fileMtime.tv_sec && st.st_mtim.tv_nsec == _fileMtime.tv_nsec))
+		{
+			return false;
+		}
+		filename = _filename;
+	}
+	return loadFromFile(filename);
+}
+
+std::string UsersDB::hashPassword(const std::string& username, const std::string& password, unsigned iterations)
+{
+	std::vector<unsigned char> salt(SALT_SIZE);
+	std::vector<unsigned char> hash(HASH_SIZE);
+	if (RAND_bytes(salt.data(), static_cast<int>(salt.size())) != 1 || !derive(password, salt, iterations, hash))
+	{
+		return std::string();
+	}
+	return username + ":pbkdf2-sha256:" + std::to_string(iterations) + ':' + toHex(salt) + ':' + toHex(hash);
 }
 
-bool UsersDB::passwordIsValid(const std::string& username, const std::string& password) const
+void UsersDB::start()
 {
-	std::map<std::string, std::string>::const_iterator it = _usersWithPasswords.find(username);
-	if (it == _usersWithPasswords.cend())
+	std::lock_guard<std::mutex> lock(_mutex);
+	_stopping = false;
+	for (std::size_t i = 0; i < WORKERS_COUNT; i++)
 	{
-		throw std::logic_error("UsersDB could not check password - username is unknown.");
+		_workers.emplace_back(&UsersDB::worker, this);
 	}
-	return it->second == password;
 }
 
-void UsersDB::loadFromFile(const std::string& filename)
+void UsersDB::stop()
 {
-	// not implemented yet...
-	_usersWithPasswords["testuser"] = "testpassword";
+	std::deque<Request> requests;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stopping = true;
+		requests.swap(_requests);
+	}
+	_wakeup.notify_all();
+
+	for (std::thread& worker : _workers)
+	{
+		worker.join();
+	}
+	_workers.clear();
+
+	// queued requests are rejected, not dropped
+	for (Request& request : requests)
+	{
+		request._handler(false);
+	}
+}
+
+UsersDB::Stats UsersDB::getStats()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _stats;
+}
+
+// username:pbkdf2-sha256:iterations:salt:hash
+bool UsersDB::parseRecord(const std::string& line, std::string& username, User& user)
+{
+	std::vector<std::string> fields;
+	std::size_t begin = 0;
+	while (true)
+	{
+		const std::size_t p = line.find(':', begin);
+		fields.push_back(line.substr(begin, p - begin));
+		if (p == std::string::npos)
+		{
+			break;
+		}
+		begin = p + 1;
+	}
+
+	if (fields.size() != 5 || fields[0].empty() || fields[1] != "pbkdf2-sha256"
+		|| fields[2].empty() || fields[2].length() > 9
+		|| !std::all_of(fields[2].begin(), fields[2].end(), [](char c) { return c >= '0' && c <= '9'; }))
+	{
+		return false;
+	}
+
+	username = fields[0];
+	user._iterations = static_cast<unsigned>(std::stoul(fields[2]));
+	return user._iterations != 0 && fromHex(fields[3], user._salt) && fromHex(fields[4], user._hash);
+}
+
+// The hash of no password at all, it never matches. It takes the iterations
+// most of the users have, a user with other ones is reported, because the
+// time of its login tells whether the username exists.
+void UsersDB::makeDummy(Table& table)
+{
+	std::vector<unsigned> iterations;
+	iterations.reserve(table._users.size());
+	for (const auto& user : table._users)
+	{
+		iterations.push_back(user.second._iterations);
+	}
+
+	User& dummy = table._dummy;
+	dummy._iterations = DEFAULT_ITERATIONS;
+	if (!iterations.empty())
+	{
+		std::nth_element(iterations.begin(), iterations.begin() + iterations.size() / 2, iterations.end());
+		dummy._iterations = iterations[iterations.size() / 2];
+	}
+	dummy._salt.assign(SALT_SIZE, 0);
+	dummy._hash.assign(HASH_SIZE, 0);
+	RAND_bytes(dummy._salt.data(), static_cast<int>(dummy._salt.size()));
+
+	for (const auto& user : table._users)
+	{
+		if (user.second._iterations != dummy._iterations)
+		{
+			LOG_ERROR() << " - Error 'User '" << user.first << "' has " << user.second._iterations
+				<< " iterations instead of " << dummy._iterations << ", rehash the password'\n";
+		}
+	}
+}
+
+bool UsersDB::verify(const User& user, const std::string& password)
+{
+	std::vector<unsigned char> hash(user._hash.size());
+	return derive(password, user._salt, user._iterations, hash)
+		&& CRYPTO_memcmp(hash.data(), user._hash.data(), hash.size()) == 0;
+}
+
+void UsersDB::worker()
+{
+	while (true)
+	{
+		Request request;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wakeup.wait(lock, [this]() { return _stopping || !_requests.empty(); });
+			if (_stopping)
+			{
+				return;
+			}
+			request = std::move(_requests.front());
+			_requests.pop_front();
+		}
+
+		const std::shared_ptr<const Table> table(std::atomic_load(&_table));
+		const Users::const_iterator it = table->_users.find(request._username);
+		const bool known = it != table->_users.cend();
+		const bool valid = verify(known ? it->second : table->_dummy, request._password) && known;
+
+		const std::uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - request._queued).count();
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stats._verified++;
+			_stats._rejected += valid ? 0 : 1;
+			_stats._totalMicros += micros;
+			_stats._maxMicros = std::max(_stats._maxMicros, micros);
+		}
+
+		request._handler(valid);
+	}
 }
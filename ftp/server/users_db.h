@@ -1,26 +1,123 @@
 #pragma once
 
-#include <map>
+#include <sys/stat.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/*
+ Users and their salted PBKDF2-HMAC-SHA256 password hashes, loaded from
+ a file of lines
+
+   username:pbkdf2-sha256:iterations:salt:hash
 
+ with the salt and the hash in hex, such a line is made by hashPassword().
+ The table is an immutable snapshot, a reload builds a new one and swaps
+ it in, so lookups never take a lock. The hashing is slow on purpose and
+ is done by a small pool of threads, not by the threads of the sessions.
+ Unknown users are checked against a dummy record with the median number
+ of iterations of the table, so they take as long to be rejected as a
+ wrong password of a typical user.
+ */
 class UsersDB final
 {
 public:
-	~UsersDB() = default;
+	using Handler = std::function<void(bool)>;
+
+	struct Stats
+	{
+		std::uint64_t _verified = 0;
+		std::uint64_t _rejected = 0;
+		std::uint64_t _totalMicros = 0;		// from the request to the result
+		std::uint64_t _maxMicros = 0;
+	};
+
+public:
+	~UsersDB();
 	UsersDB(const UsersDB&) = delete;
 	const UsersDB& operator=(const UsersDB&) = delete;
 
 private:
-	UsersDB() = default;	
+	UsersDB();
 
 public:
 	static UsersDB& getInstance();
 
 	bool usernameIsKnown(const std::string& username) const;
-	bool passwordIsValid(const std::string& username, const std::string& password) const;
 
-	void loadFromFile(const std::string& filename);
+	// The handler is called by a thread of the pool. After stop() it's called
+	// with false: right away for new requests, by stop() for queued ones.
+	void verifyPassword(const std::string& username, const std::string& password, Handler handler);
+
+	// returns false and keeps the current users if the file couldn't be read
+	bool loadFromFile(const std::string& filename);
+	// loads the file again if it's been modified since
+	bool reloadIfModified();
+
+	static std::string hashPassword(const std::string& username, const std::string& password,
+		unsigned iterations = DEFAULT_ITERATIONS);
+
+	void start();
+	void stop();
+
+	Stats getStats();
 
 private:
-	std::map<std::string, std::string> _usersWithPasswords;
-};
\ No newline at end of file
+	struct User
+	{
+		unsigned _iterations = 0;
+		std::vector<unsigned char> _salt;
+		std::vector<unsigned char> _hash;
+	};
+
+	using Users = std::unordered_map<std::string, User>;
+
+	struct Table
+	{
+		Users _users;
+		User _dummy;
+	};
+
+	struct Request
+	{
+		std::string _username;
+		std::string _password;
+		Handler _handler;
+		std::chrono::steady_clock::time_point _queued;
+	};
+
+	static bool parseRecord(const std::string& line, std::string& username, User& user);
+	static void makeDummy(Table& table);
+	static bool verify(const User& user, const std::string& password);
+	void worker();
+
+private:
+	static const unsigned DEFAULT_ITERATIONS = 100000;
+	static const std::size_t SALT_SIZE = 16;
+	static const std::size_t HASH_SIZE = 32;
+	static const std::size_t WORKERS_COUNT = 2;
+
+	// read by std::atomic_load, replaced by std::atomic_store
+	std::shared_ptr<const Table> _table;
+
+	std::mutex _fileMutex;
+	std::string _filename;
+	struct timespec _fileMtime = {};
+
+	std::mutex _mutex;
+	std::condition_variable _wakeup;
+	std::deque<Request> _requests;
+	std::vector<std::thread> _workers;
+	bool _stopping = false;
+	Stats _stats;
+};
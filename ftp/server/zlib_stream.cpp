@@ -0,0 +1,89 @@
+#include "zlib_stream.h"
+
+#include <cstring>
+
+
+ZlibStream::ZlibStream()
+{
+	std::memset(&_stream, 0, sizeof(_stream));
+}
+
+ZlibStream::~ZlibStream()
+{
+	end();
+}
+
+bool ZlibStream::start(Direction direction, int level)
+{
+	_ended = false;
+
+	if (_initialized && direction == _direction && (direction == Direction_Inflate || level == _level))
+	{
+		return (direction == Direction_Deflate ? ::deflateReset(&_stream) : ::inflateReset(&_stream)) == Z_OK;
+	}
+
+	end();
+
+	_direction = direction;
+	_level = level;
+	const int rc = direction == Direction_Deflate ? ::deflateInit(&_stream, level) : ::inflateInit(&_stream);
+	_initialized = (rc == Z_OK);
+	return _initialized;
+}
+
+void ZlibStream::end()
+{
+	if (_initialized)
+	{
+		if (_direction == Direction_Deflate)
+		{
+			::deflateEnd(&_stream);
+		}
+		else
+		{
+			::inflateEnd(&_stream);
+		}
+		_initialized = false;
+	}
+	std::memset(&_stream, 0, sizeof(_stream));
+}
+
+void ZlibStream::setInput(const char* data, std::size_t length)
+{
+	_stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+	_stream.avail_in = static_cast<uInt>(length);
+}
+
+long ZlibStream::process(char* out, std::size_t size, bool finish)
+{
+	if (_ended)
+	{
+		// the data after the end of the stream is ignored
+		_stream.avail_in = 0;
+		return 0;
+	}
+
+	_stream.next_out = reinterpret_cast<Bytef*>(out);
+	_stream.avail_out = static_cast<uInt>(size);
+
+	int rc = Z_OK;
+	if (_direction == Direction_Deflate)
+	{
+		rc = ::deflate(&_stream, finish ? Z_FINISH : Z_NO_FLUSH);
+	}
+	else
+	{
+		rc = ::inflate(&_stream, Z_NO_FLUSH);
+	}
+
+	if (rc == Z_STREAM_END)
+	{
+		_ended = true;
+	}
+	else if (rc != Z_OK && rc != Z_BUF_ERROR)
+	{
+		return -1;
+	}
+
+	return static_cast<long>(size - _stream.avail_out);
+}
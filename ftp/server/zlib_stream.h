@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstddef>
+
+#include <zlib.h>
+
+
+/*
+ Thin wrapper of a zlib stream used by MODE Z transfers. The stream is
+ initialized on the first transfer and reset for the next ones, so its
+ memory (about 256 KB for deflate, 44 KB for inflate) is allocated once
+ per session and doesn't depend on the amount of data.
+ */
+class ZlibStream final
+{
+public:
+	enum Direction
+	{
+		Direction_Deflate,
+		Direction_Inflate
+	};
+
+public:
+	ZlibStream();
+	~ZlibStream();
+
+	ZlibStream(const ZlibStream&) = delete;
+	ZlibStream& operator=(const ZlibStream&) = delete;
+
+	// starts a new stream, level is used by deflate only
+	bool start(Direction direction, int level);
+	void end();
+
+	// the input has to stay valid until it's consumed
+	void setInput(const char* data, std::size_t length);
+	bool needsInput() const { return _stream.avail_in == 0; }
+	bool ended() const { return _ended; }
+
+	// Fills the output with as much as the input gives, with 'finish' the stream
+	// is completed once the input is consumed. Returns the number of bytes put
+	// into the output, or -1 on error (the input isn't a valid zlib stream).
+	long process(char* out, std::size_t size, bool finish);
+
+private:
+	z_stream _stream;
+	bool _initialized = false;
+	bool _ended = false;
+	Direction _direction = Direction_Deflate;
+	int _level = Z_DEFAULT_COMPRESSION;
+};